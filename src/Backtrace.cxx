@@ -0,0 +1,261 @@
+/** \file Backtrace.cxx
+    \brief Implementation of backtraces of error messages.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
+
+#include "st_stream/Backtrace.h"
+#include "st_stream/Deferred.h"
+#include "st_stream/Stream.h"
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  using namespace st_stream;
+
+  // Deepest call path captured.
+  const int s_max_depth = 32;
+
+  // Backtraces are written this long after they are captured, by which time their errors have normally been written.
+  const std::chrono::milliseconds s_delay(50);
+
+  std::atomic<int> s_mode(eNoBacktraces);
+
+  // Number of the last backtrace captured.
+  std::atomic<unsigned long long> s_last_seq(0);
+
+  /** \brief A captured call path, with what is needed to write it.
+  */
+  struct Record {
+    unsigned long long m_seq;
+    void * m_address[s_max_depth];
+    int m_depth;
+    BacktraceMode m_mode;
+    std::string m_prefix;
+  };
+
+  /** \brief Queue of captured backtraces, and the background thread which writes them.
+  */
+  class Symbolizer {
+    public:
+      static Symbolizer & instance();
+
+      void push(Record & record);
+
+      void drain(bool write_deferred);
+
+    private:
+      static Symbolizer * create();
+
+      static void flushAtExit();
+
+      static void prepareFork();
+
+      static void parentFork();
+
+      static void childFork();
+
+      Symbolizer();
+
+      void run();
+
+      void stop();
+
+      std::mutex m_write_mutex;
+      std::mutex m_mutex;
+      std::condition_variable m_cond;
+      std::deque<Record> m_queue;
+      std::thread m_thread;
+      bool m_started;
+      bool m_stop;
+  };
+
+  Symbolizer & Symbolizer::instance() {
+    // Never destroyed, so that errors reported during static destruction can still be queued.
+    static Symbolizer * s_symbolizer = create();
+    return *s_symbolizer;
+  }
+
+  void Symbolizer::push(Record & record) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_queue.push_back(Record());
+      std::swap(m_queue.back(), record);
+      if (!m_started && !m_stop) {
+        m_thread = std::thread(&Symbolizer::run, this);
+        m_started = true;
+      }
+    }
+    m_cond.notify_all();
+  }
+
+  void Symbolizer::drain(bool write_deferred) {
+    // Backtraces are taken and written under one lock, so that the background thread and callers of FlushBacktraces
+    // write them in order. The SinkLock is taken first, as by every fork handler, so that a fork cannot wait for
+    // this thread while this thread waits for the SinkLock.
+    SinkLock sink_lock;
+    // Errors deferred before their backtraces were captured are written first.
+    if (write_deferred) FlushDeferred();
+    std::lock_guard<std::mutex> write_lock(m_write_mutex);
+    std::deque<Record> queue;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      queue.swap(m_queue);
+    }
+    if (queue.empty()) return;
+
+    std::ostringstream text;
+    for (std::deque<Record>::iterator itor = queue.begin(); itor != queue.end(); ++itor) {
+      text << itor->m_prefix << "backtrace " << itor->m_seq << ":\n";
+      for (int ii = 0; ii != itor->m_depth; ++ii) {
+        text << "  #" << ii << ' ';
+        Dl_info info;
+        // A return address is just past its call, so look up the byte before it, which is in the calling function.
+        char * address = static_cast<char *>(itor->m_address[ii]) - 1;
+        if (0 == dladdr(address, &info) || 0 == info.dli_fname) {
+          text << itor->m_address[ii] << '\n';
+          continue;
+        }
+        if (eSymbolizedBacktraces == itor->m_mode) {
+          if (0 != info.dli_sname) {
+            int status = -1;
+            char * name = abi::__cxa_demangle(info.dli_sname, 0, 0, &status);
+            text << (0 == status ? name : info.dli_sname) << "+0x" << std::hex << address + 1 -
+              static_cast<char *>(info.dli_saddr) << std::dec << ' ';
+            std::free(name);
+          } else {
+            text << "?? ";
+          }
+        }
+        text << '(' << info.dli_fname << "+0x" << std::hex << address + 1 - static_cast<char *>(info.dli_fbase) <<
+          std::dec << ")\n";
+      }
+    }
+
+    sterr << text.str() << std::flush;
+  }
+
+  Symbolizer * Symbolizer::create() {
+    Symbolizer * symbolizer = new Symbolizer;
+    std::atexit(flushAtExit);
+    pthread_atfork(prepareFork, parentFork, childFork);
+    return symbolizer;
+  }
+
+  void Symbolizer::flushAtExit() {
+    // Stop the background thread before static objects it may use are destroyed, then write what is left.
+    Symbolizer & symbolizer(instance());
+    symbolizer.stop();
+    symbolizer.drain(true);
+  }
+
+  void Symbolizer::prepareFork() {
+    // Write what has been captured, then keep more from being queued or written until the fork is done.
+    Symbolizer & symbolizer(instance());
+    SinkLock::prepareFork();
+    // Deferred output is written by its own handler, which may already hold the locks of the deferred log.
+    symbolizer.drain(false);
+    symbolizer.m_write_mutex.lock();
+    symbolizer.m_mutex.lock();
+  }
+
+  void Symbolizer::parentFork() {
+    Symbolizer & symbolizer(instance());
+    symbolizer.m_mutex.unlock();
+    symbolizer.m_write_mutex.unlock();
+    SinkLock::parentFork();
+  }
+
+  void Symbolizer::childFork() {
+    // Nothing can have been queued since the drain in prepareFork. The background thread does not exist in the
+    // child; as in the deferred log, the objects it was using are replaced rather than destroyed, and a new thread
+    // is started when the next backtrace is captured.
+    Symbolizer & symbolizer(instance());
+    symbolizer.m_mutex.unlock();
+    symbolizer.m_write_mutex.unlock();
+    new (&symbolizer.m_cond) std::condition_variable;
+    new (&symbolizer.m_thread) std::thread;
+    symbolizer.m_started = false;
+    SinkLock::childFork();
+  }
+
+  Symbolizer::Symbolizer(): m_write_mutex(), m_mutex(), m_cond(), m_queue(), m_thread(), m_started(false),
+    m_stop(false) {}
+
+  void Symbolizer::run() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stop) {
+      if (m_queue.empty()) {
+        m_cond.wait(lock);
+        continue;
+      }
+      // Give the errors time to be written before their backtraces.
+      std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + s_delay;
+      while (!m_stop && std::cv_status::timeout != m_cond.wait_until(lock, deadline)) {}
+      if (m_stop) break;
+      lock.unlock();
+      drain(true);
+      lock.lock();
+    }
+  }
+
+  void Symbolizer::stop() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+      if (!m_started) return;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+  }
+
+}
+
+namespace st_stream {
+
+  void SetErrorBacktraces(BacktraceMode mode) {
+    // The first backtrace loads the unwinder, which is slow, so it is done now rather than when an error is reported.
+    if (eNoBacktraces != mode) {
+      void * address[1];
+      backtrace(address, 1);
+    }
+    s_mode = mode;
+  }
+
+  BacktraceMode GetErrorBacktraces() { return BacktraceMode(s_mode.load(std::memory_order_relaxed)); }
+
+  unsigned long long CaptureBacktrace(const std::string & prefix) {
+    BacktraceMode mode = GetErrorBacktraces();
+    if (eNoBacktraces == mode) return 0;
+
+    // Skip this function and its caller.
+    Record record;
+    void * address[s_max_depth + 2];
+    int depth = backtrace(address, s_max_depth + 2);
+    record.m_depth = 2 < depth ? depth - 2 : 0;
+    std::copy(address + 2, address + 2 + record.m_depth, record.m_address);
+    record.m_mode = mode;
+    record.m_prefix = prefix;
+    record.m_seq = s_last_seq.fetch_add(1, std::memory_order_relaxed) + 1;
+    unsigned long long seq = record.m_seq;
+    Symbolizer::instance().push(record);
+    return seq;
+  }
+
+  void FlushBacktraces() { Symbolizer::instance().drain(true); }
+
+}
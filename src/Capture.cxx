@@ -0,0 +1,112 @@
+/** \file Capture.cxx
+    \brief Implementation of CaptureStreamBuf class, and redirection of the standard C++ streams.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "st_stream/Capture.h"
+#include "st_stream/Stream.h"
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  using namespace st_stream;
+
+  /** \brief Buffers installed in the standard streams, if they are captured.
+  */
+  struct Captured {
+    CaptureStreamBuf * m_out;
+    CaptureStreamBuf * m_err;
+    CaptureStreamBuf * m_log;
+    bool m_registered;
+  };
+
+  Captured & getCaptured() {
+    // Constant-initialized, so it is valid however early it is used.
+    static Captured s_captured = { 0, 0, 0, false };
+    return s_captured;
+  }
+
+  void release(std::ostream & os, CaptureStreamBuf * & buf) {
+    os.rdbuf(buf->getOriginal());
+    delete buf;
+    buf = 0;
+  }
+
+  void releaseAtExit() { ReleaseStdStreams(); }
+
+}
+
+namespace st_stream {
+
+  CaptureStreamBuf::CaptureStreamBuf(OStream & dest, std::streambuf * original): std::streambuf(), m_dest(dest),
+    m_original(original), m_pending(), m_forwarding(false) {}
+
+  CaptureStreamBuf::~CaptureStreamBuf() {
+    SinkLock sink_lock;
+    if (!m_forwarding) forward(true);
+  }
+
+  CaptureStreamBuf::int_type CaptureStreamBuf::overflow(int_type c) {
+    if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+    char ch = traits_type::to_char_type(c);
+    return 1 == xsputn(&ch, 1) ? c : traits_type::eof();
+  }
+
+  std::streamsize CaptureStreamBuf::xsputn(const char * s, std::streamsize n) {
+    SinkLock sink_lock;
+    if (m_forwarding) return 0 != m_original ? m_original->sputn(s, n) : n;
+    m_pending.append(s, n);
+    if (0 != std::memchr(s, '\n', n)) forward(false);
+    return n;
+  }
+
+  int CaptureStreamBuf::sync() {
+    SinkLock sink_lock;
+    if (m_forwarding) return 0 != m_original ? m_original->pubsync() : 0;
+    forward(true);
+    return 0;
+  }
+
+  void CaptureStreamBuf::forward(bool flush) {
+    // Up to and including the last newline, unless flushing. Note npos + 1 == 0.
+    std::string::size_type size = flush ? m_pending.size() : m_pending.rfind('\n') + 1;
+    m_forwarding = true;
+    if (0 != size) m_dest.write(m_pending.data(), size);
+    if (flush) m_dest << std::flush;
+    m_forwarding = false;
+    m_pending.erase(0, size);
+  }
+
+  void CaptureStdStreams() {
+    SinkLock sink_lock;
+    Captured & captured(getCaptured());
+    if (0 != captured.m_out) return;
+
+    captured.m_out = new CaptureStreamBuf(stout, std::cout.rdbuf());
+    captured.m_err = new CaptureStreamBuf(sterr, std::cerr.rdbuf());
+    captured.m_log = new CaptureStreamBuf(stlog, std::clog.rdbuf());
+    std::cout.rdbuf(captured.m_out);
+    std::cerr.rdbuf(captured.m_err);
+    std::clog.rdbuf(captured.m_log);
+
+    // Restore the original buffers before the global streams and the standard streams are destroyed.
+    if (!captured.m_registered) {
+      std::atexit(releaseAtExit);
+      captured.m_registered = true;
+    }
+  }
+
+  void ReleaseStdStreams() {
+    SinkLock sink_lock;
+    Captured & captured(getCaptured());
+    if (0 == captured.m_out) return;
+
+    release(std::cout, captured.m_out);
+    release(std::cerr, captured.m_err);
+    release(std::clog, captured.m_log);
+  }
+
+}
@@ -0,0 +1,388 @@
+/** \file Deferred.cxx
+    \brief Implementation of deferred output.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "st_stream/Deferred.h"
+#include "st_stream/MessageBuffer.h"
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  using namespace st_stream;
+
+  // The background thread is woken early once a thread has queued this many lines.
+  const std::size_t s_wake_records = 1024;
+
+  // Otherwise the background thread writes deferred lines this often.
+  const std::chrono::milliseconds s_period(50);
+
+  // Marks an argument which is not a string.
+  const std::size_t s_not_string = std::size_t(-1);
+
+  /** \brief A deferred line. Either the format string and its arguments, or the already formatted text. The format
+             string is copied, like string arguments, since it need not be a literal.
+  */
+  struct Record {
+    unsigned long long m_seq;
+    OStream * m_dest;
+    MessageType m_type;
+    unsigned int m_chat_level;
+    const std::string * m_prefix;
+    std::size_t m_text_begin;
+    std::size_t m_arg_begin;
+    std::size_t m_num_args;
+    std::size_t m_rendered_begin;
+    std::size_t m_rendered_size;
+  };
+
+  /** \brief Lines deferred by one thread. The characters of format strings (each with its terminating null),
+             string arguments, and any formatted text, are stored contiguously; string arguments refer to them by
+             position, since the storage may move as it grows.
+  */
+  struct Batch {
+    std::vector<Record> m_record;
+    std::vector<FormatArg> m_arg;
+    std::vector<std::size_t> m_string_begin;
+    std::string m_string;
+  };
+
+  /** \brief Queue of lines deferred by one thread.
+  */
+  class Queue {
+    public:
+      Queue();
+
+      ~Queue();
+
+      void push(OStream & dest, MessageType type, unsigned int chat_level, const std::string * prefix,
+        const char * text, const FormatArg * arg, std::size_t num_args);
+
+      std::mutex m_mutex;
+      Batch m_batch;
+  };
+
+  Queue & getQueue() {
+    thread_local Queue s_queue;
+    return s_queue;
+  }
+
+  bool lessSeq(const std::pair<const Record *, const Batch *> & r1,
+    const std::pair<const Record *, const Batch *> & r2) {
+    return r1.first->m_seq < r2.first->m_seq;
+  }
+
+}
+
+namespace st_stream {
+
+  /** \class DeferredLog
+      \brief All live queues, the sequence counter shared by them, and the background thread which writes them.
+  */
+  class DeferredLog {
+    public:
+      static DeferredLog & instance();
+
+      static DeferredLog * existingInstance() { return s_instance.load(); }
+
+      static const std::string * intern(const std::string & text);
+
+      void add(Queue * queue);
+
+      void remove(Queue * queue);
+
+      unsigned long long nextSeq() { return m_seq.fetch_add(1, std::memory_order_relaxed); }
+
+      void wake() { m_cond.notify_one(); }
+
+      void drain();
+
+      void stop();
+
+    private:
+      static DeferredLog * create();
+
+      static void flushAtExit();
+
+      static std::mutex & internMutex();
+
+      static void prepareFork();
+
+      static void parentFork();
+
+      static void childFork();
+
+      DeferredLog();
+
+      void run();
+
+      std::mutex m_mutex;
+      std::vector<Queue *> m_queue;
+      std::atomic<unsigned long long> m_seq;
+      std::mutex m_wake_mutex;
+      std::condition_variable m_cond;
+      std::thread m_thread;
+      bool m_stop;
+
+      static std::atomic<DeferredLog *> s_instance;
+  };
+
+  std::atomic<DeferredLog *> DeferredLog::s_instance(0);
+
+  DeferredLog & DeferredLog::instance() {
+    // Never destroyed, so that threads and streams which outlive static destruction can still find it.
+    static DeferredLog * s_log = create();
+    return *s_log;
+  }
+
+  const std::string * DeferredLog::intern(const std::string & text) {
+    // Prefixes are kept for the life of the process, so queued lines may refer to them after their streams change.
+    static std::set<std::string> * s_text = new std::set<std::string>;
+    std::lock_guard<std::mutex> lock(internMutex());
+    return &*s_text->insert(text).first;
+  }
+
+  void DeferredLog::add(Queue * queue) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queue.push_back(queue);
+  }
+
+  void DeferredLog::remove(Queue * queue) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_queue.erase(std::remove(m_queue.begin(), m_queue.end(), queue), m_queue.end());
+  }
+
+  void DeferredLog::drain() {
+    SinkLock sink_lock;
+    std::vector<Batch> batch;
+    {
+      // Take every queue's lines while holding all the queues' locks at once. As in FlushThreadStages, a line is
+      // numbered while its queue is locked, so lines are written in the order in which they were deferred.
+      std::lock_guard<std::mutex> log_lock(m_mutex);
+      batch.resize(m_queue.size());
+      std::vector<std::unique_lock<std::mutex> > queue_lock;
+      queue_lock.reserve(m_queue.size());
+      for (std::size_t ii = 0; ii != m_queue.size(); ++ii)
+        queue_lock.push_back(std::unique_lock<std::mutex>(m_queue[ii]->m_mutex));
+      for (std::size_t ii = 0; ii != m_queue.size(); ++ii) {
+        Batch & queued(m_queue[ii]->m_batch);
+        batch[ii].m_record.swap(queued.m_record);
+        batch[ii].m_arg.swap(queued.m_arg);
+        batch[ii].m_string_begin.swap(queued.m_string_begin);
+        batch[ii].m_string.swap(queued.m_string);
+      }
+    }
+
+    std::vector<std::pair<const Record *, const Batch *> > merged;
+    for (std::vector<Batch>::const_iterator b_itor = batch.begin(); b_itor != batch.end(); ++b_itor) {
+      for (std::vector<Record>::const_iterator r_itor = b_itor->m_record.begin(); r_itor != b_itor->m_record.end();
+        ++r_itor)
+        merged.push_back(std::make_pair(&*r_itor, &*b_itor));
+    }
+    std::sort(merged.begin(), merged.end(), lessSeq);
+
+    // Format each line in full, then write it to each destination at once.
+    std::string line;
+    std::vector<FormatArg> arg;
+    std::vector<OStream *> dest;
+    for (std::vector<std::pair<const Record *, const Batch *> >::iterator itor = merged.begin(); itor != merged.end();
+      ++itor) {
+      const Record & record(*itor->first);
+      const Batch & record_batch(*itor->second);
+      line = *record.m_prefix;
+      if (s_not_string != record.m_text_begin) {
+        arg.clear();
+        for (std::size_t ii = record.m_arg_begin; ii != record.m_arg_begin + record.m_num_args; ++ii) {
+          if (s_not_string == record_batch.m_string_begin[ii]) arg.push_back(record_batch.m_arg[ii]);
+          else arg.push_back(FormatArg(record_batch.m_string.data() + record_batch.m_string_begin[ii],
+            record_batch.m_arg[ii].getSize()));
+        }
+        FormatArg::format(line, record_batch.m_string.data() + record.m_text_begin, arg.empty() ? 0 : &arg.front(),
+          arg.size());
+      } else {
+        line.append(record_batch.m_string, record.m_rendered_begin, record.m_rendered_size);
+      }
+      line += '\n';
+      if (dest.end() == std::find(dest.begin(), dest.end(), record.m_dest)) {
+        // Its destinations may have changed since the first line was deferred to it.
+        record.m_dest->shareDeferredSinks();
+        dest.push_back(record.m_dest);
+      }
+      record.m_dest->forward(line.data(), line.size(), record.m_type, record.m_chat_level);
+    }
+
+    for (std::vector<OStream *>::iterator itor = dest.begin(); itor != dest.end(); ++itor) (*itor)->forwardFlush();
+  }
+
+  void DeferredLog::stop() {
+    if (!m_thread.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(m_wake_mutex);
+      m_stop = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+  }
+
+  DeferredLog * DeferredLog::create() {
+    DeferredLog * log = new DeferredLog;
+    s_instance.store(log);
+    std::atexit(flushAtExit);
+    pthread_atfork(prepareFork, parentFork, childFork);
+    return log;
+  }
+
+  void DeferredLog::flushAtExit() {
+    // Stop the background thread before static objects it may use are destroyed, then write what is left.
+    DeferredLog & log(instance());
+    log.stop();
+    log.drain();
+  }
+
+  std::mutex & DeferredLog::internMutex() {
+    static std::mutex * s_mutex = new std::mutex;
+    return *s_mutex;
+  }
+
+  void DeferredLog::prepareFork() {
+    // Write what has been deferred, then keep more lines from being deferred until the fork is done.
+    DeferredLog & log(instance());
+    log.drain();
+    SinkLock::prepareFork();
+    internMutex().lock();
+    log.m_mutex.lock();
+    for (std::vector<Queue *>::iterator itor = log.m_queue.begin(); itor != log.m_queue.end(); ++itor)
+      (*itor)->m_mutex.lock();
+  }
+
+  void DeferredLog::parentFork() {
+    DeferredLog & log(instance());
+    for (std::vector<Queue *>::iterator itor = log.m_queue.begin(); itor != log.m_queue.end(); ++itor)
+      (*itor)->m_mutex.unlock();
+    log.m_mutex.unlock();
+    internMutex().unlock();
+    SinkLock::parentFork();
+  }
+
+  void DeferredLog::childFork() {
+    // Lines deferred after the drain in prepareFork are written by the parent, so the child discards its copies.
+    DeferredLog & log(instance());
+    for (std::vector<Queue *>::iterator itor = log.m_queue.begin(); itor != log.m_queue.end(); ++itor) {
+      (*itor)->m_batch = Batch();
+      (*itor)->m_mutex.unlock();
+    }
+    log.m_mutex.unlock();
+    internMutex().unlock();
+    SinkLock::childFork();
+
+    // The background thread does not exist in the child. The objects it was using are replaced rather than
+    // destroyed, since destroying them could wait for it forever; then a new thread is started.
+    new (&log.m_wake_mutex) std::mutex;
+    new (&log.m_cond) std::condition_variable;
+    new (&log.m_thread) std::thread(&DeferredLog::run, &log);
+  }
+
+  DeferredLog::DeferredLog(): m_mutex(), m_queue(), m_seq(0), m_wake_mutex(), m_cond(), m_thread(), m_stop(false) {
+    m_thread = std::thread(&DeferredLog::run, this);
+  }
+
+  void DeferredLog::run() {
+    std::unique_lock<std::mutex> lock(m_wake_mutex);
+    while (!m_stop) {
+      m_cond.wait_for(lock, s_period);
+      if (m_stop) break;
+      lock.unlock();
+      drain();
+      lock.lock();
+    }
+  }
+
+  void OStream::deferFormat(const char * text, const FormatArg * arg, std::size_t num_args) {
+    // Intern the prefix the first time it is used, so that queued lines can refer to it cheaply. Several threads may
+    // defer lines to the same stream, and may all intern the prefix, which gives them all the same pointer.
+    const std::string * prefix = m_deferred_prefix.load(std::memory_order_acquire);
+    if (0 == prefix) {
+      prefix = DeferredLog::intern(getPrefix());
+      m_deferred_prefix.store(prefix, std::memory_order_release);
+    }
+    if (!m_deferred.load(std::memory_order_relaxed)) {
+      // From now on, output written directly to this stream's destinations is serialized with deferred output.
+      SinkLock lock;
+      shareDeferredSinks();
+      m_deferred.store(true, std::memory_order_relaxed);
+    }
+    getQueue().push(*this, m_message_type, m_chat_level, prefix, text, arg, num_args);
+  }
+
+  void FlushDeferred() {
+    DeferredLog * log = DeferredLog::existingInstance();
+    if (0 != log) log->drain();
+  }
+
+}
+
+namespace {
+
+  Queue::Queue(): m_mutex(), m_batch() { DeferredLog::instance().add(this); }
+
+  Queue::~Queue() {
+    // Write everything this thread deferred before its queue disappears.
+    FlushDeferred();
+    DeferredLog::instance().remove(this);
+  }
+
+  void Queue::push(OStream & dest, MessageType type, unsigned int chat_level, const std::string * prefix,
+    const char * text, const FormatArg * arg, std::size_t num_args) {
+    // Objects of other types may not outlive this call, so lines which have any are formatted at once. This is
+    // done before taking the lock in case their operator << writes deferred output too.
+    bool generic = false;
+    for (std::size_t ii = 0; ii != num_args; ++ii) generic = generic || FormatArg::eGeneric == arg[ii].getType();
+    MessageBuffer buf;
+    std::string & rendered(buf.get());
+    if (generic) FormatArg::format(rendered, text, arg, num_args);
+
+    bool wake = false;
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      Record record = { DeferredLog::instance().nextSeq(), &dest, type, chat_level, prefix, s_not_string,
+        m_batch.m_arg.size(), num_args, 0, 0 };
+      if (generic) {
+        record.m_num_args = 0;
+        record.m_rendered_begin = m_batch.m_string.size();
+        record.m_rendered_size = rendered.size();
+        m_batch.m_string += rendered;
+      } else {
+        record.m_text_begin = m_batch.m_string.size();
+        m_batch.m_string.append(text, std::strlen(text) + 1);
+        for (std::size_t ii = 0; ii != num_args; ++ii) {
+          if (FormatArg::eString == arg[ii].getType()) {
+            m_batch.m_string_begin.push_back(m_batch.m_string.size());
+            m_batch.m_string.append(arg[ii].getData(), arg[ii].getSize());
+          } else {
+            m_batch.m_string_begin.push_back(s_not_string);
+          }
+          m_batch.m_arg.push_back(arg[ii]);
+        }
+      }
+      m_batch.m_record.push_back(record);
+      wake = s_wake_records == m_batch.m_record.size();
+    }
+
+    if (wake) DeferredLog::instance().wake();
+  }
+
+}
@@ -0,0 +1,246 @@
+/** \file FdStream.cxx
+    \brief Implementation of FdStream class.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <set>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "st_stream/FdStream.h"
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  using namespace st_stream;
+
+  /** \brief All live buffers, so they can be drained before the process forks.
+  */
+  struct Registry {
+    std::mutex m_mutex;
+    std::set<FdStreamBuf *> m_buf;
+    // The buffers in the order their locks were taken by FdStreamBuf::prepareFork.
+    std::vector<FdStreamBuf *> m_locked;
+  };
+
+  Registry & getRegistry();
+
+  void prepareFork() {
+    SinkLock::prepareFork();
+    FdStreamBuf::prepareFork();
+  }
+
+  void parentFork() {
+    FdStreamBuf::parentFork();
+    SinkLock::parentFork();
+  }
+
+  void childFork() {
+    FdStreamBuf::childFork();
+    SinkLock::childFork();
+  }
+
+  Registry * createRegistry() {
+    pthread_atfork(prepareFork, parentFork, childFork);
+    return new Registry;
+  }
+
+  Registry & getRegistry() {
+    // Never destroyed, so that buffers destroyed during static destruction can still find it.
+    static Registry * s_registry = createRegistry();
+    return *s_registry;
+  }
+
+  int openAppend(const std::string & file_name) {
+    int fd = ::open(file_name.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+    if (0 > fd) throw std::runtime_error("FdStream: cannot open " + file_name + ": " + std::strerror(errno));
+    return fd;
+  }
+
+}
+
+namespace st_stream {
+
+  const std::size_t FdStreamBuf::s_default_buffer_size;
+
+  FdStreamBuf::FdStreamBuf(int fd, std::size_t buffer_size): std::streambuf(), m_mutex(),
+    m_buf(std::max<std::size_t>(buffer_size, 1)), m_size(0), m_tie(0), m_fd(fd), m_write_on_flush(0 != isatty(fd)),
+    m_whole_lines(false), m_error(false) {
+    // No put area is set, so every character reaches overflow() or xsputn(), which take the lock.
+    Registry & registry(getRegistry());
+    std::lock_guard<std::mutex> lock(registry.m_mutex);
+    registry.m_buf.insert(this);
+  }
+
+  FdStreamBuf::~FdStreamBuf() {
+    {
+      Registry & registry(getRegistry());
+      std::lock_guard<std::mutex> lock(registry.m_mutex);
+      registry.m_buf.erase(this);
+    }
+    drain();
+  }
+
+  bool FdStreamBuf::drain() {
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    return writeBuffer();
+  }
+
+  void FdStreamBuf::prepareFork() {
+    Registry & registry(getRegistry());
+    registry.m_mutex.lock();
+
+    // A writer holds its own lock while draining its tie, so a buffer is locked before the one it is tied to:
+    // buffers at the start of longer chains of ties come first.
+    std::vector<std::pair<std::size_t, FdStreamBuf *> > order;
+    for (std::set<FdStreamBuf *>::iterator itor = registry.m_buf.begin(); itor != registry.m_buf.end(); ++itor) {
+      std::size_t length = 0;
+      for (FdStreamBuf * tie = (*itor)->m_tie; 0 != tie && length != registry.m_buf.size(); tie = tie->m_tie) ++length;
+      order.push_back(std::make_pair(registry.m_buf.size() - length, *itor));
+    }
+    std::sort(order.begin(), order.end());
+    registry.m_locked.clear();
+    for (std::size_t index = 0; index != order.size(); ++index) {
+      order[index].second->m_mutex.lock();
+      registry.m_locked.push_back(order[index].second);
+    }
+    for (std::size_t index = 0; index != registry.m_locked.size(); ++index) registry.m_locked[index]->drain();
+  }
+
+  void FdStreamBuf::parentFork() {
+    Registry & registry(getRegistry());
+    for (std::size_t index = registry.m_locked.size(); 0 != index; --index)
+      registry.m_locked[index - 1]->m_mutex.unlock();
+    registry.m_locked.clear();
+    registry.m_mutex.unlock();
+  }
+
+  void FdStreamBuf::childFork() {
+    // The forking thread has a new id in the child, so it cannot release the recursive locks it holds.
+    Registry & registry(getRegistry());
+    for (std::size_t index = 0; index != registry.m_locked.size(); ++index)
+      new (&registry.m_locked[index]->m_mutex) std::recursive_mutex;
+    registry.m_locked.clear();
+    registry.m_mutex.unlock();
+  }
+
+  FdStreamBuf::int_type FdStreamBuf::overflow(int_type c) {
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    if (traits_type::eq_int_type(c, traits_type::eof()))
+      return (m_whole_lines ? writeLines() : writeBuffer()) ? traits_type::not_eof(c) : traits_type::eof();
+    if (m_size == m_buf.size() && !(m_whole_lines ? writeLines() : writeBuffer())) return traits_type::eof();
+    m_buf[m_size++] = traits_type::to_char_type(c);
+    return c;
+  }
+
+  std::streamsize FdStreamBuf::xsputn(const char * s, std::streamsize n) {
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    return put(s, n);
+  }
+
+  int FdStreamBuf::sync() {
+    std::lock_guard<std::recursive_mutex> lock(m_mutex);
+    if (!m_write_on_flush) return m_error ? -1 : 0;
+    return writeBuffer() ? 0 : -1;
+  }
+
+  bool FdStreamBuf::writeBuffer() {
+    if (0 == m_size) return !m_error;
+    if (0 != m_tie) m_tie->drain();
+    struct iovec iov[1];
+    iov[0].iov_base = &m_buf.front();
+    iov[0].iov_len = m_size;
+    return writeAll(iov, 1);
+  }
+
+  std::streamsize FdStreamBuf::put(const char * s, std::streamsize n) {
+    if (std::size_t(n) <= m_buf.size() - m_size) {
+      std::memcpy(&m_buf[m_size], s, n);
+      m_size += n;
+      return n;
+    }
+
+    // Too long to fit: write the buffered text and the new text together, without copying the new text. In
+    // whole-line mode, only up to the end of the last complete line, keeping the rest buffered.
+    std::streamsize num_lines = n;
+    if (m_whole_lines) {
+      while (0 != num_lines && '\n' != s[num_lines - 1]) --num_lines;
+      if (0 == num_lines) {
+        // The new text continues the last buffered line. Write the lines before it to make room.
+        if (!writeLines()) return 0;
+        if (std::size_t(n) <= m_buf.size() - m_size) return put(s, n);
+        num_lines = n;
+      }
+    }
+    if (0 != m_tie) m_tie->drain();
+    struct iovec iov[2];
+    iov[0].iov_base = &m_buf.front();
+    iov[0].iov_len = m_size;
+    iov[1].iov_base = const_cast<char *>(s);
+    iov[1].iov_len = num_lines;
+    if (!writeAll(iov, 2)) return 0;
+    if (num_lines != n && 0 == put(s + num_lines, n - num_lines)) return 0;
+    return n;
+  }
+
+  bool FdStreamBuf::writeAll(struct iovec * iov, int num_iov) {
+    while (0 != num_iov && !m_error) {
+      ssize_t size = ::writev(m_fd, iov, num_iov);
+      if (0 > size) {
+        if (EINTR != errno) m_error = true;
+        continue;
+      }
+      // Skip the pieces written completely, and the written part of the next one.
+      for (; 0 != num_iov && std::size_t(size) >= iov->iov_len; ++iov, --num_iov) size -= iov->iov_len;
+      if (0 != num_iov) {
+        iov->iov_base = static_cast<char *>(iov->iov_base) + size;
+        iov->iov_len -= size;
+      }
+    }
+    // After an error, output is discarded rather than collected without limit.
+    m_size = 0;
+    return !m_error;
+  }
+
+  bool FdStreamBuf::writeLines() {
+    std::size_t end = m_size;
+    while (0 != end && '\n' != m_buf[end - 1]) --end;
+    if (0 == end) return writeBuffer();
+
+    // Keep the incomplete last line, moving it to the start of the buffer once the rest is written.
+    std::size_t num_kept = m_size - end;
+    if (0 != m_tie) m_tie->drain();
+    struct iovec iov[1];
+    iov[0].iov_base = &m_buf.front();
+    iov[0].iov_len = end;
+    if (!writeAll(iov, 1)) return false;
+    std::memmove(&m_buf.front(), &m_buf[end], num_kept);
+    m_size = num_kept;
+    return true;
+  }
+
+  FdStream::FdStream(int fd, std::size_t buffer_size): std::ostream(0), m_buf(fd, buffer_size), m_close(false) {
+    rdbuf(&m_buf);
+  }
+
+  FdStream::FdStream(const std::string & file_name, std::size_t buffer_size): std::ostream(0),
+    m_buf(openAppend(file_name), buffer_size), m_close(true) {
+    m_buf.setWholeLines(true);
+    rdbuf(&m_buf);
+  }
+
+  FdStream::~FdStream() {
+    m_buf.drain();
+    if (m_close) ::close(m_buf.getFd());
+  }
+
+}
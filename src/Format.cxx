@@ -0,0 +1,304 @@
+/** \file Format.cxx
+    \brief Implementation of FormatArg class.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "st_stream/Format.h"
+
+namespace {
+
+  using st_stream::ArrayFormat;
+
+  /** \brief Placeholder specification, parsed from [align][width][.precision][type].
+  */
+  struct Spec {
+    Spec(const char * spec, std::size_t spec_size);
+
+    char m_align;
+    std::size_t m_width;
+    int m_precision;
+    char m_type;
+  };
+
+  Spec::Spec(const char * spec, std::size_t spec_size): m_align('\0'), m_width(0), m_precision(-1), m_type('\0') {
+    const char * end = spec + spec_size;
+    if (spec != end && ':' == *spec) ++spec;
+    if (spec != end && ('<' == *spec || '>' == *spec || '^' == *spec)) m_align = *spec++;
+    for (; spec != end && '0' <= *spec && '9' >= *spec; ++spec) m_width = 10 * m_width + (*spec - '0');
+    if (spec != end && '.' == *spec) {
+      m_precision = 0;
+      for (++spec; spec != end && '0' <= *spec && '9' >= *spec; ++spec) m_precision = 10 * m_precision + (*spec - '0');
+    }
+    if (spec != end) m_type = *spec;
+  }
+
+  /** \brief Write the decimal digits of the given value so that they end just before the given position, two at a
+             time, and return the position of the first digit.
+  */
+  char * writeDecimal(char * end, unsigned long long value) {
+    static const char s_pair[] =
+      "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+      "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+      "8081828384858687888990919293949596979899";
+    char * begin = end;
+    while (100 <= value) {
+      const char * pair = s_pair + 2 * (value % 100);
+      value /= 100;
+      *--begin = pair[1];
+      *--begin = pair[0];
+    }
+    if (10 <= value) {
+      *--begin = s_pair[2 * value + 1];
+      *--begin = s_pair[2 * value];
+    } else {
+      *--begin = static_cast<char>('0' + value);
+    }
+    return begin;
+  }
+
+  void appendUnsigned(std::string & buf, unsigned long long value, char type) {
+    char tmp[64];
+    char * end = tmp + sizeof(tmp);
+    if ('x' != type && 'X' != type && 'o' != type) {
+      buf.append(writeDecimal(end, value), end);
+      return;
+    }
+
+    unsigned int base = 'o' == type ? 8 : 16;
+    const char * digits = 'X' == type ? "0123456789ABCDEF" : "0123456789abcdef";
+
+    // Generate digits from least to most significant, then append them in the right order.
+    char * begin = end;
+    do {
+      *--begin = digits[value % base];
+      value /= base;
+    } while (0 != value);
+    buf.append(begin, end);
+  }
+
+  void appendSigned(std::string & buf, long long value, char type) {
+    if (0 > value) {
+      buf += '-';
+      // Negate in unsigned arithmetic so that the most negative value is handled correctly.
+      appendUnsigned(buf, 0ULL - static_cast<unsigned long long>(value), type);
+    } else {
+      appendUnsigned(buf, value, type);
+    }
+  }
+
+  void appendFloat(std::string & buf, long double value, int precision, char type) {
+    // With no type, behave like std::ostream with default flags: general format, precision 6 unless specified.
+    char conversion = 'g';
+    if ('f' == type || 'e' == type || 'E' == type || 'g' == type || 'G' == type) conversion = type;
+    if (0 > precision) precision = 6;
+
+    char format[8] = { '%', '.', '*', 'L', conversion, '\0' };
+    char tmp[128];
+    int size = std::snprintf(tmp, sizeof(tmp), format, precision, value);
+    if (0 > size) return;
+    if (std::size_t(size) < sizeof(tmp)) {
+      buf.append(tmp, size);
+    } else {
+      // Very large values in fixed format need more room.
+      std::string::size_type start = buf.size();
+      buf.resize(start + size + 1);
+      std::snprintf(&buf[start], size + 1, format, precision, value);
+      buf.resize(start + size);
+    }
+  }
+
+
+  /** \brief Append the given value in fixed format with the given precision, as "%.*f" would, by rounding
+             it to an integer number of units of the last decimal. Return false without appending anything if the
+             value is out of range, or so close to halfway between two results that the scaling, which is not
+             exact, could have changed the rounding.
+  */
+  bool appendFixed(std::string & buf, double value, int precision) {
+    static const double s_scale[] = { 1.e0, 1.e1, 1.e2, 1.e3, 1.e4, 1.e5, 1.e6, 1.e7, 1.e8, 1.e9, 1.e10, 1.e11, 1.e12,
+      1.e13, 1.e14, 1.e15 };
+    if (0 > precision || 15 < precision) return false;
+    double scaled = std::fabs(value) * s_scale[precision];
+    if (!(1.e15 > scaled)) return false;
+
+    double whole = std::floor(scaled);
+    double fraction = scaled - whole;
+    if (std::fabs(fraction - .5) <= scaled * 4.e-16 + 1.e-12) return false;
+    unsigned long long units = static_cast<unsigned long long>(whole) + (.5 < fraction ? 1 : 0);
+
+    char tmp[40];
+    char * end = tmp + sizeof(tmp);
+    char * begin = end;
+    if (0 < precision) {
+      // Digits after the point, including leading zeros, then the point.
+      unsigned long long divisor = static_cast<unsigned long long>(s_scale[precision]);
+      char * digits = writeDecimal(end, units % divisor);
+      while (end - digits < precision) *--digits = '0';
+      begin = digits;
+      *--begin = '.';
+      units /= divisor;
+    }
+    begin = writeDecimal(begin, units);
+    if (std::signbit(value)) *--begin = '-';
+    buf.append(begin, end);
+    return true;
+  }
+
+  /** \brief Pad the text appended to the given buffer since the given position to the given width, aligned
+             to the right, as numbers are by default.
+  */
+  void padLeft(std::string & buf, std::string::size_type start, std::size_t width) {
+    std::size_t size = buf.size() - start;
+    if (width > size) buf.insert(start, width - size, ' ');
+  }
+
+  template <typename T>
+  void formatSignedArray(std::string & buf, const T * data, std::size_t size, const ArrayFormat & format) {
+    buf.reserve(buf.size() + size * (format.getSeparator().size() + std::max<std::size_t>(format.getWidth(), 12)));
+    for (std::size_t ii = 0; ii != size; ++ii) {
+      if (0 != ii) buf += format.getSeparator();
+      std::string::size_type start = buf.size();
+      appendSigned(buf, data[ii], format.getType());
+      padLeft(buf, start, format.getWidth());
+    }
+  }
+
+  template <typename T>
+  void formatUnsignedArray(std::string & buf, const T * data, std::size_t size, const ArrayFormat & format) {
+    buf.reserve(buf.size() + size * (format.getSeparator().size() + std::max<std::size_t>(format.getWidth(), 12)));
+    for (std::size_t ii = 0; ii != size; ++ii) {
+      if (0 != ii) buf += format.getSeparator();
+      std::string::size_type start = buf.size();
+      appendUnsigned(buf, data[ii], format.getType());
+      padLeft(buf, start, format.getWidth());
+    }
+  }
+
+  template <typename T>
+  void formatFloatArray(std::string & buf, const T * data, std::size_t size, const ArrayFormat & format) {
+    buf.reserve(buf.size() + size * (format.getSeparator().size() + std::max<std::size_t>(format.getWidth(), 16)));
+    bool fixed = 'f' == format.getType();
+    int precision = 0 > format.getPrecision() ? 6 : format.getPrecision();
+    for (std::size_t ii = 0; ii != size; ++ii) {
+      if (0 != ii) buf += format.getSeparator();
+      std::string::size_type start = buf.size();
+      if (!fixed || !appendFixed(buf, data[ii], precision)) appendFloat(buf, data[ii], precision, format.getType());
+      padLeft(buf, start, format.getWidth());
+    }
+  }
+
+}
+
+namespace st_stream {
+
+  void FormatArg::render(std::string & buf, const char * spec_text, std::size_t spec_size) const {
+    Spec spec(spec_text, spec_size);
+    std::string::size_type start = buf.size();
+    bool numeric = false;
+    bool as_integer = 'd' == spec.m_type || 'x' == spec.m_type || 'X' == spec.m_type || 'o' == spec.m_type;
+
+    switch (m_type) {
+      case eBool:
+        if (as_integer) appendUnsigned(buf, m_value.m_unsigned, spec.m_type);
+        else buf += 0 != m_value.m_unsigned ? "true" : "false";
+        break;
+      case eChar:
+        if (as_integer) appendSigned(buf, m_value.m_signed, spec.m_type);
+        else buf += static_cast<char>(m_value.m_signed);
+        break;
+      case eSigned:
+        numeric = true;
+        appendSigned(buf, m_value.m_signed, spec.m_type);
+        break;
+      case eUnsigned:
+        numeric = true;
+        appendUnsigned(buf, m_value.m_unsigned, spec.m_type);
+        break;
+      case eFloat:
+        numeric = true;
+        appendFloat(buf, m_value.m_float, spec.m_precision, spec.m_type);
+        break;
+      case eString: {
+        // Precision limits the number of characters displayed.
+        std::size_t size = m_value.m_string.m_size;
+        if (0 <= spec.m_precision && std::size_t(spec.m_precision) < size) size = spec.m_precision;
+        buf.append(m_value.m_string.m_data, size);
+        break;
+      }
+      case eGeneric:
+        m_value.m_generic.m_render(buf, m_value.m_generic.m_object);
+        break;
+    }
+
+    // Pad to the field width. Numbers are right-aligned and everything else left-aligned by default.
+    std::size_t size = buf.size() - start;
+    if (spec.m_width > size) {
+      std::size_t pad = spec.m_width - size;
+      char align = '\0' != spec.m_align ? spec.m_align : (numeric ? '>' : '<');
+      if ('>' == align) buf.insert(start, pad, ' ');
+      else if ('<' == align) buf.append(pad, ' ');
+      else {
+        buf.insert(start, pad / 2, ' ');
+        buf.append(pad - pad / 2, ' ');
+      }
+    }
+  }
+
+  void FormatArg::format(std::string & buf, const char * text, const FormatArg * arg, std::size_t num_args) {
+    std::size_t arg_index = 0;
+    const char * literal = text;
+    for (const char * itor = text; '\0' != *itor; ) {
+      if (('{' == *itor && '{' == itor[1]) || ('}' == *itor && '}' == itor[1])) {
+        // Escaped brace: emit the text so far, including one brace, then skip the other.
+        buf.append(literal, itor + 1);
+        itor += 2;
+        literal = itor;
+      } else if ('{' == *itor) {
+        buf.append(literal, itor);
+        const char * close = itor + 1;
+        while ('\0' != *close && '}' != *close) ++close;
+        if (arg_index < num_args) arg[arg_index++].render(buf, itor + 1, close - itor - 1);
+        itor = '\0' == *close ? close : close + 1;
+        literal = itor;
+      } else {
+        ++itor;
+      }
+    }
+    buf.append(literal);
+  }
+
+  void FormatArray(std::string & buf, const signed int * data, std::size_t size, const ArrayFormat & format) {
+    formatSignedArray(buf, data, size, format);
+  }
+
+  void FormatArray(std::string & buf, const signed long * data, std::size_t size, const ArrayFormat & format) {
+    formatSignedArray(buf, data, size, format);
+  }
+
+  void FormatArray(std::string & buf, const signed long long * data, std::size_t size, const ArrayFormat & format) {
+    formatSignedArray(buf, data, size, format);
+  }
+
+  void FormatArray(std::string & buf, const unsigned int * data, std::size_t size, const ArrayFormat & format) {
+    formatUnsignedArray(buf, data, size, format);
+  }
+
+  void FormatArray(std::string & buf, const unsigned long * data, std::size_t size, const ArrayFormat & format) {
+    formatUnsignedArray(buf, data, size, format);
+  }
+
+  void FormatArray(std::string & buf, const unsigned long long * data, std::size_t size, const ArrayFormat & format) {
+    formatUnsignedArray(buf, data, size, format);
+  }
+
+  void FormatArray(std::string & buf, const float * data, std::size_t size, const ArrayFormat & format) {
+    formatFloatArray(buf, data, size, format);
+  }
+
+  void FormatArray(std::string & buf, const double * data, std::size_t size, const ArrayFormat & format) {
+    formatFloatArray(buf, data, size, format);
+  }
+
+}
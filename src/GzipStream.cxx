@@ -0,0 +1,255 @@
+/** \file GzipStream.cxx
+    \brief Implementation of GzipStream class.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <pthread.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <set>
+#include <stdexcept>
+
+#include <zlib.h>
+
+#include "st_stream/GzipStream.h"
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  using namespace st_stream;
+
+  // Maximum number of frames waiting to be compressed. Writers wait rather than use unbounded memory.
+  const std::size_t s_max_queued_frames = 4;
+
+  /** \brief All open buffers, so their frames can be written before the process forks.
+  */
+  struct Registry {
+    std::mutex m_mutex;
+    std::set<GzipStreamBuf *> m_buf;
+  };
+
+  void prepareFork() {
+    SinkLock::prepareFork();
+    GzipStreamBuf::prepareFork();
+  }
+
+  void parentFork() {
+    GzipStreamBuf::parentFork();
+    SinkLock::parentFork();
+  }
+
+  void childFork() {
+    GzipStreamBuf::childFork();
+    SinkLock::childFork();
+  }
+
+  Registry * createRegistry() {
+    pthread_atfork(prepareFork, parentFork, childFork);
+    return new Registry;
+  }
+
+  Registry & getRegistry() {
+    // Never destroyed, so that streams destroyed during static destruction can still find it.
+    static Registry * s_registry = createRegistry();
+    return *s_registry;
+  }
+
+}
+
+namespace st_stream {
+
+  const std::size_t GzipStreamBuf::s_default_frame_size;
+  const int GzipStreamBuf::s_default_level;
+
+  const std::chrono::milliseconds GzipStreamBuf::s_max_delay(1000);
+
+  GzipStreamBuf::GzipStreamBuf(const std::string & file_name, bool append, std::size_t frame_size, int level):
+    std::streambuf(), m_frame(std::max<std::size_t>(frame_size, 1)), m_queue(), m_mutex(), m_cond(), m_thread(),
+    m_frame_time(), m_num_queued(0), m_num_written(0), m_file(std::fopen(file_name.c_str(), append ? "ab" : "wb")),
+    m_level(level), m_done(false), m_error(false) {
+    if (0 == m_file)
+      throw std::runtime_error("st_stream::GzipStream: could not open file \"" + file_name + "\": " +
+        std::strerror(errno));
+    setp(&m_frame.front(), &m_frame.front() + m_frame.size());
+    m_thread = std::thread(&GzipStreamBuf::run, this);
+    Registry & registry(getRegistry());
+    std::lock_guard<std::mutex> lock(registry.m_mutex);
+    registry.m_buf.insert(this);
+  }
+
+  GzipStreamBuf::~GzipStreamBuf() { close(); }
+
+  void GzipStreamBuf::close() {
+    if (0 == m_file) return;
+    {
+      Registry & registry(getRegistry());
+      std::lock_guard<std::mutex> lock(registry.m_mutex);
+      registry.m_buf.erase(this);
+    }
+
+    // Hand off whatever is left, then let the compression thread drain the queue and finish.
+    if (pptr() != pbase()) queueFrame(pptr() - pbase());
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_done = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+
+    if (0 != std::fclose(m_file)) m_error = true;
+    m_file = 0;
+  }
+
+  void GzipStreamBuf::prepareFork() {
+    Registry & registry(getRegistry());
+    registry.m_mutex.lock();
+    for (std::set<GzipStreamBuf *>::iterator itor = registry.m_buf.begin(); itor != registry.m_buf.end(); ++itor) {
+      // Hand off the whole frame, even an incomplete last line, and wait until it is written, so that neither
+      // process writes it again.
+      GzipStreamBuf & buf(**itor);
+      if (buf.pptr() != buf.pbase()) buf.queueFrame(buf.pptr() - buf.pbase());
+      std::unique_lock<std::mutex> lock(buf.m_mutex);
+      while (buf.m_num_written != buf.m_num_queued && !buf.m_error) buf.m_cond.wait(lock);
+      lock.release();
+    }
+  }
+
+  void GzipStreamBuf::parentFork() {
+    Registry & registry(getRegistry());
+    for (std::set<GzipStreamBuf *>::iterator itor = registry.m_buf.begin(); itor != registry.m_buf.end(); ++itor)
+      (*itor)->m_mutex.unlock();
+    registry.m_mutex.unlock();
+  }
+
+  void GzipStreamBuf::childFork() {
+    // The compression threads do not exist in the child. The objects they were using are replaced rather than
+    // destroyed, since destroying them could wait for them forever.
+    Registry & registry(getRegistry());
+    for (std::set<GzipStreamBuf *>::iterator itor = registry.m_buf.begin(); itor != registry.m_buf.end(); ++itor) {
+      GzipStreamBuf & buf(**itor);
+      new (&buf.m_mutex) std::mutex;
+      new (&buf.m_cond) std::condition_variable;
+      new (&buf.m_thread) std::thread;
+      buf.m_thread = std::thread(&GzipStreamBuf::run, &buf);
+    }
+    registry.m_mutex.unlock();
+  }
+
+  GzipStreamBuf::int_type GzipStreamBuf::overflow(int_type c) {
+    if (0 == m_file) return traits_type::eof();
+
+    // Frame is full.
+    endFrame();
+
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (m_error) return traits_type::eof();
+    }
+
+    if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+    return sputc(traits_type::to_char_type(c));
+  }
+
+  int GzipStreamBuf::sync() {
+    if (0 == m_file || pptr() == pbase()) return 0;
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (std::chrono::steady_clock::time_point() == m_frame_time) m_frame_time = now;
+    if (eError == GetMessageType()) {
+      // Make sure an error is on disk before returning, in case the process is about to die.
+      endFrame();
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (m_num_written != m_num_queued && !m_error) m_cond.wait(lock);
+      return m_error ? -1 : 0;
+    }
+    if (s_max_delay <= now - m_frame_time) endFrame();
+    return 0;
+  }
+
+  void GzipStreamBuf::endFrame() {
+    // End the frame after the last complete line if there is one, otherwise use the whole frame.
+    std::size_t size = pptr() - pbase();
+    const char * newline = std::find(std::reverse_iterator<char *>(pptr()), std::reverse_iterator<char *>(pbase()),
+      '\n').base();
+    if (newline != pbase()) size = newline - pbase();
+    queueFrame(size);
+  }
+
+  void GzipStreamBuf::queueFrame(std::size_t size) {
+    std::string frame(pbase(), size);
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      while (s_max_queued_frames <= m_queue.size()) m_cond.wait(lock);
+      m_queue.push_back(std::string());
+      m_queue.back().swap(frame);
+      ++m_num_queued;
+    }
+    m_cond.notify_all();
+
+    // Start the next frame with whatever was not handed off.
+    std::size_t remaining = pptr() - pbase() - size;
+    std::memmove(pbase(), pbase() + size, remaining);
+    setp(&m_frame.front(), &m_frame.front() + m_frame.size());
+    pbump(int(remaining));
+    m_frame_time = 0 == remaining ? std::chrono::steady_clock::time_point() : std::chrono::steady_clock::now();
+  }
+
+  void GzipStreamBuf::run() {
+    std::vector<unsigned char> compressed;
+    std::string frame;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_queue.empty() && !m_done) m_cond.wait(lock);
+        if (m_queue.empty()) break;
+        frame.swap(m_queue.front());
+        m_queue.pop_front();
+      }
+      // Wake a writer which may be waiting for room in the queue.
+      m_cond.notify_all();
+
+      bool written = writeFrame(frame, compressed);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!written) m_error = true;
+        ++m_num_written;
+      }
+      // Wake a writer which may be waiting for its error to be written.
+      m_cond.notify_all();
+    }
+  }
+
+  bool GzipStreamBuf::writeFrame(const std::string & frame, std::vector<unsigned char> & compressed) {
+    z_stream zs;
+    std::memset(&zs, 0, sizeof(zs));
+
+    // Window bits of 15 + 16 selects a gzip header and trailer, making each frame a complete gzip member.
+    if (Z_OK != deflateInit2(&zs, m_level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)) return false;
+
+    compressed.resize(deflateBound(&zs, frame.size()));
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(frame.data()));
+    zs.avail_in = frame.size();
+    zs.next_out = &compressed.front();
+    zs.avail_out = compressed.size();
+    int status = deflate(&zs, Z_FINISH);
+    std::size_t size = compressed.size() - zs.avail_out;
+    deflateEnd(&zs);
+    if (Z_STREAM_END != status) return false;
+
+    // Flush every frame so that complete frames are on disk even if the process later dies.
+    return size == std::fwrite(&compressed.front(), 1, size, m_file) && 0 == std::fflush(m_file);
+  }
+
+  GzipStream::GzipStream(const std::string & file_name, bool append, std::size_t frame_size, int level):
+    std::ostream(0), m_buf(file_name, append, frame_size, level) { rdbuf(&m_buf); }
+
+  GzipStream::~GzipStream() {}
+
+  void GzipStream::close() {
+    flush();
+    m_buf.close();
+  }
+
+}
@@ -0,0 +1,430 @@
+/** \file LogIndex.cxx
+    \brief Implementation of IndexedFileStream and LogIndex classes.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <pthread.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+
+#include "st_stream/LogIndex.h"
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  using namespace st_stream;
+
+  const char s_magic[] = "STIDX01\n";
+  const std::size_t s_magic_size = 8;
+
+  const struct { const char * m_name; MessageType m_type; } s_type_name[] = {
+    { "DEBUG", eDebug }, { "ERROR", eError }, { "INFO", eInfo }, { "WARNING", eWarning }
+  };
+
+  long long now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  // FNV-1a. Zero is reserved for "no component".
+  unsigned long long hashName(const char * name, std::size_t size) {
+    unsigned long long hash = 14695981039346656037ull;
+    for (std::size_t ii = 0; ii != size; ++ii) {
+      hash ^= static_cast<unsigned char>(name[ii]);
+      hash *= 1099511628211ull;
+    }
+    return 0 == hash ? 1 : hash;
+  }
+
+  // Each name sets three of the 256 bits of a filter, chosen by different bytes of its hash.
+  void addHash(unsigned long long * filter, unsigned long long hash) {
+    for (int ii = 0; ii != 3; ++ii, hash >>= 8) filter[(hash >> 6) & 3] |= 1ull << (hash & 63);
+  }
+
+  bool hasHash(const unsigned long long * filter, unsigned long long hash) {
+    for (int ii = 0; ii != 3; ++ii, hash >>= 8) if (0 == (filter[(hash >> 6) & 3] & 1ull << (hash & 63))) return false;
+    return true;
+  }
+
+  void putNumber(unsigned char * & dest, unsigned long long value, int num_bytes) {
+    for (int ii = 0; ii != num_bytes; ++ii, value >>= 8) *dest++ = static_cast<unsigned char>(value & 0xff);
+  }
+
+  unsigned long long getNumber(const unsigned char * & src, int num_bytes) {
+    unsigned long long value = 0;
+    for (int ii = 0; ii != num_bytes; ++ii) value |= static_cast<unsigned long long>(*src++) << 8 * ii;
+    return value;
+  }
+
+  void encode(const IndexBlock & block, unsigned char * record) {
+    putNumber(record, block.m_offset, 8);
+    putNumber(record, block.m_size, 4);
+    putNumber(record, block.m_num_lines, 4);
+    putNumber(record, block.m_begin_time, 8);
+    putNumber(record, block.m_end_time, 8);
+    putNumber(record, block.m_type_mask, 4);
+    putNumber(record, block.m_flags, 4);
+    for (int ii = 0; ii != 4; ++ii) putNumber(record, block.m_filter[ii], 8);
+  }
+
+  void decode(const unsigned char * record, IndexBlock & block) {
+    block.m_offset = getNumber(record, 8);
+    block.m_size = static_cast<unsigned int>(getNumber(record, 4));
+    block.m_num_lines = static_cast<unsigned int>(getNumber(record, 4));
+    block.m_begin_time = static_cast<long long>(getNumber(record, 8));
+    block.m_end_time = static_cast<long long>(getNumber(record, 8));
+    block.m_type_mask = static_cast<unsigned int>(getNumber(record, 4));
+    block.m_flags = static_cast<unsigned int>(getNumber(record, 4));
+    for (int ii = 0; ii != 4; ++ii) block.m_filter[ii] = getNumber(record, 8);
+  }
+
+  // A part of the log which is not indexed, so it may hold anything.
+  IndexBlock unindexedBlock(unsigned long long offset, unsigned long long size) {
+    IndexBlock block;
+    block.m_offset = offset;
+    block.m_size = static_cast<unsigned int>(size);
+    block.m_num_lines = 0;
+    block.m_begin_time = LogIndex::s_min_time;
+    block.m_end_time = LogIndex::s_max_time;
+    block.m_type_mask = eAllMessageTypes;
+    block.m_flags = IndexBlock::eUntagged;
+    std::fill(block.m_filter, block.m_filter + 4, ~0ull);
+    return block;
+  }
+
+  std::FILE * openFile(const std::string & file_name, const char * mode) {
+    std::FILE * file = std::fopen(file_name.c_str(), mode);
+    if (0 == file)
+      throw std::runtime_error("st_stream::LogIndex: could not open file \"" + file_name + "\": " +
+        std::strerror(errno));
+    return file;
+  }
+
+  bool lessOffset(const IndexBlock & block1, const IndexBlock & block2) { return block1.m_offset < block2.m_offset; }
+
+  /** \brief All open buffers, so their blocks can be written before the process forks.
+  */
+  struct Registry {
+    std::mutex m_mutex;
+    std::set<IndexedFileStreamBuf *> m_buf;
+  };
+
+  void prepareFork() {
+    SinkLock::prepareFork();
+    IndexedFileStreamBuf::prepareFork();
+  }
+
+  void parentFork() {
+    IndexedFileStreamBuf::parentFork();
+    SinkLock::parentFork();
+  }
+
+  void childFork() {
+    IndexedFileStreamBuf::childFork();
+    SinkLock::childFork();
+  }
+
+  Registry * createRegistry() {
+    pthread_atfork(prepareFork, parentFork, childFork);
+    return new Registry;
+  }
+
+  Registry & getRegistry() {
+    // Never destroyed, so that streams destroyed during static destruction can still find it.
+    static Registry * s_registry = createRegistry();
+    return *s_registry;
+  }
+
+}
+
+namespace st_stream {
+
+  const std::size_t IndexBlock::s_record_size;
+
+  bool IndexBlock::mayContain(const std::string & component) const {
+    return 0 != (m_flags & eUntagged) || hasHash(m_filter, hashName(component.data(), component.size()));
+  }
+
+  MessageType ClassifyLine(const char * line, std::size_t size) {
+    // The type is the first or, after the name of the executable, the second field of the prefix.
+    const char * end = line + size;
+    const char * field = line;
+    for (int ii = 0; ii != 2; ++ii) {
+      const char * sep = std::search(field, end, ": ", ": " + 2);
+      if (end == sep) break;
+      std::size_t field_size = sep - field;
+      for (std::size_t jj = 0; jj != sizeof(s_type_name) / sizeof(s_type_name[0]); ++jj) {
+        if (field_size == std::strlen(s_type_name[jj].m_name) &&
+          0 == std::memcmp(field, s_type_name[jj].m_name, field_size))
+          return s_type_name[jj].m_type;
+      }
+      // Sampled information, e.g. "INFO (sampled 1/100)".
+      if (6 < field_size && 0 == std::memcmp(field, "INFO (", 6)) return eInfo;
+      field = sep + 2;
+    }
+    return eOutput;
+  }
+
+  const std::size_t IndexedFileStreamBuf::s_default_block_size;
+
+  const std::chrono::milliseconds IndexedFileStreamBuf::s_max_delay(1000);
+
+  IndexedFileStreamBuf::IndexedFileStreamBuf(const std::string & file_name, bool append, std::size_t block_size):
+    std::streambuf(), m_block(std::max<std::size_t>(block_size, 1)), m_mark(), m_block_time(), m_file(0), m_index(0),
+    m_block_size(m_block.size()), m_error(false) {
+    m_file = openFile(file_name, append ? "ab" : "wb");
+    try {
+      m_index = openFile(LogIndex::getIndexName(file_name), append ? "ab" : "wb");
+    } catch (...) {
+      std::fclose(m_file);
+      throw;
+    }
+
+    std::fseek(m_index, 0, SEEK_END);
+    // Flush the header, so that the log may be read while it is written.
+    if (0 == std::ftell(m_index))
+      m_error = s_magic_size != std::fwrite(s_magic, 1, s_magic_size, m_index) || 0 != std::fflush(m_index);
+    setp(&m_block.front(), &m_block.front() + m_block.size());
+    Registry & registry(getRegistry());
+    std::lock_guard<std::mutex> lock(registry.m_mutex);
+    registry.m_buf.insert(this);
+  }
+
+  IndexedFileStreamBuf::~IndexedFileStreamBuf() { close(); }
+
+  void IndexedFileStreamBuf::close() {
+    if (0 == m_file) return;
+    {
+      Registry & registry(getRegistry());
+      std::lock_guard<std::mutex> lock(registry.m_mutex);
+      registry.m_buf.erase(this);
+    }
+    if (pptr() != pbase()) writeBlock(pptr() - pbase());
+    if (0 != std::fclose(m_index)) m_error = true;
+    if (0 != std::fclose(m_file)) m_error = true;
+    m_file = 0;
+    m_index = 0;
+  }
+
+  void IndexedFileStreamBuf::prepareFork() {
+    // Write the whole block, even an incomplete last line, so that neither process writes it again. Writers hold
+    // the SinkLock, which the handler has taken.
+    Registry & registry(getRegistry());
+    registry.m_mutex.lock();
+    for (std::set<IndexedFileStreamBuf *>::iterator itor = registry.m_buf.begin(); itor != registry.m_buf.end();
+      ++itor)
+      if ((*itor)->pptr() != (*itor)->pbase()) (*itor)->writeBlock((*itor)->pptr() - (*itor)->pbase());
+  }
+
+  void IndexedFileStreamBuf::parentFork() { getRegistry().m_mutex.unlock(); }
+
+  void IndexedFileStreamBuf::childFork() { getRegistry().m_mutex.unlock(); }
+
+  IndexedFileStreamBuf::int_type IndexedFileStreamBuf::overflow(int_type c) {
+    if (0 == m_file || m_error) return traits_type::eof();
+    // Write the complete lines, or grow the block to hold a line longer than a block.
+    char * newline = std::find(std::reverse_iterator<char *>(pptr()), std::reverse_iterator<char *>(pbase()), '\n')
+      .base();
+    if (newline != pbase()) {
+      writeBlock(newline - pbase());
+    } else {
+      std::size_t size = pptr() - pbase();
+      m_block.resize(2 * m_block.size());
+      setp(&m_block.front(), &m_block.front() + m_block.size());
+      pbump(int(size));
+    }
+    if (m_error) return traits_type::eof();
+    if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+    return sputc(traits_type::to_char_type(c));
+  }
+
+  std::streamsize IndexedFileStreamBuf::xsputn(const char * s, std::streamsize n) {
+    if (0 == m_file || m_error) return 0;
+    markLine();
+    for (std::streamsize num_left = n; 0 != num_left; ) {
+      std::streamsize num_copied = std::min<std::streamsize>(num_left, epptr() - pptr());
+      std::memcpy(pptr(), s, num_copied);
+      // Every line begun within the text, e.g. each frame of a backtrace, belongs to the same message.
+      for (const char * newline = s; 0 != (newline = static_cast<const char *>(std::memchr(newline, '\n',
+        s + num_copied - newline))) && newline + 1 != s + num_left; ) {
+        ++newline;
+        m_mark.push_back(currentMark(pptr() - pbase() + (newline - s)));
+      }
+      pbump(int(num_copied));
+      s += num_copied;
+      num_left -= num_copied;
+      if (0 != num_left && traits_type::eq_int_type(overflow(traits_type::to_int_type(*s)), traits_type::eof()))
+        return 0;
+      if (0 != num_left) {
+        if ('\n' == *s && 1 != num_left) m_mark.push_back(currentMark(pptr() - pbase()));
+        ++s;
+        --num_left;
+      }
+    }
+    return n;
+  }
+
+  int IndexedFileStreamBuf::sync() {
+    if (0 == m_file || pptr() == pbase()) return m_error ? -1 : 0;
+    std::chrono::steady_clock::time_point time = std::chrono::steady_clock::now();
+    if (std::chrono::steady_clock::time_point() == m_block_time) m_block_time = time;
+    // An error is written at once, in case the process is about to die.
+    if (eError == GetMessageType() || s_max_delay <= time - m_block_time) {
+      // End the block after the last complete line if there is one, otherwise use the whole block.
+      char * newline = std::find(std::reverse_iterator<char *>(pptr()), std::reverse_iterator<char *>(pbase()), '\n')
+        .base();
+      writeBlock((newline != pbase() ? newline : pptr()) - pbase());
+    }
+    return m_error ? -1 : 0;
+  }
+
+  IndexedFileStreamBuf::LineMark IndexedFileStreamBuf::currentMark(std::size_t begin) const {
+    const std::string & component(GetMessageComponent());
+    LineMark mark = { begin, now(), { 0, 0 }, GetMessageType() };
+    if (!component.empty()) {
+      mark.m_hash[0] = hashName(component.data(), component.size());
+      mark.m_hash[1] = hashName(component.data(), std::min(component.find("::"), component.size()));
+    }
+    return mark;
+  }
+
+  void IndexedFileStreamBuf::markLine() {
+    if (pptr() != pbase() && '\n' != pptr()[-1]) return;
+    m_mark.push_back(currentMark(pptr() - pbase()));
+  }
+
+  void IndexedFileStreamBuf::writeBlock(std::size_t size) {
+    IndexBlock block;
+    block.m_size = static_cast<unsigned int>(size);
+    block.m_num_lines = 0;
+    block.m_type_mask = 0;
+    block.m_flags = 0;
+    std::fill(block.m_filter, block.m_filter + 4, 0ull);
+
+    // Lines begun by single characters rather than by strings have no mark, and are taken to have no component.
+    std::vector<LineMark>::iterator mark_end = m_mark.begin();
+    while (m_mark.end() != mark_end && size > mark_end->m_begin) ++mark_end;
+
+    // Each line has the type of the message which wrote it. Only lines with no mark, or written outside any
+    // message, are classified by their prefix.
+    std::vector<LineMark>::iterator mark = m_mark.begin();
+    for (const char * line = pbase(); line != pbase() + size; ++block.m_num_lines) {
+      const char * end = std::find(line, static_cast<const char *>(pbase() + size), '\n');
+      std::size_t begin = line - pbase();
+      while (mark_end != mark && begin > mark->m_begin) ++mark;
+      if (mark_end != mark && begin == mark->m_begin && eNumMessageTypes != mark->m_type)
+        block.m_type_mask |= 1u << mark->m_type;
+      else
+        block.m_type_mask |= 1u << ClassifyLine(line, end - line);
+      line = end == pbase() + size ? end : end + 1;
+    }
+    if (m_mark.begin() == mark_end || 0 != m_mark.front().m_begin) block.m_flags |= IndexBlock::eUntagged;
+    block.m_begin_time = m_mark.begin() == mark_end ? now() : m_mark.front().m_time;
+    block.m_end_time = m_mark.begin() == mark_end ? block.m_begin_time : mark_end[-1].m_time;
+    for (std::vector<LineMark>::iterator itor = m_mark.begin(); itor != mark_end; ++itor) {
+      if (0 == itor->m_hash[0]) {
+        block.m_flags |= IndexBlock::eUntagged;
+      } else {
+        addHash(block.m_filter, itor->m_hash[0]);
+        addHash(block.m_filter, itor->m_hash[1]);
+      }
+    }
+
+    // Write the block, then its record, flushing both so that a log left behind by a crashed process is indexed up
+    // to its last complete block. The block ends where the log now stands, even if other streams have appended to
+    // the log since this one was opened.
+    unsigned char record[IndexBlock::s_record_size];
+    long end = -1;
+    if (size != std::fwrite(pbase(), 1, size, m_file) || 0 != std::fflush(m_file) || 0 > (end = std::ftell(m_file)))
+      m_error = true;
+    block.m_offset = 0 > end ? 0 : static_cast<unsigned long long>(end) - size;
+    encode(block, record);
+    if (m_error || IndexBlock::s_record_size != std::fwrite(record, 1, IndexBlock::s_record_size, m_index) ||
+      0 != std::fflush(m_index))
+      m_error = true;
+
+    // Start the next block with whatever was not written.
+    m_mark.erase(m_mark.begin(), mark_end);
+    for (std::vector<LineMark>::iterator itor = m_mark.begin(); itor != m_mark.end(); ++itor) itor->m_begin -= size;
+    std::size_t remaining = pptr() - pbase() - size;
+    std::memmove(pbase(), pbase() + size, remaining);
+    if (m_block_size < m_block.size() && m_block_size > remaining) m_block.resize(m_block_size);
+    setp(&m_block.front(), &m_block.front() + m_block.size());
+    pbump(int(remaining));
+    m_block_time = 0 == remaining ? std::chrono::steady_clock::time_point() : std::chrono::steady_clock::now();
+  }
+
+  IndexedFileStream::IndexedFileStream(const std::string & file_name, bool append, std::size_t block_size):
+    std::ostream(0), m_buf(file_name, append, block_size) { rdbuf(&m_buf); }
+
+  IndexedFileStream::~IndexedFileStream() {}
+
+  void IndexedFileStream::close() {
+    flush();
+    m_buf.close();
+  }
+
+  const long long LogIndex::s_min_time;
+  const long long LogIndex::s_max_time;
+
+  LogIndex::LogIndex(const std::string & file_name): m_file_name(file_name), m_block() {
+    std::string index_name = getIndexName(file_name);
+    std::FILE * index = openFile(index_name, "rb");
+    char magic[s_magic_size];
+    std::vector<IndexBlock> indexed;
+    bool valid = s_magic_size == std::fread(magic, 1, s_magic_size, index) &&
+      0 == std::memcmp(magic, s_magic, s_magic_size);
+    unsigned char record[IndexBlock::s_record_size];
+    while (valid && IndexBlock::s_record_size == std::fread(record, 1, IndexBlock::s_record_size, index)) {
+      indexed.push_back(IndexBlock());
+      decode(record, indexed.back());
+    }
+    std::fclose(index);
+    if (!valid) throw std::runtime_error("st_stream::LogIndex: file \"" + index_name + "\" is not a log index");
+    // Streams appending to the same log may write their records out of order.
+    std::stable_sort(indexed.begin(), indexed.end(), lessOffset);
+
+    std::FILE * log = openFile(file_name, "rb");
+    std::fseek(log, 0, SEEK_END);
+    unsigned long long log_size = std::ftell(log);
+    std::fclose(log);
+
+    // Any part of the log not covered by the index, e.g. written without an index, or after the last complete block.
+    unsigned long long offset = 0;
+    for (std::vector<IndexBlock>::iterator itor = indexed.begin(); itor != indexed.end(); ++itor) {
+      if (offset < itor->m_offset) m_block.push_back(unindexedBlock(offset, itor->m_offset - offset));
+      m_block.push_back(*itor);
+      offset = itor->m_offset + itor->m_size;
+    }
+    if (offset < log_size) m_block.push_back(unindexedBlock(offset, log_size - offset));
+  }
+
+  std::vector<IndexBlock> LogIndex::select(unsigned int type_mask, const std::string & component, long long begin_time,
+    long long end_time) const {
+    std::vector<IndexBlock> selected;
+    for (std::vector<IndexBlock>::const_iterator itor = m_block.begin(); itor != m_block.end(); ++itor) {
+      if (0 != (type_mask & itor->m_type_mask) && (component.empty() || itor->mayContain(component)) &&
+        itor->overlaps(begin_time, end_time))
+        selected.push_back(*itor);
+    }
+    return selected;
+  }
+
+  void LogIndex::read(const IndexBlock & block, std::string & text) const {
+    std::FILE * log = openFile(m_file_name, "rb");
+    text.resize(block.m_size);
+    bool ok = 0 == std::fseek(log, long(block.m_offset), SEEK_SET) &&
+      (0 == block.m_size || block.m_size == std::fread(&text[0], 1, block.m_size, log));
+    std::fclose(log);
+    if (!ok) throw std::runtime_error("st_stream::LogIndex: could not read from file \"" + m_file_name + "\"");
+  }
+
+  std::string LogIndex::getIndexName(const std::string & file_name) { return file_name + ".idx"; }
+
+}
@@ -0,0 +1,67 @@
+/** \file MessageBuffer.cxx
+    \brief Implementation of MessageBuffer class.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <atomic>
+#include <vector>
+
+#include "st_stream/MessageBuffer.h"
+
+namespace {
+
+  std::atomic<unsigned long long> s_num_allocations(0);
+
+  // Set when the calling thread's pool has been destroyed, so buffers used later during thread exit (e.g. by
+  // other thread-local objects) are allocated and freed individually.
+  thread_local bool s_pool_destroyed = false;
+
+  /** \brief Buffers not currently lent out by one thread. The buffers are deleted when the thread exits.
+  */
+  struct Pool {
+    ~Pool() {
+      s_pool_destroyed = true;
+      for (std::vector<std::string *>::iterator itor = m_free.begin(); itor != m_free.end(); ++itor) delete *itor;
+    }
+
+    std::vector<std::string *> m_free;
+  };
+
+  Pool * getPool() {
+    if (s_pool_destroyed) return 0;
+    static thread_local Pool s_pool;
+    return &s_pool;
+  }
+
+}
+
+namespace st_stream {
+
+  const std::size_t MessageBuffer::s_max_capacity;
+
+  MessageBuffer::MessageBuffer(): m_buf(0), m_capacity(0) {
+    Pool * pool = getPool();
+    if (0 == pool || pool->m_free.empty()) {
+      s_num_allocations.fetch_add(1, std::memory_order_relaxed);
+      m_buf = new std::string;
+      m_buf->reserve(256);
+    } else {
+      m_buf = pool->m_free.back();
+      pool->m_free.pop_back();
+    }
+    m_capacity = m_buf->capacity();
+  }
+
+  MessageBuffer::~MessageBuffer() {
+    if (m_buf->capacity() != m_capacity) s_num_allocations.fetch_add(1, std::memory_order_relaxed);
+    Pool * pool = getPool();
+    if (0 == pool || s_max_capacity < m_buf->capacity()) {
+      delete m_buf;
+    } else {
+      m_buf->clear();
+      pool->m_free.push_back(m_buf);
+    }
+  }
+
+  unsigned long long GetNumBufferAllocations() { return s_num_allocations.load(std::memory_order_relaxed); }
+
+}
@@ -0,0 +1,299 @@
+/** \file Metrics.cxx
+    \brief Implementation of metrics and their periodic reporting.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <pthread.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "st_stream/Metrics.h"
+#include "st_stream/StreamFormatter.h"
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  using namespace st_stream;
+
+  /** \brief All live metrics, the final summaries of metrics which have been destroyed since the last report, and
+             the time of the last report.
+  */
+  struct Registry {
+    Registry(): m_mutex(), m_metric(), m_retired(), m_last_report(std::chrono::steady_clock::now()) {}
+
+    double elapsed() const {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_last_report).count();
+    }
+
+    std::mutex m_mutex;
+    std::vector<Metric *> m_metric;
+    std::vector<std::string> m_retired;
+    std::chrono::steady_clock::time_point m_last_report;
+  };
+
+  Registry * createRegistry();
+
+  Registry & getRegistry() {
+    // Never destroyed, so that metrics destroyed during static destruction can still find it.
+    static Registry * s_registry = createRegistry();
+    return *s_registry;
+  }
+
+  /** \brief Background thread which reports metrics periodically.
+  */
+  class Reporter {
+    public:
+      Reporter(): m_mutex(), m_cond(), m_thread(), m_period_ms(10000), m_stop(false) {}
+
+      ~Reporter() { stop(); }
+
+      void start(unsigned int period_ms) {
+        stop();
+        m_period_ms = 0 == period_ms ? 1 : period_ms;
+        m_stop = false;
+        m_thread = std::thread(&Reporter::run, this);
+      }
+
+      void stop() {
+        if (!m_thread.joinable()) return;
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_stop = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+      }
+
+      // Called in a child process, where the thread does not exist. The objects it was using are replaced rather
+      // than destroyed, since destroying them could wait for it forever.
+      void restartInChild() {
+        bool running = m_thread.joinable();
+        new (&m_mutex) std::mutex;
+        new (&m_cond) std::condition_variable;
+        new (&m_thread) std::thread;
+        if (running) start(m_period_ms);
+      }
+
+    private:
+      void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop) {
+          m_cond.wait_for(lock, std::chrono::milliseconds(m_period_ms));
+          if (m_stop) break;
+          lock.unlock();
+          ReportMetrics();
+          lock.lock();
+        }
+      }
+
+      std::mutex m_mutex;
+      std::condition_variable m_cond;
+      std::thread m_thread;
+      unsigned int m_period_ms;
+      bool m_stop;
+  };
+
+  Reporter & getReporter() {
+    // Never destroyed; the thread is stopped by reportAtExit instead.
+    static Reporter * s_reporter = new Reporter;
+    return *s_reporter;
+  }
+
+  void reportAtExit() {
+    getReporter().stop();
+    ReportMetrics();
+  }
+
+  void prepareFork() {
+    SinkLock::prepareFork();
+    getRegistry().m_mutex.lock();
+  }
+
+  void parentFork() {
+    getRegistry().m_mutex.unlock();
+    SinkLock::parentFork();
+  }
+
+  void childFork() {
+    getRegistry().m_mutex.unlock();
+    SinkLock::childFork();
+    getReporter().restartInChild();
+  }
+
+  Registry * createRegistry() {
+    pthread_atfork(prepareFork, parentFork, childFork);
+    return new Registry;
+  }
+
+}
+
+namespace st_stream {
+
+  Metric::~Metric() {
+    // Normally already done by the derived class.
+    if (!m_retired) {
+      Registry & registry(getRegistry());
+      std::lock_guard<std::mutex> lock(registry.m_mutex);
+      registry.m_metric.erase(std::remove(registry.m_metric.begin(), registry.m_metric.end(), this),
+        registry.m_metric.end());
+    }
+  }
+
+  const std::string & Metric::getName() const { return m_name; }
+
+  Metric::Metric(const std::string & name): m_name(name), m_retired(false) { registerMetric(); }
+
+  Metric::Metric(const StreamFormatter & os, const std::string & name): m_name(os.getClassName()), m_retired(false) {
+    if (!m_name.empty()) m_name += '.';
+    m_name += name;
+    registerMetric();
+  }
+
+  void Metric::retire() {
+    if (m_retired) return;
+    Registry & registry(getRegistry());
+    std::lock_guard<std::mutex> lock(registry.m_mutex);
+    std::ostringstream summary;
+    summarize(summary, registry.elapsed());
+    registry.m_retired.push_back(summary.str());
+    registry.m_metric.erase(std::remove(registry.m_metric.begin(), registry.m_metric.end(), this),
+      registry.m_metric.end());
+    m_retired = true;
+  }
+
+  void Metric::registerMetric() {
+    Registry & registry(getRegistry());
+    std::lock_guard<std::mutex> lock(registry.m_mutex);
+    registry.m_metric.push_back(this);
+  }
+
+  void Counter::summarize(std::ostream & os, double elapsed) {
+    unsigned long long value = get();
+    os << getName() << '=' << value;
+    if (0. < elapsed) os << " (" << (value - m_reported) / elapsed << "/s)";
+    m_reported = value;
+  }
+
+  void Gauge::summarize(std::ostream & os, double) { os << getName() << '=' << get(); }
+
+  Histogram::Histogram(const std::string & name): Metric(name), m_count(0), m_sum(0.),
+    m_min(std::numeric_limits<double>::infinity()), m_max(-std::numeric_limits<double>::infinity()) { init(); }
+
+  Histogram::Histogram(const StreamFormatter & os, const std::string & name): Metric(os, name), m_count(0), m_sum(0.),
+    m_min(std::numeric_limits<double>::infinity()), m_max(-std::numeric_limits<double>::infinity()) { init(); }
+
+  void Histogram::record(double value) {
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    double sum = m_sum.load(std::memory_order_relaxed);
+    while (!m_sum.compare_exchange_weak(sum, sum + value, std::memory_order_relaxed)) {}
+
+    // Only write the extremes when they change, which soon becomes rare.
+    double old_min = m_min.load(std::memory_order_relaxed);
+    while (value < old_min && !m_min.compare_exchange_weak(old_min, value, std::memory_order_relaxed)) {}
+    double old_max = m_max.load(std::memory_order_relaxed);
+    while (value > old_max && !m_max.compare_exchange_weak(old_max, value, std::memory_order_relaxed)) {}
+
+    // Bucket n holds values up to 2^(n - 32).
+    int index = 0;
+    if (0. < value) {
+      int exponent = 0;
+      std::frexp(value, &exponent);
+      index = std::min(std::max(exponent + s_num_buckets / 2, 0), s_num_buckets - 1);
+    }
+    m_bucket[index].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  double Histogram::getMean() const {
+    unsigned long long count = getCount();
+    return 0 == count ? 0. : m_sum.load(std::memory_order_relaxed) / count;
+  }
+
+  double Histogram::getPercentile(double percent) const {
+    unsigned long long count[s_num_buckets];
+    unsigned long long total = 0;
+    for (int ii = 0; ii != s_num_buckets; ++ii) {
+      count[ii] = m_bucket[ii].load(std::memory_order_relaxed);
+      total += count[ii];
+    }
+    if (0 == total) return 0.;
+
+    // Use the upper limit of the bucket holding the value of the given rank, bounded by the extremes.
+    double fraction = std::min(std::max(percent, 0.), 100.) / 100.;
+    unsigned long long rank = std::max(1ULL, static_cast<unsigned long long>(fraction * total + .5));
+    unsigned long long sum = 0;
+    int index = 0;
+    for (; index != s_num_buckets - 1; ++index) {
+      sum += count[index];
+      if (sum >= rank) break;
+    }
+    double limit = std::ldexp(1., index - s_num_buckets / 2);
+    return std::max(std::min(limit, m_max.load(std::memory_order_relaxed)), m_min.load(std::memory_order_relaxed));
+  }
+
+  void Histogram::summarize(std::ostream & os, double) {
+    unsigned long long count = getCount();
+    os << getName() << "=[n=" << count;
+    if (0 != count) {
+      os << " mean=" << getMean() << " min=" << m_min.load(std::memory_order_relaxed) << " p50=" <<
+        getPercentile(50.) << " p99=" << getPercentile(99.) << " max=" << m_max.load(std::memory_order_relaxed);
+    }
+    os << ']';
+  }
+
+  void Histogram::init() {
+    for (int ii = 0; ii != s_num_buckets; ++ii) m_bucket[ii].store(0, std::memory_order_relaxed);
+  }
+
+  void ReportMetrics() {
+    std::ostringstream line;
+    {
+      Registry & registry(getRegistry());
+      std::lock_guard<std::mutex> lock(registry.m_mutex);
+      if (registry.m_metric.empty() && registry.m_retired.empty()) return;
+
+      const std::string exec_name(GetDisplayName());
+      if (!exec_name.empty()) line << exec_name << ": ";
+      line << "METRICS: ";
+
+      double elapsed = registry.elapsed();
+      registry.m_last_report = std::chrono::steady_clock::now();
+      const char * separator = "";
+      for (std::vector<std::string>::iterator itor = registry.m_retired.begin(); itor != registry.m_retired.end();
+        ++itor) {
+        line << separator << *itor;
+        separator = ", ";
+      }
+      registry.m_retired.clear();
+      for (std::vector<Metric *>::iterator itor = registry.m_metric.begin(); itor != registry.m_metric.end(); ++itor) {
+        line << separator;
+        (*itor)->summarize(line, elapsed);
+        separator = ", ";
+      }
+      line << '\n';
+    }
+
+    SinkLock sink_lock;
+    stlog << line.str() << std::flush;
+  }
+
+  void StartMetricsReporting(unsigned int period_ms) {
+    static bool s_registered = false;
+    if (!s_registered) {
+      std::atexit(reportAtExit);
+      s_registered = true;
+    }
+    getReporter().start(period_ms);
+  }
+
+  void StopMetricsReporting() { getReporter().stop(); }
+
+}
@@ -0,0 +1,97 @@
+/** \file Progress.cxx
+    \brief Implementation of ProgressReporter class.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <unistd.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "st_stream/Progress.h"
+#include "st_stream/Stream.h"
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  /// \brief Write a number of seconds as h:mm:ss.
+  void writeTime(std::ostream & os, double seconds) {
+    unsigned long long total = static_cast<unsigned long long>(std::max(seconds, 0.) + .5);
+    os << total / 3600 << ':' << std::setfill('0') << std::setw(2) << total / 60 % 60 << ':' << std::setw(2) <<
+      total % 60 << std::setfill(' ');
+  }
+
+}
+
+namespace st_stream {
+
+  ProgressReporter::ProgressReporter(OStream & os, const std::string & label, unsigned long long total,
+    unsigned int period_ms): m_os(os), m_label(label),
+    m_period(std::chrono::duration_cast<clock_type::duration>(std::chrono::milliseconds(period_ms))),
+    m_start(clock_type::now()), m_last_check(m_start), m_last_report(m_start), m_total(total), m_count(0),
+    m_next_check(1), m_last_check_count(0), m_num_reports(0), m_width(0), m_overwrite(false), m_finished(false) {
+    // Only the global streams are known to be connected to a particular file descriptor.
+    int fd = &os == &stout ? STDOUT_FILENO : (&os == &sterr || &os == &stlog ? STDERR_FILENO : -1);
+    m_overwrite = 0 <= fd && 0 != isatty(fd);
+  }
+
+  ProgressReporter::~ProgressReporter() { finish(); }
+
+  void ProgressReporter::finish() {
+    if (m_finished) return;
+    m_finished = true;
+    report(clock_type::now(), true);
+  }
+
+  void ProgressReporter::check() {
+    clock_type::time_point now = clock_type::now();
+
+    // Choose the number of iterations before the next check so that it comes about an eighth of a period from now
+    // at the recent rate, but at most quadruple it, in case the recent iterations were unusually fast.
+    unsigned long long num_iterations = m_count - m_last_check_count;
+    double interval = std::chrono::duration<double>(now - m_last_check).count();
+    double target = std::chrono::duration<double>(m_period).count() / 8.;
+    double stride = 0. < interval ? num_iterations * target / interval : 4. * num_iterations;
+    stride = std::min(stride, 4. * num_iterations);
+    m_next_check = m_count + std::max(1ULL, static_cast<unsigned long long>(stride));
+    m_last_check = now;
+    m_last_check_count = m_count;
+
+    if (now - m_last_report >= m_period) report(now, false);
+  }
+
+  void ProgressReporter::report(clock_type::time_point now, bool final) {
+    double elapsed = std::chrono::duration<double>(now - m_start).count();
+    double rate = 0. < elapsed ? m_count / elapsed : 0.;
+
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(1) << m_label << ": " << m_count;
+    if (0 != m_total) text << '/' << m_total << " (" << 100. * m_count / m_total << "%)";
+    text << ' ' << rate << "/s";
+    if (final) {
+      text << " in ";
+      writeTime(text, elapsed);
+    } else if (0 != m_total && 0. < rate && m_count < m_total) {
+      text << " ETA ";
+      writeTime(text, (m_total - m_count) / rate);
+    }
+
+    std::string line;
+    if (m_overwrite) {
+      // Return to the start of the line, and blank out whatever is left of a longer previous report.
+      line = '\r' + text.str();
+      std::string::size_type width = line.size();
+      if (m_width > width) line.append(m_width - width, ' ');
+      m_width = width;
+      if (final) line += '\n';
+    } else {
+      line = text.str() + '\n';
+    }
+
+    SinkLock sink_lock;
+    m_os << line << std::flush;
+    m_last_report = now;
+    ++m_num_reports;
+  }
+
+}
@@ -0,0 +1,217 @@
+/** \file RuntimeControl.cxx
+    \brief Implementation of runtime reconfiguration of chatter and debug settings through a control file and signals.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  // Set by the SIGUSR1 handler to request that the control file be re-read.
+  std::atomic<bool> s_reload_requested(false);
+
+  extern "C" void handleReload(int) { s_reload_requested.store(true); }
+
+  extern "C" void handleToggleDebug(int) {
+    // Only lock-free atomic operations are used, so this is safe in a signal handler.
+    st_stream::SetDebugMode(!st_stream::GetDebugMode());
+  }
+
+  std::string trim(const std::string & text) {
+    std::string::size_type begin = text.find_first_not_of(" \t\r");
+    if (std::string::npos == begin) return std::string();
+    std::string::size_type end = text.find_last_not_of(" \t\r");
+    return text.substr(begin, end + 1 - begin);
+  }
+
+  bool parseUnsigned(const std::string & text, unsigned int & value) {
+    if (text.empty() || !std::isdigit(static_cast<unsigned char>(text[0]))) return false;
+    std::istringstream iss(text);
+    unsigned int tmp = 0;
+    if (!(iss >> tmp) || !iss.eof()) return false;
+    value = tmp;
+    return true;
+  }
+
+  bool parseBool(const std::string & text, bool & value) {
+    if ("true" == text || "yes" == text || "on" == text || "1" == text) value = true;
+    else if ("false" == text || "no" == text || "off" == text || "0" == text) value = false;
+    else return false;
+    return true;
+  }
+
+  /** \brief Background thread which watches the control file.
+  */
+  class Controller {
+    public:
+      Controller(): m_mutex(), m_cond(), m_thread(), m_file_name(), m_poll_ms(1000), m_mod_time(0), m_stop(false) {}
+
+      ~Controller() { stop(); }
+
+      void start(const std::string & file_name, unsigned int poll_ms) {
+        stop();
+        m_file_name = file_name;
+        m_poll_ms = 0 == poll_ms ? 1 : poll_ms;
+        m_mod_time = modTime();
+        m_stop = false;
+        m_thread = std::thread(&Controller::run, this);
+      }
+
+      void stop() {
+        if (!m_thread.joinable()) return;
+        {
+          std::lock_guard<std::mutex> lock(m_mutex);
+          m_stop = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+      }
+
+      // Called in a child process, where the thread does not exist. The objects it was using are replaced rather
+      // than destroyed, since destroying them could wait for it forever.
+      void restartInChild() {
+        bool running = m_thread.joinable();
+        new (&m_mutex) std::mutex;
+        new (&m_cond) std::condition_variable;
+        new (&m_thread) std::thread;
+        if (running) start(m_file_name, m_poll_ms);
+      }
+
+    private:
+      long long modTime() const {
+        struct stat status;
+        if (m_file_name.empty() || 0 != stat(m_file_name.c_str(), &status)) return 0;
+#ifdef __APPLE__
+        long long nsec = status.st_mtimespec.tv_nsec;
+#else
+        long long nsec = status.st_mtim.tv_nsec;
+#endif
+        return static_cast<long long>(status.st_mtime) * 1000000000LL + nsec;
+      }
+
+      void run() {
+        // Check at least this often for a reload requested by a signal.
+        const std::chrono::milliseconds signal_poll(std::min(m_poll_ms, 100U));
+        std::chrono::steady_clock::time_point next_check = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_stop) {
+          m_cond.wait_for(lock, signal_poll);
+          if (m_stop) break;
+
+          bool reload = s_reload_requested.exchange(false);
+          if (std::chrono::steady_clock::now() >= next_check) {
+            next_check = std::chrono::steady_clock::now() + std::chrono::milliseconds(m_poll_ms);
+            long long mod_time = modTime();
+            if (mod_time != m_mod_time) {
+              m_mod_time = mod_time;
+              reload = reload || 0 != mod_time;
+            }
+          }
+          if (reload && !m_file_name.empty()) st_stream::ApplyControlFile(m_file_name);
+        }
+      }
+
+      std::mutex m_mutex;
+      std::condition_variable m_cond;
+      std::thread m_thread;
+      std::string m_file_name;
+      unsigned int m_poll_ms;
+      long long m_mod_time;
+      bool m_stop;
+  };
+
+  Controller & getController() {
+    static Controller s_controller;
+    return s_controller;
+  }
+
+  void childFork() { getController().restartInChild(); }
+
+}
+
+namespace st_stream {
+
+  bool ApplyControlFile(const std::string & file_name) {
+    std::ifstream control(file_name.c_str());
+    if (!control) return false;
+
+    bool status = true;
+    bool has_max_chat = false;
+    unsigned int max_chat = 0;
+    bool has_debug_mode = false;
+    bool debug_mode = false;
+    std::map<std::string, unsigned int> component_chat;
+
+    std::string line;
+    while (std::getline(control, line)) {
+      line = trim(line);
+      if (line.empty() || '#' == line[0]) continue;
+
+      std::string::size_type equals = line.find('=');
+      if (std::string::npos == equals) { status = false; continue; }
+      std::string value = trim(line.substr(equals + 1));
+
+      // Split the key into a setting name and an optional component name.
+      std::istringstream key(line.substr(0, equals));
+      std::string name;
+      std::string component;
+      std::string extra;
+      key >> name >> component >> extra;
+
+      unsigned int chat = 0;
+      if ("chatter" == name && component.empty() && parseUnsigned(value, chat)) {
+        has_max_chat = true;
+        max_chat = chat;
+      } else if ("chatter" == name && !component.empty() && extra.empty() && parseUnsigned(value, chat)) {
+        component_chat[component] = chat;
+      } else if ("debug" == name && component.empty() && parseBool(value, debug_mode)) {
+        has_debug_mode = true;
+      } else {
+        status = false;
+      }
+    }
+
+    ReplaceComponentChatter(component_chat);
+    if (has_max_chat) SetMaximumChatter(max_chat);
+    if (has_debug_mode) SetDebugMode(debug_mode);
+
+    return status;
+  }
+
+  void EnableRuntimeControl(const std::string & control_file, unsigned int poll_ms) {
+    // Make sure the settings exist before a signal handler can touch them.
+    SetDebugMode(GetDebugMode());
+    std::signal(SIGUSR1, handleReload);
+    std::signal(SIGUSR2, handleToggleDebug);
+    static bool s_registered = false;
+    if (!s_registered) {
+      pthread_atfork(0, 0, childFork);
+      s_registered = true;
+    }
+    getController().start(control_file, poll_ms);
+  }
+
+  void DisableRuntimeControl() {
+    std::signal(SIGUSR1, SIG_DFL);
+    std::signal(SIGUSR2, SIG_DFL);
+    getController().stop();
+  }
+
+}
@@ -0,0 +1,239 @@
+/** \file ScopeTimer.cxx
+    \brief Implementation of TimerSite and ScopeTimer classes.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+#include "st_stream/ScopeTimer.h"
+#include "st_stream/StreamFormatter.h"
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  using namespace st_stream;
+
+  /** \brief One row of the summary table.
+  */
+  struct Row {
+    std::string m_name;
+    unsigned long long m_count;
+    unsigned long long m_total;
+    unsigned long long m_min;
+    unsigned long long m_p50;
+    unsigned long long m_p90;
+    unsigned long long m_p99;
+    unsigned long long m_max;
+  };
+
+  Row makeRow(const TimerSite & site) {
+    Row row = { site.getName(), site.getCount(), site.getTotal(), site.getMinimum(), site.getPercentile(50.),
+      site.getPercentile(90.), site.getPercentile(99.), site.getMaximum() };
+    return row;
+  }
+
+  /** \brief All live sites, and the statistics of sites which have been destroyed, so that sites declared as
+             static objects can still be reported when the process exits.
+  */
+  struct Registry {
+    Registry(): m_mutex(), m_site(), m_retired(), m_report_at_exit(false) {}
+
+    std::mutex m_mutex;
+    std::vector<const TimerSite *> m_site;
+    std::vector<Row> m_retired;
+    bool m_report_at_exit;
+  };
+
+  Registry & getRegistry() {
+    // Never destroyed, so that sites destroyed during static destruction can still find it.
+    static Registry * s_registry = new Registry;
+    return *s_registry;
+  }
+
+  void reportAtExit() {
+    bool report = false;
+    {
+      Registry & registry(getRegistry());
+      std::lock_guard<std::mutex> lock(registry.m_mutex);
+      report = registry.m_report_at_exit;
+    }
+    if (report) ReportTimers(stlog);
+  }
+
+  std::string microseconds(unsigned long long nsec) {
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(3) << nsec / 1000.;
+    return oss.str();
+  }
+
+}
+
+namespace st_stream {
+
+  TimerSite::TimerSite(const std::string & name): m_name_mutex(), m_name(name), m_has_name(!name.empty()), m_count(0),
+    m_total(0), m_min(std::numeric_limits<unsigned long long>::max()), m_max(0) {
+    for (unsigned int ii = 0; ii != s_num_buckets; ++ii) m_bucket[ii].store(0, std::memory_order_relaxed);
+    Registry & registry(getRegistry());
+    std::lock_guard<std::mutex> lock(registry.m_mutex);
+    registry.m_site.push_back(this);
+  }
+
+  TimerSite::~TimerSite() {
+    Registry & registry(getRegistry());
+    std::lock_guard<std::mutex> lock(registry.m_mutex);
+    registry.m_site.erase(std::remove(registry.m_site.begin(), registry.m_site.end(), this), registry.m_site.end());
+    if (0 != getCount()) registry.m_retired.push_back(makeRow(*this));
+  }
+
+  void TimerSite::record(unsigned long long nsec) {
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_total.fetch_add(nsec, std::memory_order_relaxed);
+    m_bucket[bucket(nsec)].fetch_add(1, std::memory_order_relaxed);
+
+    // Only write the extremes when they change, which soon becomes rare.
+    unsigned long long old_min = m_min.load(std::memory_order_relaxed);
+    while (nsec < old_min && !m_min.compare_exchange_weak(old_min, nsec, std::memory_order_relaxed)) {}
+    unsigned long long old_max = m_max.load(std::memory_order_relaxed);
+    while (nsec > old_max && !m_max.compare_exchange_weak(old_max, nsec, std::memory_order_relaxed)) {}
+  }
+
+  std::string TimerSite::getName() const {
+    std::lock_guard<std::mutex> lock(m_name_mutex);
+    return m_name;
+  }
+
+  void TimerSite::setDefaultName(const std::string & name) {
+    std::lock_guard<std::mutex> lock(m_name_mutex);
+    if (m_name.empty()) m_name = name;
+    m_has_name.store(true, std::memory_order_release);
+  }
+
+  unsigned long long TimerSite::getMinimum() const {
+    return 0 == getCount() ? 0 : m_min.load(std::memory_order_relaxed);
+  }
+
+  unsigned long long TimerSite::getPercentile(double percent) const {
+    unsigned long long count[s_num_buckets];
+    unsigned long long total = 0;
+    for (unsigned int ii = 0; ii != s_num_buckets; ++ii) {
+      count[ii] = m_bucket[ii].load(std::memory_order_relaxed);
+      total += count[ii];
+    }
+    if (0 == total) return 0;
+
+    // Find the bucket holding the measurement of the given rank, and use the upper limit of that bucket, bounded by
+    // the extremes actually measured.
+    double fraction = std::min(std::max(percent, 0.), 100.) / 100.;
+    unsigned long long rank = std::max(1ULL, static_cast<unsigned long long>(fraction * total + .5));
+    unsigned long long sum = 0;
+    unsigned int index = 0;
+    for (; index != s_num_buckets - 1; ++index) {
+      sum += count[index];
+      if (sum >= rank) break;
+    }
+    return std::max(std::min(bucketLimit(index), getMaximum()), getMinimum());
+  }
+
+  void TimerSite::reset() {
+    m_count.store(0, std::memory_order_relaxed);
+    m_total.store(0, std::memory_order_relaxed);
+    m_min.store(std::numeric_limits<unsigned long long>::max(), std::memory_order_relaxed);
+    m_max.store(0, std::memory_order_relaxed);
+    for (unsigned int ii = 0; ii != s_num_buckets; ++ii) m_bucket[ii].store(0, std::memory_order_relaxed);
+  }
+
+  unsigned int TimerSite::bucket(unsigned long long nsec) {
+    if (s_sub_buckets > nsec) return static_cast<unsigned int>(nsec);
+
+    // Index of the highest bit, then the next two bits below it.
+    unsigned int exponent = 0;
+    for (unsigned long long value = nsec; 1 < value; value >>= 1) ++exponent;
+    return exponent * s_sub_buckets + static_cast<unsigned int>((nsec >> (exponent - 2)) & (s_sub_buckets - 1));
+  }
+
+  unsigned long long TimerSite::bucketLimit(unsigned int index) {
+    if (2 * s_sub_buckets > index) return index;
+    unsigned int exponent = index / s_sub_buckets;
+    unsigned long long sub = index % s_sub_buckets;
+    return ((s_sub_buckets + sub + 1) << (exponent - 2)) - 1;
+  }
+
+  ScopeTimer::ScopeTimer(StreamFormatter & os, TimerSite & site): m_os(os), m_site(site),
+    m_start(std::chrono::steady_clock::now()), m_chat_level(0), m_report(false) { nameSite(); }
+
+  ScopeTimer::ScopeTimer(StreamFormatter & os, TimerSite & site, unsigned int chat_level): m_os(os), m_site(site),
+    m_start(std::chrono::steady_clock::now()), m_chat_level(chat_level), m_report(true) { nameSite(); }
+
+  ScopeTimer::~ScopeTimer() {
+    unsigned long long nsec = elapsed();
+    m_site.record(nsec);
+    if (m_report) {
+      m_os.info(m_chat_level).prefix().format(ST_FORMAT("{} took {:.3f} ms"), m_site.getName(), nsec / 1.e6) <<
+        std::endl;
+    }
+  }
+
+  unsigned long long ScopeTimer::elapsed() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - m_start).count();
+  }
+
+  void ScopeTimer::nameSite() {
+    if (m_site.hasName()) return;
+
+    // Name the site after the class and method, in the style of the formatter's prefixes.
+    const std::string & class_name(m_os.getClassName());
+    const std::string & method_name(m_os.getMethod());
+    std::string name = class_name;
+    if (!class_name.empty() && !method_name.empty()) name += "::";
+    name += method_name;
+    m_site.setDefaultName(name.empty() ? std::string("(unnamed)") : name);
+  }
+
+  void ReportTimers(OStream & os) {
+    std::vector<Row> row;
+    {
+      Registry & registry(getRegistry());
+      std::lock_guard<std::mutex> lock(registry.m_mutex);
+      row = registry.m_retired;
+      for (std::vector<const TimerSite *>::iterator itor = registry.m_site.begin(); itor != registry.m_site.end();
+        ++itor)
+        if (0 != (*itor)->getCount()) row.push_back(makeRow(**itor));
+    }
+    if (row.empty()) return;
+
+    std::string::size_type name_width = 4;
+    for (std::vector<Row>::iterator itor = row.begin(); itor != row.end(); ++itor)
+      name_width = std::max(name_width, itor->m_name.size());
+
+    std::ostringstream table;
+    table << std::left << std::setw(name_width) << "Site" << std::right << std::setw(10) << "Count" <<
+      std::setw(14) << "Total (us)" << std::setw(12) << "Mean" << std::setw(12) << "Min" << std::setw(12) << "P50" <<
+      std::setw(12) << "P90" << std::setw(12) << "P99" << std::setw(12) << "Max" << '\n';
+    for (std::vector<Row>::iterator itor = row.begin(); itor != row.end(); ++itor) {
+      table << std::left << std::setw(name_width) << itor->m_name << std::right << std::setw(10) << itor->m_count <<
+        std::setw(14) << microseconds(itor->m_total) << std::setw(12) << microseconds(itor->m_total / itor->m_count) <<
+        std::setw(12) << microseconds(itor->m_min) << std::setw(12) << microseconds(itor->m_p50) <<
+        std::setw(12) << microseconds(itor->m_p90) << std::setw(12) << microseconds(itor->m_p99) <<
+        std::setw(12) << microseconds(itor->m_max) << '\n';
+    }
+
+    SinkLock sink_lock;
+    os << table.str() << std::flush;
+  }
+
+  void SetTimerReportAtExit(bool report_at_exit) {
+    Registry & registry(getRegistry());
+    std::lock_guard<std::mutex> lock(registry.m_mutex);
+    static bool s_registered = false;
+    if (report_at_exit && !s_registered) {
+      std::atexit(reportAtExit);
+      s_registered = true;
+    }
+    registry.m_report_at_exit = report_at_exit;
+  }
+
+}
@@ -0,0 +1,322 @@
+/** \file ShmStream.cxx
+    \brief Implementation of ShmStream class and its shared-memory ring buffer.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <stdexcept>
+#include <thread>
+
+#include "st_stream/ShmStream.h"
+
+namespace {
+
+  // Identifies an initialized ring, and the version of its layout.
+  const unsigned int s_ring_magic = 0x5354524dU;
+  const unsigned int s_ring_version = 1;
+
+  // Flags stored with each slot.
+  const unsigned int s_first_fragment = 0x1U;
+  const unsigned int s_more_fragments = 0x2U;
+
+#if ATOMIC_LLONG_LOCK_FREE != 2
+#error "st_stream::ShmStream requires lock-free 64 bit atomics"
+#endif
+
+  /** \brief Layout of the beginning of the shared-memory object. The slots follow immediately after.
+  */
+  struct RingHeader {
+    std::atomic<unsigned int> m_magic;
+    unsigned int m_version;
+    unsigned long long m_num_slots;
+    unsigned long long m_slot_size;
+    // Total number of slots ever reserved by writers.
+    std::atomic<unsigned long long> m_head;
+  };
+
+  /** \brief Layout of the beginning of each slot. The payload follows immediately after.
+
+             The sequence number of a slot holding record number n is 2 * n + 1 while it is being written, and
+             2 * n + 2 once it is complete.
+  */
+  struct SlotHeader {
+    std::atomic<unsigned long long> m_seq;
+    unsigned int m_length;
+    unsigned int m_flags;
+  };
+
+  std::size_t headerSize() {
+    // Keep slots aligned.
+    return (sizeof(RingHeader) + 63) / 64 * 64;
+  }
+
+  std::string sysError(const std::string & what, const std::string & name) {
+    return "st_stream::ShmStream: " + what + " \"" + name + "\": " + std::strerror(errno);
+  }
+
+}
+
+namespace st_stream {
+
+  /** \brief Process-local handle to a mapped ring.
+  */
+  struct ShmRing {
+    ShmRing(const std::string & name, std::size_t num_slots, std::size_t slot_size, bool writable);
+
+    ~ShmRing();
+
+    SlotHeader * slot(unsigned long long record) const {
+      return reinterpret_cast<SlotHeader *>(m_slots + (record % m_num_slots) * m_slot_size);
+    }
+
+    char * payload(SlotHeader * slot) const { return reinterpret_cast<char *>(slot) + sizeof(SlotHeader); }
+
+    void * m_addr;
+    std::size_t m_size;
+    RingHeader * m_header;
+    char * m_slots;
+    unsigned long long m_num_slots;
+    unsigned long long m_slot_size;
+    std::size_t m_payload_size;
+  };
+
+  ShmRing::ShmRing(const std::string & name, std::size_t num_slots, std::size_t slot_size, bool writable):
+    m_addr(0), m_size(0), m_header(0), m_slots(0), m_num_slots(0), m_slot_size(0), m_payload_size(0) {
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    bool created = false;
+    int fd = -1;
+
+    if (writable) {
+      // Round slot size up to keep slot headers aligned, and make sure there is room for a payload.
+      slot_size = std::max<std::size_t>((slot_size + 7) / 8 * 8, 2 * sizeof(SlotHeader));
+      num_slots = std::max<std::size_t>(num_slots, 1);
+
+      // Try to be the process which creates the ring.
+      fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+      if (0 <= fd) {
+        created = true;
+        if (0 != ftruncate(fd, headerSize() + num_slots * slot_size)) {
+          std::string msg = sysError("could not size shared memory", name);
+          close(fd);
+          shm_unlink(name.c_str());
+          throw std::runtime_error(msg);
+        }
+      } else if (EEXIST == errno) {
+        fd = shm_open(name.c_str(), O_RDWR, 0);
+      }
+    } else {
+      fd = shm_open(name.c_str(), O_RDONLY, 0);
+    }
+    if (0 > fd) throw std::runtime_error(sysError("could not open shared memory", name));
+
+    // Another process may still be sizing the object it just created.
+    struct stat status;
+    status.st_size = 0;
+    for (int ii = 0; 0 == fstat(fd, &status) && 0 == status.st_size && ii < 1000; ++ii)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    if (headerSize() >= std::size_t(status.st_size)) {
+      close(fd);
+      throw std::runtime_error("st_stream::ShmStream: shared memory \"" + name + "\" is not a ring buffer");
+    }
+
+    m_size = status.st_size;
+    m_addr = mmap(0, m_size, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == m_addr) throw std::runtime_error(sysError("could not map shared memory", name));
+
+    m_header = static_cast<RingHeader *>(m_addr);
+    m_slots = static_cast<char *>(m_addr) + headerSize();
+
+    if (created) {
+      // Fresh memory is zero-filled, so only the atomics need to be constructed. The magic number is set last
+      // so that other processes do not use the ring before it is ready.
+      new (&m_header->m_head) std::atomic<unsigned long long>(0);
+      for (std::size_t ii = 0; ii != num_slots; ++ii)
+        new (m_slots + ii * slot_size) std::atomic<unsigned long long>(0);
+      m_header->m_version = s_ring_version;
+      m_header->m_num_slots = num_slots;
+      m_header->m_slot_size = slot_size;
+      new (&m_header->m_magic) std::atomic<unsigned int>(0);
+      m_header->m_magic.store(s_ring_magic, std::memory_order_release);
+    } else {
+      for (int ii = 0; s_ring_magic != m_header->m_magic.load(std::memory_order_acquire) && ii < 1000; ++ii)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    if (s_ring_magic != m_header->m_magic.load(std::memory_order_acquire) || s_ring_version != m_header->m_version ||
+      m_size < headerSize() + m_header->m_num_slots * m_header->m_slot_size) {
+      munmap(m_addr, m_size);
+      throw std::runtime_error("st_stream::ShmStream: shared memory \"" + name + "\" is not a valid ring buffer");
+    }
+
+    m_num_slots = m_header->m_num_slots;
+    m_slot_size = m_header->m_slot_size;
+    m_payload_size = m_slot_size - sizeof(SlotHeader);
+  }
+
+  ShmRing::~ShmRing() { munmap(m_addr, m_size); }
+
+  const std::size_t ShmStreamBuf::s_default_num_slots;
+  const std::size_t ShmStreamBuf::s_default_slot_size;
+
+  ShmStreamBuf::ShmStreamBuf(const std::string & name, std::size_t num_slots, std::size_t slot_size):
+    std::streambuf(), m_ring(new ShmRing(name, num_slots, slot_size, true)), m_line() {}
+
+  ShmStreamBuf::~ShmStreamBuf() {
+    // Do not lose a final line which was not terminated.
+    if (!m_line.empty()) commit();
+    delete m_ring;
+  }
+
+  ShmStreamBuf::int_type ShmStreamBuf::overflow(int_type c) {
+    if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+    if ('\n' == traits_type::to_char_type(c)) commit();
+    else m_line += traits_type::to_char_type(c);
+    return c;
+  }
+
+  std::streamsize ShmStreamBuf::xsputn(const char * s, std::streamsize n) {
+    const char * end = s + n;
+    for (const char * begin = s; begin != end; ) {
+      const char * newline = std::find(begin, end, '\n');
+      m_line.append(begin, newline);
+      if (newline == end) break;
+      commit();
+      begin = newline + 1;
+    }
+    return n;
+  }
+
+  void ShmStreamBuf::commit() {
+    std::size_t payload_size = m_ring->m_payload_size;
+
+    // Number of slots needed for this line. Lines too long for the whole ring are truncated.
+    unsigned long long num_frag = std::max<std::size_t>(1, (m_line.size() + payload_size - 1) / payload_size);
+    num_frag = std::min(num_frag, m_ring->m_num_slots);
+
+    // Reserve consecutive slots for the whole line, so that fragments from different writers never interleave.
+    unsigned long long first = m_ring->m_header->m_head.fetch_add(num_frag, std::memory_order_acq_rel);
+
+    const char * data = m_line.data();
+    std::size_t remaining = m_line.size();
+    for (unsigned long long ii = 0; ii != num_frag; ++ii) {
+      unsigned long long record = first + ii;
+      SlotHeader * slot = m_ring->slot(record);
+
+      // Mark slot as being written, then fill it, then mark it complete.
+      slot->m_seq.store(2 * record + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+
+      std::size_t length = std::min(remaining, payload_size);
+      std::memcpy(m_ring->payload(slot), data, length);
+      slot->m_length = length;
+      slot->m_flags = (0 == ii ? s_first_fragment : 0) | (ii + 1 != num_frag ? s_more_fragments : 0);
+      data += length;
+      remaining -= length;
+
+      slot->m_seq.store(2 * record + 2, std::memory_order_release);
+    }
+
+    m_line.clear();
+  }
+
+  ShmStream::ShmStream(const std::string & name, std::size_t num_slots, std::size_t slot_size):
+    std::ostream(0), m_buf(name, num_slots, slot_size) { rdbuf(&m_buf); }
+
+  ShmStream::~ShmStream() {}
+
+  void ShmStream::remove(const std::string & name) { shm_unlink(name.c_str()); }
+
+  const std::chrono::milliseconds ShmReader::s_default_max_wait(1000);
+
+  ShmReader::ShmReader(const std::string & name, std::chrono::milliseconds max_wait):
+    m_ring(new ShmRing(name, 0, 0, false)), m_wait_start(), m_max_wait(max_wait), m_next(0),
+    m_wait_record(std::numeric_limits<unsigned long long>::max()), m_num_lost(0), m_pending(), m_in_line(false) {
+    // Start with the oldest record which has not yet been overwritten.
+    unsigned long long head = m_ring->m_header->m_head.load(std::memory_order_acquire);
+    if (head > m_ring->m_num_slots) m_next = head - m_ring->m_num_slots;
+  }
+
+  ShmReader::~ShmReader() { delete m_ring; }
+
+  bool ShmReader::read(std::string & line) {
+    std::string fragment;
+    while (true) {
+      unsigned long long head = m_ring->m_header->m_head.load(std::memory_order_acquire);
+      if (m_next >= head) return false;
+
+      // If writers lapped this reader, skip to the oldest record still present.
+      if (head - m_next > m_ring->m_num_slots) {
+        m_num_lost += head - m_ring->m_num_slots - m_next;
+        m_next = head - m_ring->m_num_slots;
+        m_in_line = false;
+      }
+
+      SlotHeader * slot = m_ring->slot(m_next);
+      unsigned long long expected = 2 * m_next + 2;
+      unsigned long long seq = slot->m_seq.load(std::memory_order_acquire);
+
+      // Record reserved, but its writer has not finished with it. Wait for it a while, but not for a writer which
+      // will never finish.
+      if (seq < expected) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        if (m_wait_record != m_next) {
+          m_wait_record = m_next;
+          m_wait_start = now;
+        }
+        if (m_max_wait > now - m_wait_start) return false;
+        // Give up on it; it is counted as lost below.
+        seq = 0;
+      }
+
+      bool valid = seq == expected;
+      unsigned int flags = 0;
+      if (valid) {
+        std::size_t length = std::min<std::size_t>(slot->m_length, m_ring->m_payload_size);
+        flags = slot->m_flags;
+        fragment.assign(m_ring->payload(slot), length);
+
+        // Make sure the slot was not reused while it was being copied.
+        std::atomic_thread_fence(std::memory_order_acquire);
+        valid = slot->m_seq.load(std::memory_order_relaxed) == expected;
+      }
+      ++m_next;
+
+      if (!valid) {
+        ++m_num_lost;
+        m_in_line = false;
+        continue;
+      }
+
+      if (0 != (flags & s_first_fragment)) {
+        m_pending.swap(fragment);
+        m_in_line = true;
+      } else if (m_in_line) {
+        m_pending += fragment;
+      } else {
+        // Tail of a line whose beginning was lost.
+        continue;
+      }
+
+      if (0 == (flags & s_more_fragments)) {
+        line.swap(m_pending);
+        m_pending.clear();
+        m_in_line = false;
+        return true;
+      }
+    }
+  }
+
+  unsigned long long ShmReader::getNumLost() const { return m_num_lost; }
+
+}
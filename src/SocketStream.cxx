@@ -0,0 +1,339 @@
+/** \file SocketStream.cxx
+    \brief Implementation of SocketStream and SocketCollector classes.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <set>
+#include <stdexcept>
+#include <thread>
+
+#include "st_stream/SocketStream.h"
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  using namespace st_stream;
+
+  /** \brief All live buffers, and the background thread which sends their batches once they have waited too long.
+  */
+  struct Flusher {
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::thread m_thread;
+    std::set<SocketStreamBuf *> m_buf;
+    bool m_stop;
+  };
+
+  Flusher & getFlusher();
+
+  void stopFlusher() {
+    Flusher & flusher(getFlusher());
+    {
+      std::lock_guard<std::mutex> lock(flusher.m_mutex);
+      flusher.m_stop = true;
+    }
+    flusher.m_cond.notify_all();
+    if (flusher.m_thread.joinable()) flusher.m_thread.join();
+  }
+
+  void prepareFork() {
+    SinkLock::prepareFork();
+    SocketStreamBuf::prepareFork();
+  }
+
+  void parentFork() {
+    SocketStreamBuf::parentFork();
+    SinkLock::parentFork();
+  }
+
+  void childFork() {
+    SocketStreamBuf::childFork();
+    SinkLock::childFork();
+  }
+
+  Flusher * createFlusher() {
+    pthread_atfork(prepareFork, parentFork, childFork);
+    std::atexit(stopFlusher);
+    Flusher * flusher = new Flusher;
+    flusher->m_stop = false;
+    return flusher;
+  }
+
+  Flusher & getFlusher() {
+    // Never destroyed, so that buffers destroyed during static destruction can still find it. The thread is
+    // stopped at exit instead.
+    static Flusher * s_flusher = createFlusher();
+    return *s_flusher;
+  }
+
+  // Largest datagram the collector accepts.
+  const std::size_t s_max_datagram = 64 * 1024;
+
+  struct sockaddr_un socketAddress(const std::string & socket_path) {
+    struct sockaddr_un address;
+    std::memset(&address, 0, sizeof(address));
+    if (sizeof(address.sun_path) <= socket_path.size())
+      throw std::runtime_error("st_stream::SocketStream: socket path is too long: " + socket_path);
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, socket_path.data(), socket_path.size());
+    return address;
+  }
+
+  int openSocket() {
+    int fd = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (0 > fd)
+      throw std::runtime_error(std::string("st_stream::SocketStream: cannot create socket: ") + std::strerror(errno));
+    return fd;
+  }
+
+  // Return the size of the longest run of whole lines at the start of the text no longer than the given size, or
+  // the given size if the first line is longer.
+  std::size_t wholeLines(const char * s, std::size_t n, std::size_t max_size) {
+    if (n <= max_size) return n;
+    const char * end = std::find(std::reverse_iterator<const char *>(s + max_size),
+      std::reverse_iterator<const char *>(s), '\n').base();
+    return end == s ? max_size : end - s;
+  }
+
+}
+
+namespace st_stream {
+
+  const std::size_t SocketStreamBuf::s_default_batch_size;
+
+  const std::size_t SocketStreamBuf::s_default_max_spill;
+
+  const std::chrono::milliseconds SocketStreamBuf::s_max_delay(100);
+
+  SocketStreamBuf::SocketStreamBuf(const std::string & socket_path, std::size_t batch_size, std::size_t max_spill):
+    std::streambuf(), m_mutex(), m_buf(std::max<std::size_t>(std::min(batch_size, s_max_datagram), 1)), m_spill(),
+    m_socket_path(socket_path), m_batch_time(), m_num_dropped(0), m_size(0), m_max_spill(max_spill), m_fd(-1),
+    m_connected(false) {
+    socketAddress(socket_path);
+    m_fd = openSocket();
+    // No put area is set, so every character reaches overflow() or xsputn(), which take the lock.
+    Flusher & flusher(getFlusher());
+    std::lock_guard<std::mutex> lock(flusher.m_mutex);
+    flusher.m_buf.insert(this);
+    if (!flusher.m_thread.joinable() && !flusher.m_stop) flusher.m_thread = std::thread(&SocketStreamBuf::runFlusher);
+  }
+
+  SocketStreamBuf::~SocketStreamBuf() {
+    {
+      Flusher & flusher(getFlusher());
+      std::lock_guard<std::mutex> lock(flusher.m_mutex);
+      flusher.m_buf.erase(this);
+    }
+    // Send everything, including an incomplete last line.
+    if (0 != m_size) sendBatch(m_size);
+    else sendSpill();
+    ::close(m_fd);
+  }
+
+  bool SocketStreamBuf::drain() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    sendLines();
+    return m_spill.empty();
+  }
+
+  unsigned long long SocketStreamBuf::getNumDropped() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_num_dropped;
+  }
+
+  std::size_t SocketStreamBuf::getSpillSize() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_spill.size();
+  }
+
+  void SocketStreamBuf::prepareFork() {
+    Flusher & flusher(getFlusher());
+    flusher.m_mutex.lock();
+    // Send the complete lines now, or both processes would send them.
+    for (std::set<SocketStreamBuf *>::iterator itor = flusher.m_buf.begin(); itor != flusher.m_buf.end(); ++itor) {
+      (*itor)->m_mutex.lock();
+      (*itor)->sendLines();
+    }
+  }
+
+  void SocketStreamBuf::parentFork() {
+    Flusher & flusher(getFlusher());
+    for (std::set<SocketStreamBuf *>::iterator itor = flusher.m_buf.begin(); itor != flusher.m_buf.end(); ++itor)
+      (*itor)->m_mutex.unlock();
+    flusher.m_mutex.unlock();
+  }
+
+  void SocketStreamBuf::childFork() {
+    // The thread does not exist in the child. The objects it was using are replaced rather than destroyed, since
+    // destroying them could wait for it forever.
+    Flusher & flusher(getFlusher());
+    for (std::set<SocketStreamBuf *>::iterator itor = flusher.m_buf.begin(); itor != flusher.m_buf.end(); ++itor)
+      new (&(*itor)->m_mutex) std::mutex;
+    bool running = flusher.m_thread.joinable();
+    new (&flusher.m_mutex) std::mutex;
+    new (&flusher.m_cond) std::condition_variable;
+    new (&flusher.m_thread) std::thread;
+    if (running) flusher.m_thread = std::thread(&SocketStreamBuf::runFlusher);
+  }
+
+  void SocketStreamBuf::runFlusher() {
+    Flusher & flusher(getFlusher());
+    std::unique_lock<std::mutex> lock(flusher.m_mutex);
+    while (!flusher.m_stop) {
+      flusher.m_cond.wait_for(lock, s_max_delay);
+      for (std::set<SocketStreamBuf *>::iterator itor = flusher.m_buf.begin(); itor != flusher.m_buf.end(); ++itor) {
+        std::lock_guard<std::mutex> buf_lock((*itor)->m_mutex);
+        (*itor)->sendStale();
+      }
+    }
+  }
+
+  SocketStreamBuf::int_type SocketStreamBuf::overflow(int_type c) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (traits_type::eq_int_type(c, traits_type::eof())) {
+      sendLines();
+      return traits_type::not_eof(c);
+    }
+    char ch = traits_type::to_char_type(c);
+    put(&ch, 1);
+    return c;
+  }
+
+  std::streamsize SocketStreamBuf::xsputn(const char * s, std::streamsize n) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    put(s, n);
+    return n;
+  }
+
+  int SocketStreamBuf::sync() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (0 == m_size) return 0;
+    // An error is sent at once, in case the process is about to die.
+    if (eError == GetMessageType() || s_max_delay <= std::chrono::steady_clock::now() - m_batch_time) sendLines();
+    return 0;
+  }
+
+  void SocketStreamBuf::put(const char * s, std::size_t n) {
+    while (0 != n) {
+      if (0 == m_size) m_batch_time = std::chrono::steady_clock::now();
+      std::size_t num_copied = std::min(n, m_buf.size() - m_size);
+      std::memcpy(&m_buf[m_size], s, num_copied);
+      m_size += num_copied;
+      s += num_copied;
+      n -= num_copied;
+      if (m_size == m_buf.size()) {
+        // Send the complete lines, or part of a line longer than a batch.
+        sendLines();
+        if (m_size == m_buf.size()) sendBatch(m_size);
+      }
+    }
+  }
+
+  void SocketStreamBuf::sendLines() {
+    const char * begin = &m_buf.front();
+    const char * end = std::find(std::reverse_iterator<const char *>(begin + m_size),
+      std::reverse_iterator<const char *>(begin), '\n').base();
+    if (end != begin) sendBatch(end - begin);
+    else sendSpill();
+  }
+
+  void SocketStreamBuf::sendStale() {
+    if (0 != m_size && s_max_delay <= std::chrono::steady_clock::now() - m_batch_time) sendLines();
+    else if (!m_spill.empty()) sendSpill();
+  }
+
+  void SocketStreamBuf::sendBatch(std::size_t size) {
+    // Anything spilled goes first, so lines arrive in order.
+    if (!sendSpill() || !sendDatagram(&m_buf.front(), size)) spill(&m_buf.front(), size);
+
+    // The incomplete line left over starts the next batch.
+    m_size -= size;
+    std::memmove(&m_buf.front(), &m_buf.front() + size, m_size);
+    m_batch_time = std::chrono::steady_clock::now();
+  }
+
+  bool SocketStreamBuf::sendSpill() {
+    std::size_t sent = 0;
+    while (sent != m_spill.size()) {
+      std::size_t size = wholeLines(m_spill.data() + sent, m_spill.size() - sent, m_buf.size());
+      if (!sendDatagram(m_spill.data() + sent, size)) break;
+      sent += size;
+    }
+    m_spill.erase(0, sent);
+    return m_spill.empty();
+  }
+
+  bool SocketStreamBuf::sendDatagram(const char * s, std::size_t n) {
+    // (Re)connect each time the collector was not there, so that it may start, or restart, at any time.
+    if (!m_connected) {
+      struct sockaddr_un address = socketAddress(m_socket_path);
+      m_connected = 0 == ::connect(m_fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address));
+      if (!m_connected) return false;
+    }
+    while (true) {
+      if (0 <= ::send(m_fd, s, n, MSG_DONTWAIT | MSG_NOSIGNAL)) return true;
+      if (EINTR == errno) continue;
+      // The collector exited; any other error, such as a full socket buffer, is temporary.
+      if (ECONNREFUSED == errno || ENOTCONN == errno || ENOENT == errno) m_connected = false;
+      return false;
+    }
+  }
+
+  void SocketStreamBuf::spill(const char * s, std::size_t n) {
+    std::size_t kept = m_spill.size() < m_max_spill ? wholeLines(s, n, m_max_spill - m_spill.size()) : 0;
+    // Keep only whole lines.
+    if (kept != n && 0 != kept && '\n' != s[kept - 1]) kept = 0;
+    m_spill.append(s, kept);
+    if (kept != n) {
+      m_num_dropped += std::count(s + kept, s + n, '\n');
+      if ('\n' != s[n - 1]) ++m_num_dropped;
+    }
+  }
+
+  SocketStream::SocketStream(const std::string & socket_path, std::size_t batch_size, std::size_t max_spill):
+    std::ostream(0), m_buf(socket_path, batch_size, max_spill) { rdbuf(&m_buf); }
+
+  SocketStream::~SocketStream() {}
+
+  SocketCollector::SocketCollector(const std::string & socket_path): m_buf(s_max_datagram), m_socket_path(socket_path),
+    m_fd(-1) {
+    struct sockaddr_un address = socketAddress(socket_path);
+    m_fd = openSocket();
+    ::unlink(socket_path.c_str());
+    if (0 != ::bind(m_fd, reinterpret_cast<struct sockaddr *>(&address), sizeof(address))) {
+      std::string error = std::strerror(errno);
+      ::close(m_fd);
+      throw std::runtime_error("st_stream::SocketCollector: cannot bind socket " + socket_path + ": " + error);
+    }
+  }
+
+  SocketCollector::~SocketCollector() {
+    ::close(m_fd);
+    ::unlink(m_socket_path.c_str());
+  }
+
+  bool SocketCollector::receive(std::string & batch, int timeout) {
+    struct pollfd poll_fd = { m_fd, POLLIN, 0 };
+    int status = ::poll(&poll_fd, 1, timeout);
+    if (0 > status && EINTR != errno)
+      throw std::runtime_error(std::string("st_stream::SocketCollector: poll failed: ") + std::strerror(errno));
+    if (0 >= status) return false;
+    ssize_t size = ::recv(m_fd, &m_buf.front(), m_buf.size(), 0);
+    if (0 > size) return false;
+    batch.assign(&m_buf.front(), size);
+    return true;
+  }
+
+}
@@ -2,46 +2,259 @@
     \brief Implementation of OStream class.
     \author James Peachey, HEASARC/GSSC
 */
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+
+#include "st_stream/Capture.h"
+#include "st_stream/Deferred.h"
+#include "st_stream/FdStream.h"
 #include "st_stream/Stream.h"
 #include "st_stream/st_stream.h"
 
+namespace {
+
+  // File streams used by the global streams for direct output.
+  st_stream::FdStream * s_std_fd_stream[2] = { 0, 0 };
+
+  // Component of the message the calling thread is writing to a destination, if any.
+  thread_local const std::string * s_message_component = 0;
+
+  // Type of the message the calling thread is writing to a destination, if any.
+  thread_local st_stream::MessageType s_message_type = st_stream::eNumMessageTypes;
+
+  // Chat level of the message the calling thread is writing to a destination, if any.
+  thread_local unsigned int s_message_chat_level = 0;
+
+  void drainStdFdStreams() {
+    for (int ii = 0; ii != 2; ++ii) if (0 != s_std_fd_stream[ii]) s_std_fd_stream[ii]->getBuf().drain();
+  }
+
+}
+
 namespace st_stream {
 
   // Define standard streams with maximum chatter set to the highest possible value so that
-  // all output sent directly to them will always be displayed.
+  // all output sent directly to them will always be displayed. These are constant-initialized, so code running
+  // during static initialization of other translation units may write to them; until initStdStreams connects
+  // them, such output is discarded.
   OStream sterr(false);
   OStream stlog(false);
   OStream stout(false);
 
-  void OStream::initStdStreams() {
-    // Connect standard streams to their natural STL counterparts.
-    sterr.connect(std::cerr);
-    stlog.connect(std::clog);
-    stout.connect(std::cout);
+  void OStream::initStdStreams(unsigned int options) {
+    if (0 != (options & (eCaptureStdStreams | eDirectOutput))) {
+      // The file streams are never destroyed, so that output written during static destruction is not lost.
+      if (0 == s_std_fd_stream[0]) {
+        s_std_fd_stream[0] = new FdStream(STDOUT_FILENO);
+        s_std_fd_stream[1] = new FdStream(STDERR_FILENO);
+        // Workers sharing a pipe or log file with their parent never split each other's lines.
+        s_std_fd_stream[0]->getBuf().setWholeLines(true);
+        s_std_fd_stream[1]->getBuf().setWholeLines(true);
+        // Errors appear as soon as they are flushed, and never before the output which preceded them.
+        s_std_fd_stream[1]->getBuf().setWriteOnFlush(true);
+        s_std_fd_stream[1]->getBuf().setTie(&s_std_fd_stream[0]->getBuf());
+        std::atexit(drainStdFdStreams);
+      }
+      sterr.connect(*s_std_fd_stream[1]);
+      stlog.connect(*s_std_fd_stream[1]);
+      stout.connect(*s_std_fd_stream[0]);
+
+      // The standard streams may now write into the global streams without writing into themselves.
+      if (0 != (options & eCaptureStdStreams)) CaptureStdStreams();
+    } else {
+      // Connect standard streams to their natural STL counterparts.
+      sterr.connect(std::cerr);
+      stlog.connect(std::clog);
+      stout.connect(std::cout);
+    }
+
+    // Messages written directly to sterr are errors.
+    sterr.setMessageType(eError);
+  }
+
+  std::atomic<unsigned long> OStream::s_config_generation(0);
+
+  std::atomic<unsigned long> OStream::s_topology_generation(0);
+
+  std::atomic<const OStream::DeferredSinkCont_t *> OStream::s_deferred_sinks(0);
+
+  OStream::OStream(const OStream & os): m_sinks(0 == os.m_sinks ? 0 : new Sinks(*os.m_sinks)),
+    m_deferred_prefix(0), m_topology_generation(std::numeric_limits<unsigned long>::max()),
+    m_config_generation(os.m_config_generation), m_chat_level(os.m_chat_level), m_message_type(os.m_message_type),
+    m_enabled(os.m_enabled), m_use_chatter(os.m_use_chatter), m_in_message(false), m_deferred(false) {
+    for (int ii = 0; ii != eNumMessageTypes; ++ii) m_accept_limit[ii].store(0, std::memory_order_relaxed);
   }
 
-  OStream::OStream(bool use_chatter): m_std_stream_cont(), m_stream_cont(), m_prefix(), m_chat_level(0),
-    m_enabled(true), m_use_chatter(use_chatter) { setChatLevel(m_chat_level); }
+  OStream::~OStream() {
+    // Deferred lines refer to this stream, so they must be written before it disappears.
+    if (m_deferred.load(std::memory_order_relaxed)) FlushDeferred();
+    // A global stream written to during static destruction then discards the output.
+    delete m_sinks;
+    m_sinks = 0;
+  }
 
-  OStream & OStream::prefix() { return *this << m_prefix; }
+  OStream & OStream::operator =(const OStream & os) {
+    // Lines already deferred to this stream keep the prefix they were deferred with.
+    if (0 != os.m_sinks) getSinks() = *os.m_sinks;
+    else if (0 != m_sinks) *m_sinks = Sinks();
+    m_deferred_prefix.store(0, std::memory_order_relaxed);
+    m_config_generation = os.m_config_generation;
+    m_chat_level = os.m_chat_level;
+    m_message_type = os.m_message_type;
+    m_topology_generation.store(std::numeric_limits<unsigned long>::max(), std::memory_order_relaxed);
+    m_enabled = os.m_enabled;
+    m_use_chatter = os.m_use_chatter;
+    m_in_message = false;
+    return *this;
+  }
+
+  OStream & OStream::prefix() {
+    ST_STREAM_TRACE2(message_begin, int(m_message_type), m_chat_level);
+    endMessage();
+    return 0 == m_sinks ? *this : *this << m_sinks->m_prefix;
+  }
 
   OStream & OStream::setChatLevel(unsigned int chat_level) {
     m_chat_level = chat_level;
+    m_config_generation = getConfigGeneration();
+    m_in_message = false;
     if (m_use_chatter) enable(m_chat_level <= GetMaximumChatter());
     return *this;
   }
 
-  const std::string & OStream::getPrefix() const { return m_prefix; }
+  const std::string & OStream::getPrefix() const {
+    static const std::string s_no_prefix;
+    return 0 == m_sinks ? s_no_prefix : m_sinks->m_prefix;
+  }
+
+  void OStream::setPrefix(const std::string & prefix) {
+    getSinks().m_prefix = prefix;
+    m_deferred_prefix.store(0, std::memory_order_relaxed);
+  }
+
+  const std::string & OStream::getComponent() const {
+    static const std::string s_no_component;
+    return 0 == m_sinks ? s_no_component : m_sinks->m_component;
+  }
+
+  void OStream::setComponent(const std::string & component) {
+    // Deferred output may be reading the component on another thread, so it is only written when it changes.
+    if (component != getComponent()) getSinks().m_component = component;
+  }
+
+  MessageType OStream::getMessageType() const { return m_message_type; }
+
+  void OStream::setMessageType(MessageType type) { m_message_type = type; }
+
+  void OStream::forward(const char * s, std::streamsize n, MessageType type, unsigned int chat_level) {
+    if (0 == m_sinks) return;
+    MessageScope scope(*m_sinks, type, chat_level);
+    DeferredSinkLock lock(*m_sinks);
+    for (StdStreamCont_t::iterator itor = m_sinks->m_std_stream_cont.begin(); itor != m_sinks->m_std_stream_cont.end();
+      ++itor) {
+      if (itor->second.accepts(type, chat_level)) {
+        ST_STREAM_TRACE3(sink_write, int(type), chat_level, static_cast<long>(n));
+        itor->first->write(s, n);
+      }
+    }
+    for (OStreamCont_t::iterator itor = m_sinks->m_stream_cont.begin(); itor != m_sinks->m_stream_cont.end(); ++itor)
+      if (itor->second.accepts(type, chat_level) && itor->first->isEnabled())
+        itor->first->forward(s, n, type, chat_level);
+  }
+
+  void OStream::forwardFlush() {
+    if (0 == m_sinks) return;
+    // Flushing writes buffered output, which must not overlap the background thread's writes either.
+    DeferredSinkLock lock(*m_sinks);
+    for (StdStreamCont_t::iterator itor = m_sinks->m_std_stream_cont.begin(); itor != m_sinks->m_std_stream_cont.end();
+      ++itor)
+      itor->first->flush();
+    for (OStreamCont_t::iterator itor = m_sinks->m_stream_cont.begin(); itor != m_sinks->m_stream_cont.end(); ++itor)
+      itor->first->forwardFlush();
+  }
+
+  void OStream::shareDeferredSinks() {
+    const DeferredSinkCont_t * shared = s_deferred_sinks.load(std::memory_order_acquire);
+    DeferredSinkCont_t sinks;
+    if (0 != shared) sinks = *shared;
+    collectSinks(sinks);
+    std::sort(sinks.begin(), sinks.end(), std::less<const std::ostream *>());
+    sinks.erase(std::unique(sinks.begin(), sinks.end()), sinks.end());
+    // Other threads may still be reading the previous container, so it is never deleted. There are only as many as
+    // there are changes to the set of destinations which receive deferred output.
+    if (0 == shared || sinks.size() != shared->size())
+      s_deferred_sinks.store(new DeferredSinkCont_t(sinks), std::memory_order_release);
+  }
+
+  void OStream::collectSinks(DeferredSinkCont_t & sinks) const {
+    if (0 == m_sinks) return;
+    for (StdStreamCont_t::const_iterator itor = m_sinks->m_std_stream_cont.begin();
+      itor != m_sinks->m_std_stream_cont.end(); ++itor)
+      sinks.push_back(itor->first);
+    for (OStreamCont_t::const_iterator itor = m_sinks->m_stream_cont.begin(); itor != m_sinks->m_stream_cont.end();
+      ++itor)
+      itor->first->collectSinks(sinks);
+  }
+
+  void OStream::updateAcceptLimit() {
+    // Read the generation first, so that a change made during the computation causes another one.
+    unsigned long generation = s_topology_generation.load(std::memory_order_acquire);
+    unsigned long long limit[eNumMessageTypes] = {};
+    computeAcceptLimit(limit);
+    for (int ii = 0; ii != eNumMessageTypes; ++ii) m_accept_limit[ii].store(limit[ii], std::memory_order_relaxed);
+    m_topology_generation.store(generation, std::memory_order_release);
+  }
+
+  void OStream::computeAcceptLimit(unsigned long long * limit) const {
+    if (0 == m_sinks) return;
+    for (StdStreamCont_t::const_iterator itor = m_sinks->m_std_stream_cont.begin();
+      itor != m_sinks->m_std_stream_cont.end(); ++itor) {
+      for (int ii = 0; ii != eNumMessageTypes; ++ii)
+        limit[ii] = std::max(limit[ii], itor->second.getLimit(MessageType(ii)));
+    }
+    // A message reaches a destination of another OStream only if both filters on the way accept it.
+    for (OStreamCont_t::const_iterator itor = m_sinks->m_stream_cont.begin(); itor != m_sinks->m_stream_cont.end();
+      ++itor) {
+      unsigned long long dest_limit[eNumMessageTypes] = {};
+      itor->first->computeAcceptLimit(dest_limit);
+      for (int ii = 0; ii != eNumMessageTypes; ++ii)
+        limit[ii] = std::max(limit[ii], std::min(dest_limit[ii], itor->second.getLimit(MessageType(ii))));
+    }
+  }
 
-  void OStream::setPrefix(const std::string prefix) { m_prefix = prefix; }
+  void OStream::connect(std::ostream & dest) { connect(dest, SinkFilter()); }
 
-  void OStream::connect(std::ostream & dest) { m_std_stream_cont.insert(&dest); }
+  void OStream::connect(std::ostream & dest, const SinkFilter & filter) {
+    getSinks().m_std_stream_cont[&dest] = filter;
+    topologyChanged();
+  }
+
+  void OStream::disconnect(std::ostream & dest) {
+    if (0 != m_sinks) m_sinks->m_std_stream_cont.erase(&dest);
+    topologyChanged();
+  }
 
-  void OStream::disconnect(std::ostream & dest) { m_std_stream_cont.erase(&dest); }
+  void OStream::connect(OStream & dest) { connect(dest, SinkFilter()); }
 
-  void OStream::connect(OStream & dest) { if (this != &dest) m_stream_cont.insert(&dest); }
+  void OStream::connect(OStream & dest, const SinkFilter & filter) {
+    if (this != &dest) {
+      getSinks().m_stream_cont[&dest] = filter;
+      topologyChanged();
+    }
+  }
+
+  void OStream::disconnect(OStream & dest) {
+    if (0 != m_sinks) m_sinks->m_stream_cont.erase(&dest);
+    topologyChanged();
+  }
 
-  void OStream::disconnect(OStream & dest) { m_stream_cont.erase(&dest); }
+  OStream & OStream::flush() {
+    forwardFlush();
+    return *this;
+  }
 
   std::ios_base::fmtflags OStream::flags() const {
     return getStreamState<std::ios_base::fmtflags, std::ios_base>(&std::ostream::flags, &OStream::flags);
@@ -60,14 +273,15 @@ namespace st_stream {
     std::ios_base::fmtflags orig_flags = flags();
 
     // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter.
-    if (m_enabled) {
+    if (0 != m_sinks && isEnabled()) {
       // Call setf for all std::ostream objects.
-      for (StdStreamCont_t::iterator itor = m_std_stream_cont.begin(); itor != m_std_stream_cont.end(); ++itor)
-        (*itor)->setf(fmtfl, mask);
+      for (StdStreamCont_t::iterator itor = m_sinks->m_std_stream_cont.begin();
+        itor != m_sinks->m_std_stream_cont.end(); ++itor)
+        itor->first->setf(fmtfl, mask);
 
       // Call setf for all OStream objects.
-      for (OStreamCont_t::iterator itor = m_stream_cont.begin(); itor != m_stream_cont.end(); ++itor)
-        (*itor)->setf(fmtfl, mask);
+      for (OStreamCont_t::iterator itor = m_sinks->m_stream_cont.begin(); itor != m_sinks->m_stream_cont.end(); ++itor)
+        itor->first->setf(fmtfl, mask);
     }
 
     return orig_flags;
@@ -76,14 +290,15 @@ namespace st_stream {
   // Note that the following method has an unusal signature and thus can't use setStreamState.
   void OStream::unsetf(std::ios_base::fmtflags mask) {
     // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter.
-    if (m_enabled) {
+    if (0 != m_sinks && isEnabled()) {
       // Call unsetf for all std::ostream objects.
-      for (StdStreamCont_t::iterator itor = m_std_stream_cont.begin(); itor != m_std_stream_cont.end(); ++itor)
-        (*itor)->unsetf(mask);
+      for (StdStreamCont_t::iterator itor = m_sinks->m_std_stream_cont.begin();
+        itor != m_sinks->m_std_stream_cont.end(); ++itor)
+        itor->first->unsetf(mask);
 
       // Call unsetf for all OStream objects.
-      for (OStreamCont_t::iterator itor = m_stream_cont.begin(); itor != m_stream_cont.end(); ++itor)
-        (*itor)->unsetf(mask);
+      for (OStreamCont_t::iterator itor = m_sinks->m_stream_cont.begin(); itor != m_sinks->m_stream_cont.end(); ++itor)
+        itor->first->unsetf(mask);
     }
   }
 
@@ -107,11 +322,14 @@ namespace st_stream {
   char OStream::fill() const {
     char orig = char();
 
-    if ( !m_std_stream_cont.empty() )
-      orig = ( *m_std_stream_cont.begin() )->fill();
+    if ( 0 == m_sinks )
+      return orig;
+
+    if ( !m_sinks->m_std_stream_cont.empty() )
+      orig = m_sinks->m_std_stream_cont.begin()->first->fill();
 
-    else if ( !m_stream_cont.empty() )
-      orig = ( *m_stream_cont.begin() )->fill();
+    else if ( !m_sinks->m_stream_cont.empty() )
+      orig = m_sinks->m_stream_cont.begin()->first->fill();
 
     return orig;
   }
@@ -123,15 +341,59 @@ namespace st_stream {
 
     // Only modify destination streams if message chatter is less than or equal
     // to maximum user/client chatter.
-    if ( m_enabled ) {
-      for ( auto& strm : m_std_stream_cont )
-        strm->fill( new_fill );
-      for ( auto& strm : m_stream_cont )
-        strm->fill( new_fill );
+    if ( 0 != m_sinks && isEnabled() ) {
+      for ( auto& strm : m_sinks->m_std_stream_cont )
+        strm.first->fill( new_fill );
+      for ( auto& strm : m_sinks->m_stream_cont )
+        strm.first->fill( new_fill );
   }
 
     return orig;
   }
 
+  OStream::Sinks & OStream::getSinks() {
+    if (0 == m_sinks) m_sinks = new Sinks;
+    return *m_sinks;
+  }
+
+  OStream::MessageScope::MessageScope(const Sinks & sinks, MessageType type, unsigned int chat_level):
+    m_previous(s_message_component), m_set_component(!sinks.m_component.empty() && 0 == s_message_component),
+    m_set_type(eNumMessageTypes == s_message_type) {
+    // A message keeps the type, chat level and component of the stream it was first written to as it is forwarded
+    // through others.
+    if (m_set_component) s_message_component = &sinks.m_component;
+    if (m_set_type) {
+      s_message_type = type;
+      s_message_chat_level = chat_level;
+    }
+  }
+
+  OStream::MessageScope::MessageScope(const std::string * component, MessageType type, unsigned int chat_level):
+    m_previous(s_message_component), m_set_component(0 != component && 0 == s_message_component),
+    m_set_type(eNumMessageTypes == s_message_type) {
+    if (m_set_component) s_message_component = component;
+    if (m_set_type) {
+      s_message_type = type;
+      s_message_chat_level = chat_level;
+    }
+  }
+
+  OStream::MessageScope::~MessageScope() {
+    if (m_set_component) s_message_component = m_previous;
+    if (m_set_type) {
+      s_message_type = eNumMessageTypes;
+      s_message_chat_level = 0;
+    }
+  }
+
+  const std::string & GetMessageComponent() {
+    static const std::string s_no_component;
+    return 0 == s_message_component ? s_no_component : *s_message_component;
+  }
+
+  MessageType GetMessageType() { return s_message_type; }
+
+  unsigned int GetMessageChatLevel() { return s_message_chat_level; }
+
   OStream & prefix(OStream & os) { return os.prefix(); }
 }
@@ -3,8 +3,13 @@
     \author James Peachey, HEASARC/GSSC
 */
 #include <iostream>
+#include <sstream>
 
+#include "st_stream/Backtrace.h"
+#include "st_stream/MessageBuffer.h"
 #include "st_stream/StreamFormatter.h"
+#include "st_stream/ThreadStage.h"
+#include "st_stream/Trace.h"
 #include "st_stream/st_stream.h"
 
 namespace st_stream {
@@ -12,53 +17,126 @@ namespace st_stream {
   StreamFormatter::StreamFormatter(const std::string & class_name, const std::string & method_name,
     unsigned int default_chat_level): m_class_name(class_name), m_method_name(method_name), m_debug_stream(false),
     m_err_stream(false), m_info_stream(true), m_out_stream(false), m_warn_stream(true),
-    m_default_chat_level(default_chat_level), m_debug_mode(false) {
-    // Make any mandatory connections for all streams.
-    m_debug_stream.connect(sterr);
-    m_err_stream.connect(sterr);
-    m_info_stream.connect(stout);
-    m_out_stream.connect(stout);
-    m_warn_stream.connect(stlog);
+    m_sampled_stream(false), m_prefix_method(), m_err_prefix(), m_context_stack(&GetContextStack()),
+    m_context_id(m_context_stack->m_id),
+    m_config_generation(OStream::getConfigGeneration()), m_sampled_rate(0),
+    m_default_chat_level(default_chat_level), m_component_chat(0),
+    m_debug_mode(false), m_use_component_chat(false), m_err_tagged(false) {
+    // Make any mandatory connections for all streams. If staging output per thread, connect to this thread's
+    // stages for the global streams rather than to the global streams themselves.
+    if (GetThreadStaging()) {
+      m_debug_stream.connect(GetThreadStage(sterr));
+      m_err_stream.connect(GetThreadStage(sterr));
+      m_info_stream.connect(GetThreadStage(stout));
+      m_sampled_stream.connect(GetThreadStage(stout));
+      m_out_stream.connect(GetThreadStage(stout));
+      m_warn_stream.connect(GetThreadStage(stlog));
+    } else {
+      m_debug_stream.connect(sterr);
+      m_err_stream.connect(sterr);
+      m_info_stream.connect(stout);
+      m_sampled_stream.connect(stout);
+      m_out_stream.connect(stout);
+      m_warn_stream.connect(stlog);
+    }
+
+    // Set the message type of each stream, used by destination filters.
+    m_debug_stream.setMessageType(eDebug);
+    m_err_stream.setMessageType(eError);
+    m_info_stream.setMessageType(eInfo);
+    m_sampled_stream.setMessageType(eInfo);
+    m_out_stream.setMessageType(eOutput);
+    m_warn_stream.setMessageType(eWarning);
 
     // Set debugging mode based on the global debugging setting. This will also set up the prefixes for all stream output.
     setDebugMode(GetDebugMode());
+    m_use_component_chat = GetComponentChatter(m_class_name, m_component_chat);
+
+    // Sampled stream is enabled only for messages selected by a sampler.
+    m_sampled_stream.enable(false);
   }
 
   StreamFormatter::~StreamFormatter() throw() {}
 
+  const std::string & StreamFormatter::getClassName() const { return m_class_name; }
+
+  const std::string & StreamFormatter::getMethod() const { return m_method_name; }
+
   void StreamFormatter::setMethod(const std::string & method_name) {
     m_method_name = method_name;
     setPrefix();
   }
 
   OStream & StreamFormatter::debug() {
+    refresh();
+    if (m_debug_mode) refreshContext();
     return m_debug_stream;
   }
 
   OStream & StreamFormatter::err() {
+    refresh();
+    refreshContext();
+    // Tag the message with the number of its backtrace, which may be written later and apart from it.
+    unsigned long long backtrace = CaptureBacktrace(m_err_prefix);
+    if (0 != backtrace) {
+      std::ostringstream tag;
+      tag << "(backtrace " << backtrace << ") ";
+      m_err_stream.setPrefix(m_err_prefix + tag.str());
+      m_err_tagged = true;
+    } else if (m_err_tagged) {
+      m_err_stream.setPrefix(m_err_prefix);
+      m_err_tagged = false;
+    }
     // Error stream ignores chatter.
     return m_err_stream;
   }
 
   OStream & StreamFormatter::info() {
-    return m_info_stream.setChatLevel(m_default_chat_level);
+    return info(m_default_chat_level);
   }
 
   OStream & StreamFormatter::info(unsigned int chat_level) {
-    return m_info_stream.setChatLevel(chat_level);
+    refresh();
+    if (isDisplayed(chat_level)) refreshContext();
+    return setChatLevel(m_info_stream, chat_level);
+  }
+
+  OStream & StreamFormatter::info(Sampler & sampler) {
+    return info(m_default_chat_level, sampler);
+  }
+
+  OStream & StreamFormatter::info(unsigned int chat_level, Sampler & sampler) {
+    refresh();
+
+    // Only offer the sampler messages which would otherwise be displayed.
+    bool selected = isDisplayed(chat_level) && sampler.sample();
+    // The chat level is still used by destination filters, even though the sampler decides whether to write.
+    m_sampled_stream.setChatLevel(chat_level);
+    m_sampled_stream.enable(selected);
+
+    // Prefix includes the rate, so rebuild it if this sampler's rate differs from the last one.
+    if (selected && sampler.getRate() != m_sampled_rate) {
+      m_sampled_rate = sampler.getRate();
+      setPrefix();
+    }
+    if (selected) refreshContext();
+    return m_sampled_stream;
   }
 
   OStream & StreamFormatter::out() {
+    refresh();
     // Output stream ignores chatter.
     return m_out_stream;
   }
 
   OStream & StreamFormatter::warn() {
-    return m_warn_stream.setChatLevel(m_default_chat_level);
+    return warn(m_default_chat_level);
   }
 
   OStream & StreamFormatter::warn(unsigned int chat_level) {
-    return m_warn_stream.setChatLevel(chat_level);
+    refresh();
+    if (isDisplayed(chat_level)) refreshContext();
+    return setChatLevel(m_warn_stream, chat_level);
   }
 
   void StreamFormatter::setDebugMode(bool debug_mode) {
@@ -72,16 +150,83 @@ namespace st_stream {
     setPrefix();
   }
 
+  void StreamFormatter::refresh() {
+    // Global settings have not changed since this object last looked at them, which is nearly always the case.
+    if (m_config_generation == OStream::getConfigGeneration()) return;
+
+    // Adopt the current global settings, which take precedence over any local debug mode.
+    m_config_generation = OStream::getConfigGeneration();
+    m_use_component_chat = GetComponentChatter(m_class_name, m_component_chat);
+    setDebugMode(GetDebugMode());
+  }
+
+  void StreamFormatter::refreshContext() {
+    // Nearly always the same thread and the same state of its stack as when the prefixes were last built.
+    const ContextStack & stack(GetContextStack());
+    if (&stack == m_context_stack && stack.m_id == m_context_id) return;
+    m_context_stack = &stack;
+    m_context_id = stack.m_id;
+
+    // The stack often returns to the same names, e.g. when a helper is called repeatedly, in which case the
+    // prefixes are still correct.
+    MessageBuffer method_name;
+    appendContextMethod(method_name.get());
+    if (method_name.get() != m_prefix_method) setPrefix();
+  }
+
+  void StreamFormatter::appendContextMethod(std::string & method_name) const {
+    method_name += m_method_name;
+    const ContextStack & stack(GetContextStack());
+    unsigned int depth = stack.m_depth < ContextStack::s_max_depth ? stack.m_depth : ContextStack::s_max_depth;
+    for (unsigned int ii = 0; ii != depth; ++ii) {
+      if (!method_name.empty()) method_name += '>';
+      method_name += stack.m_name[ii];
+    }
+  }
+
+  OStream & StreamFormatter::setChatLevel(OStream & os, unsigned int chat_level) {
+    os.setChatLevel(chat_level);
+
+    // A maximum chatter set for this component replaces the global maximum.
+    if (m_use_component_chat) os.enable(chat_level <= m_component_chat);
+    ST_STREAM_TRACE3(chatter, m_class_name.c_str(), chat_level, int(isDisplayed(chat_level)));
+    return os;
+  }
+
+  bool StreamFormatter::isDisplayed(unsigned int chat_level) const {
+    return chat_level <= (m_use_component_chat ? m_component_chat : GetMaximumChatter());
+  }
+
   void StreamFormatter::setPrefix() {
-    // Get the name of the executable.
-    const std::string & exec_name = GetExecName();
+    // Get the name of the executable, and the method name including the current context.
+    const std::string exec_name = GetDisplayName();
+    m_prefix_method.clear();
+    appendContextMethod(m_prefix_method);
+    const std::string & method_name(m_prefix_method);
+    m_context_stack = &GetContextStack();
+    m_context_id = m_context_stack->m_id;
 
     // Create appropriate prefix for each stream.
-    m_debug_stream.setPrefix(createPrefix(exec_name, m_class_name, m_method_name, "DEBUG"));
-    m_err_stream.setPrefix(createPrefix(exec_name, m_class_name, m_method_name, "ERROR"));
-    m_info_stream.setPrefix(createPrefix(exec_name, m_class_name, m_method_name, "INFO"));
+    m_debug_stream.setPrefix(createPrefix(exec_name, m_class_name, method_name, "DEBUG"));
+    m_err_prefix = createPrefix(exec_name, m_class_name, method_name, "ERROR");
+    m_err_stream.setPrefix(m_err_prefix);
+    m_err_tagged = false;
+    m_info_stream.setPrefix(createPrefix(exec_name, m_class_name, method_name, "INFO"));
     m_out_stream.setPrefix(createPrefix(exec_name, "", "", ""));
-    m_warn_stream.setPrefix(createPrefix(exec_name, m_class_name, m_method_name, "WARNING"));
+    m_warn_stream.setPrefix(createPrefix(exec_name, m_class_name, method_name, "WARNING"));
+    if (0 != m_sampled_rate) {
+      std::ostringstream message_type;
+      message_type << "INFO (sampled 1/" << m_sampled_rate << ")";
+      m_sampled_stream.setPrefix(createPrefix(exec_name, m_class_name, method_name, message_type.str()));
+    }
+
+    // Identify this component to destinations, e.g. for indexing, whether or not the prefixes name it.
+    std::string component = m_class_name;
+    if (!component.empty() && !m_method_name.empty()) component += "::";
+    component += m_method_name;
+    OStream * stream[] = { &m_debug_stream, &m_err_stream, &m_info_stream, &m_out_stream, &m_warn_stream,
+      &m_sampled_stream };
+    for (std::size_t ii = 0; ii != sizeof(stream) / sizeof(stream[0]); ++ii) stream[ii]->setComponent(component);
   }
 
   std::string StreamFormatter::createPrefix(const std::string & exec_name, const std::string & class_name,
@@ -0,0 +1,75 @@
+/** \file TableWriter.cxx
+    \brief Implementation of TableWriter class.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <sstream>
+#include <stdexcept>
+
+#include "st_stream/Stream.h"
+#include "st_stream/TableWriter.h"
+
+namespace st_stream {
+
+  TableWriter::TableWriter(OStream & os, const std::string & separator): m_os(os), m_separator(separator), m_column(),
+    m_buf() {}
+
+  TableWriter & TableWriter::addColumn(const std::string & name, std::size_t width, char align, int precision,
+    char type) {
+    Column column;
+    column.m_name = name;
+    column.m_width = name.size() > width ? name.size() : width;
+
+    // Build the placeholder specification once, so rows only need to parse it.
+    std::ostringstream spec;
+    spec << ':';
+    if ('\0' != align) spec << align;
+    spec << column.m_width;
+    if (0 <= precision) spec << '.' << precision;
+    if ('\0' != type) spec << type;
+    column.m_spec = spec.str();
+
+    // Names are aligned like the values, or to the right if the presentation type shows the values are numbers.
+    std::ostringstream header_spec;
+    header_spec << ':' << ('\0' != align ? align : ('\0' != type && 's' != type ? '>' : '<')) << column.m_width;
+    column.m_header_spec = header_spec.str();
+
+    m_column.push_back(column);
+    return *this;
+  }
+
+  void TableWriter::writeHeader() {
+    m_buf.clear();
+    for (std::vector<Column>::iterator itor = m_column.begin(); itor != m_column.end(); ++itor) {
+      if (itor != m_column.begin()) m_buf += m_separator;
+      const std::string & spec(itor->m_header_spec);
+      FormatArg(itor->m_name).render(m_buf, spec.data(), spec.size());
+    }
+    m_buf += '\n';
+    for (std::vector<Column>::iterator itor = m_column.begin(); itor != m_column.end(); ++itor) {
+      if (itor != m_column.begin()) m_buf += m_separator;
+      m_buf.append(itor->m_width, '-');
+    }
+    m_buf += '\n';
+    write();
+  }
+
+  void TableWriter::writeRow(const FormatArg * arg, std::size_t num_args) {
+    if (num_args != m_column.size()) {
+      std::ostringstream msg;
+      msg << "st_stream::TableWriter: row has " << num_args << " values, but table has " << m_column.size() <<
+        " columns";
+      throw std::logic_error(msg.str());
+    }
+    m_buf.clear();
+    for (std::size_t ii = 0; ii != num_args; ++ii) {
+      if (0 != ii) m_buf += m_separator;
+      const std::string & spec(m_column[ii].m_spec);
+      arg[ii].render(m_buf, spec.data(), spec.size());
+    }
+    m_buf += '\n';
+    write();
+  }
+
+  void TableWriter::write() { m_os.write(m_buf.data(), m_buf.size()); }
+
+}
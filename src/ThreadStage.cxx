@@ -0,0 +1,307 @@
+/** \file ThreadStage.cxx
+    \brief Implementation of per-thread output staging.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <mutex>
+#include <set>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "st_stream/ThreadStage.h"
+#include "st_stream/st_stream.h"
+
+namespace {
+
+  using namespace st_stream;
+
+  // A thread's stage is forwarded once it holds this many lines or bytes.
+  const std::size_t s_max_staged_lines = 256;
+  const std::size_t s_max_staged_bytes = 64 * 1024;
+
+  /** \brief A complete line of output, stored in a batch's text buffer, with the type, chat level and component
+             of the message it completed, so that destinations see the same message as if it were not staged.
+  */
+  struct Record {
+    unsigned long long m_seq;
+    OStream * m_dest;
+    const std::string * m_component;
+    std::size_t m_begin;
+    std::size_t m_size;
+    MessageType m_type;
+    unsigned int m_chat_level;
+  };
+
+  /** \brief Lines staged by one thread, with their text stored contiguously.
+  */
+  struct Batch {
+    std::vector<Record> m_record;
+    std::string m_text;
+  };
+
+  class Stage;
+
+  /** \brief Stream buffer which collects characters into lines, and commits each complete line to its stage.
+  */
+  class StageBuf : public std::streambuf {
+    public:
+      StageBuf(Stage & stage, OStream & dest): std::streambuf(), m_stage(stage), m_dest(dest), m_line() {}
+
+      // Commit any incomplete line.
+      void commitPartial();
+
+    protected:
+      virtual int_type overflow(int_type c);
+
+      virtual std::streamsize xsputn(const char * s, std::streamsize n);
+
+    private:
+      Stage & m_stage;
+      OStream & m_dest;
+      std::string m_line;
+  };
+
+  /** \brief Staging area for one thread.
+  */
+  class Stage {
+    public:
+      Stage();
+
+      ~Stage();
+
+      std::ostream & stream(OStream & dest);
+
+      void commit(OStream & dest, std::string & line);
+
+      std::mutex m_mutex;
+      Batch m_batch;
+
+    private:
+      /** \brief Return a copy of the given component which lasts as long as this stage, or 0 if it is empty.
+                 Staged lines refer to it after the stream which wrote them may have changed or gone.
+      */
+      const std::string * internComponent(const std::string & component);
+
+      struct Entry {
+        OStream * m_dest;
+        StageBuf * m_buf;
+        std::ostream * m_os;
+      };
+
+      std::vector<Entry> m_entry;
+      std::set<std::string> m_component;
+      const std::string * m_last_component;
+  };
+
+  /** \brief All live stages, and the sequence counter shared by them.
+  */
+  struct Registry {
+    Registry(): m_mutex(), m_stage(), m_seq(0) {}
+
+    std::mutex m_mutex;
+    std::vector<Stage *> m_stage;
+    std::atomic<unsigned long long> m_seq;
+  };
+
+  void flushAtExit() { FlushThreadStages(); }
+
+  Registry & getRegistry();
+
+  void prepareFork() {
+    // Forward what has been staged, then keep more lines from being staged until the fork is done.
+    FlushThreadStages();
+    SinkLock::prepareFork();
+    Registry & registry(getRegistry());
+    registry.m_mutex.lock();
+    for (std::vector<Stage *>::iterator itor = registry.m_stage.begin(); itor != registry.m_stage.end(); ++itor)
+      (*itor)->m_mutex.lock();
+  }
+
+  void parentFork() {
+    Registry & registry(getRegistry());
+    for (std::vector<Stage *>::iterator itor = registry.m_stage.begin(); itor != registry.m_stage.end(); ++itor)
+      (*itor)->m_mutex.unlock();
+    registry.m_mutex.unlock();
+    SinkLock::parentFork();
+  }
+
+  void childFork() {
+    // Lines staged after the flush in prepareFork are forwarded by the parent, so the child discards its copies.
+    Registry & registry(getRegistry());
+    for (std::vector<Stage *>::iterator itor = registry.m_stage.begin(); itor != registry.m_stage.end(); ++itor)
+      (*itor)->m_batch = Batch();
+    for (std::vector<Stage *>::iterator itor = registry.m_stage.begin(); itor != registry.m_stage.end(); ++itor)
+      (*itor)->m_mutex.unlock();
+    registry.m_mutex.unlock();
+    SinkLock::childFork();
+  }
+
+  Registry * createRegistry() {
+    // Forward lines staged by threads which are still running when the process exits.
+    std::atexit(flushAtExit);
+    pthread_atfork(prepareFork, parentFork, childFork);
+    return new Registry;
+  }
+
+  Registry & getRegistry() {
+    // Never destroyed, so that threads which outlive static destruction can still find it.
+    static Registry * s_registry = createRegistry();
+    return *s_registry;
+  }
+
+  Stage & getStage() {
+    thread_local Stage s_stage;
+    return s_stage;
+  }
+
+  void StageBuf::commitPartial() {
+    if (!m_line.empty()) m_stage.commit(m_dest, m_line);
+  }
+
+  StageBuf::int_type StageBuf::overflow(int_type c) {
+    if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+    m_line += traits_type::to_char_type(c);
+    if ('\n' == traits_type::to_char_type(c)) m_stage.commit(m_dest, m_line);
+    return c;
+  }
+
+  std::streamsize StageBuf::xsputn(const char * s, std::streamsize n) {
+    const char * end = s + n;
+    for (const char * begin = s; begin != end; ) {
+      const char * newline = std::find(begin, end, '\n');
+      if (newline == end) {
+        m_line.append(begin, end);
+        break;
+      }
+      m_line.append(begin, newline + 1);
+      m_stage.commit(m_dest, m_line);
+      begin = newline + 1;
+    }
+    return n;
+  }
+
+  Stage::Stage(): m_mutex(), m_batch(), m_entry(), m_component(), m_last_component(0) {
+    Registry & registry(getRegistry());
+    std::lock_guard<std::mutex> lock(registry.m_mutex);
+    registry.m_stage.push_back(this);
+  }
+
+  Stage::~Stage() {
+    // Forward everything this thread wrote, including incomplete lines, before it disappears.
+    for (std::vector<Entry>::iterator itor = m_entry.begin(); itor != m_entry.end(); ++itor)
+      itor->m_buf->commitPartial();
+    FlushThreadStages();
+
+    Registry & registry(getRegistry());
+    {
+      std::lock_guard<std::mutex> lock(registry.m_mutex);
+      registry.m_stage.erase(std::remove(registry.m_stage.begin(), registry.m_stage.end(), this),
+        registry.m_stage.end());
+    }
+
+    for (std::vector<Entry>::iterator itor = m_entry.begin(); itor != m_entry.end(); ++itor) {
+      delete itor->m_os;
+      delete itor->m_buf;
+    }
+  }
+
+  std::ostream & Stage::stream(OStream & dest) {
+    for (std::vector<Entry>::iterator itor = m_entry.begin(); itor != m_entry.end(); ++itor)
+      if (&dest == itor->m_dest) return *itor->m_os;
+    Entry entry = { &dest, new StageBuf(*this, dest), 0 };
+    entry.m_os = new std::ostream(entry.m_buf);
+    m_entry.push_back(entry);
+    return *entry.m_os;
+  }
+
+  const std::string * Stage::internComponent(const std::string & component) {
+    // Nearly always the same as for the previous line.
+    if (component.empty()) return 0;
+    if (0 == m_last_component || *m_last_component != component)
+      m_last_component = &*m_component.insert(component).first;
+    return m_last_component;
+  }
+
+  void Stage::commit(OStream & dest, std::string & line) {
+    // A line written to the stage directly rather than through an OStream has the type of its destination.
+    MessageType type = GetMessageType();
+    unsigned int chat_level = GetMessageChatLevel();
+    if (eNumMessageTypes == type) type = dest.getMessageType();
+    const std::string * component = internComponent(GetMessageComponent());
+
+    bool flush = false;
+    {
+      // The sequence number is assigned while holding this stage's lock; see FlushThreadStages.
+      std::lock_guard<std::mutex> lock(m_mutex);
+      Record record = { getRegistry().m_seq.fetch_add(1, std::memory_order_relaxed), &dest, component,
+        m_batch.m_text.size(), line.size(), type, chat_level };
+      m_batch.m_text += line;
+      m_batch.m_record.push_back(record);
+      flush = s_max_staged_lines <= m_batch.m_record.size() || s_max_staged_bytes <= m_batch.m_text.size();
+    }
+    line.clear();
+
+    // Errors are forwarded at once rather than waiting for a full batch.
+    if (flush || eError == type) FlushThreadStages();
+  }
+
+  bool lessSeq(const std::pair<const Record *, const Batch *> & r1,
+    const std::pair<const Record *, const Batch *> & r2) {
+    return r1.first->m_seq < r2.first->m_seq;
+  }
+
+}
+
+namespace st_stream {
+
+  std::ostream & GetThreadStage(OStream & dest) { return getStage().stream(dest); }
+
+  void FlushThreadStages() {
+    SinkLock sink_lock;
+    Registry & registry(getRegistry());
+    std::lock_guard<std::mutex> registry_lock(registry.m_mutex);
+
+    // Take every stage's lines while holding all the stages' locks at once. A line is numbered while its stage is
+    // locked, so no line numbered before any line taken here can still be waiting to be added to a stage.
+    std::vector<Batch> batch(registry.m_stage.size());
+    std::vector<std::unique_lock<std::mutex> > stage_lock;
+    stage_lock.reserve(registry.m_stage.size());
+    for (std::size_t ii = 0; ii != registry.m_stage.size(); ++ii) {
+      stage_lock.push_back(std::unique_lock<std::mutex>(registry.m_stage[ii]->m_mutex));
+    }
+    for (std::size_t ii = 0; ii != registry.m_stage.size(); ++ii) {
+      batch[ii].m_record.swap(registry.m_stage[ii]->m_batch.m_record);
+      batch[ii].m_text.swap(registry.m_stage[ii]->m_batch.m_text);
+    }
+    stage_lock.clear();
+
+    // Merge all lines in order of their sequence numbers.
+    std::vector<std::pair<const Record *, const Batch *> > merged;
+    for (std::vector<Batch>::const_iterator b_itor = batch.begin(); b_itor != batch.end(); ++b_itor) {
+      for (std::vector<Record>::const_iterator r_itor = b_itor->m_record.begin(); r_itor != b_itor->m_record.end();
+        ++r_itor)
+        merged.push_back(std::make_pair(&*r_itor, &*b_itor));
+    }
+    std::sort(merged.begin(), merged.end(), lessSeq);
+
+    std::vector<OStream *> dest;
+    for (std::vector<std::pair<const Record *, const Batch *> >::iterator itor = merged.begin(); itor != merged.end();
+      ++itor) {
+      const Record & record(*itor->first);
+      // Forward the line as the message it was part of, rather than as one of the destination's own.
+      OStream::MessageScope scope(record.m_component, record.m_type, record.m_chat_level);
+      if (record.m_dest->isEnabled())
+        record.m_dest->forward(itor->second->m_text.data() + record.m_begin, record.m_size, record.m_type,
+          record.m_chat_level);
+      if (dest.end() == std::find(dest.begin(), dest.end(), record.m_dest)) dest.push_back(record.m_dest);
+    }
+
+    for (std::vector<OStream *>::iterator itor = dest.begin(); itor != dest.end(); ++itor) **itor << std::flush;
+  }
+
+}
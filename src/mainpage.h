@@ -37,6 +37,107 @@
     by clients. Instead, the StreamFormatter class is provided to facilitate
     consistent and stylized output using chattiness and prefixes.
 
+    Passing eDirectOutput to InitStdStreams connects the global streams to
+    FdStream objects, which write straight to the standard output and
+    error file descriptors with large buffers, bypassing iostreams and
+    stdio. Standard output is then written in large blocks unless it is a
+    terminal; standard error is written at every flush, after any pending
+    standard output. Both are written in whole lines, so forked workers
+    sharing them with their parent do not split each other's lines. Each
+    FdStream buffer has its own lock, so threads may write the direct
+    streams without holding a SinkLock.
+
+    Libraries which write to std::cout and std::cerr directly bypass the
+    global streams and their destinations. Passing eCaptureStdStreams to
+    InitStdStreams also connects the global streams to the file
+    descriptors, then redirects std::cout, std::cerr and std::clog into
+    stout, sterr and stlog, so all output of the process takes the same
+    path. See Capture.h and FdStream.h.
+
+    \subsection fork Forking worker processes
+    After InitStdStreams, a process may fork workers safely. Before the
+    fork, everything buffered by st_stream (destinations of the global
+    streams, FdStream buffers, thread stages and deferred lines) is
+    written, and all of its locks are taken, so nothing is written twice
+    or left locked in the child. The child restarts the background threads
+    it had (deferred output, metrics reporting, runtime control). With
+    SetShowProcessId, prefixes show each process's own id. Workers may
+    share a log file through FdStream(file_name), which appends whole
+    lines with single write calls, so lines from different processes are
+    never mixed. A GzipStream or ShmStream must not be used by both
+    processes after a fork.
+
+    \subsection format Format strings
+    As an alternative to a chain of left shifts, OStream::format writes a
+    message described by a format string, for example:
+\verbatim
+    stout.format(ST_FORMAT("x={:.3f} n={:>5}"), x, n) << std::endl;
+\endverbatim
+    The ST_FORMAT macro checks the format string at compile time, and
+    OStream::format checks that the number of arguments matches it. The
+    message is rendered once into a buffer, which is written to all
+    destinations, and the format state of the destinations is not used
+    or changed. Types other than numbers and strings are rendered using
+    their own left shift operators, unless they specialize TextFormatter,
+    in which case they append their text directly to the message buffer.
+    Such types are also rendered once by OStream::write, however many
+    destinations there are, and may be shifted to an OStream.
+
+    Messages are rendered into buffers lent by a pool belonging to the
+    calling thread (see MessageBuffer.h), and prefixes are rebuilt in
+    place only when their text changes, so once the buffers have grown to
+    fit, writing a message makes no heap allocations.
+
+    Similarly, OStream::writeArray writes a whole array of numbers, such
+    as a spectrum, in one buffer, with a separator, width, precision and
+    type given once in an ArrayFormat, instead of one left shift and one
+    width change per element. Likewise, a TableWriter is given the name,
+    width, alignment, precision and type of each column of a table once,
+    then renders each row into one buffer and writes it at once.
+
+    \subsection filters Destination filters
+    Each destination may be connected with a SinkFilter, which selects the
+    messages forwarded to it by message type (debug, error, info, output or
+    warning, from the StreamFormatter stream the message was written to)
+    and by chatter level. For example, a terminal may receive only errors
+    while a log file receives everything. A message which no destination
+    accepts is discarded before any formatting is done.
+
+    \subsection destinations Additional destinations
+    Any std::ostream may be connected to an OStream. The package provides
+    a few specialized ones:
+
+    \verbatim
+    ShmStream - Writes each complete line as a record into a POSIX
+                shared-memory ring buffer, without locks, so that output
+                may be followed live by a separate process. The
+                st_stream_tail utility copies such a ring to a terminal
+                or file, e.g. st_stream_tail -f /my_job_log.
+
+    GzipStream - Writes compressed output to a file. Compression is done
+                on a background thread, in frames which are independent
+                gzip members, so the file can be read with zcat, even if
+                the process dies before closing it. Flushed errors are
+                written at once, other lines within about a second of
+                a flush, and everything else when a frame fills.
+
+    IndexedFileStream - Writes a log file in blocks of whole lines,
+                with a sidecar index (the log's name plus ".idx")
+                recording each block's time range, message types and
+                the StreamFormatter components which wrote it. The
+                st_stream_query utility prints only the blocks which may
+                match, e.g. st_stream_query -t error -c MyClass my.log.
+
+    SocketStream - Sends batches of whole lines as datagrams over a
+                Unix-domain socket to a collector process, so tools on
+                one node can share a log. Sending never blocks; while the
+                collector is absent or busy, lines are spilled to a
+                bounded buffer, and counted when dropped. A batch is
+                sent within 100 ms of its first line, and errors at
+                once. The st_stream_collect utility is such a collector, e.g.
+                st_stream_collect /tmp/node.sock node.log.
+    \endverbatim
+
     \section StreamFormatter StreamFormatter class
     The StreamFormatter class wraps several OStreams with standardized
     message formatting. While clients can write directly to the global
@@ -52,7 +153,11 @@
     StreamFormatter::setMethod allows a client to change a "method name"
     after the StreamFormatter object has been constructed. The class name
     and method name are used, in combination with the name of the current
-    executable, to define a standard prefix for output streams.
+    executable, to define a standard prefix for output streams. Nested work
+    may be described without replacing the method name by creating a
+    ContextGuard, which pushes a name on a stack private to the current
+    thread for the lifetime of the guard; prefixes then show the method
+    name followed by the names on the stack, e.g. "Class::outer>inner: ".
 
     StreamFormatter objects also provide five methods, each of which
     returns an OStream object for a specific purpose:
@@ -87,6 +192,72 @@
     stream in question, but does not affect the StreamFormatter
     object's default chatter level.
 
+    For messages which are written very often, info() is also overloaded
+    to take a Sampler object, which forwards only one in every N messages,
+    either every Nth message or at random. The prefix of each forwarded
+    message shows the sampling rate, e.g. "INFO (sampled 1/1000): ".
+
+    \subsection timers Timers
+    A ScopeTimer measures the time spent in a scope with a monotonic clock
+    and adds it to a TimerSite, normally a static object at the place being
+    measured, which keeps the count, total, extremes and an approximate
+    distribution of the times. Sites are named after the class and method
+    names of the StreamFormatter given to the timer. Each time may also be
+    reported on the formatter's info stream at a given chatter level, and
+    ReportTimers writes a summary table of all sites, which may also be
+    written to stlog at exit (see SetTimerReportAtExit).
+
+    \subsection metrics Metrics
+    For events too frequent to log one by one, a Counter, Gauge or
+    Histogram aggregates them with a few atomic operations, and
+    ReportMetrics writes one line summarizing all metrics to stlog, e.g.
+    "my_tool: METRICS: Reader.events=120000 (11999.8/s), queue_depth=3".
+    StartMetricsReporting does this periodically on a background thread,
+    and once more at exit. See Metrics.h.
+
+    \subsection backtraces Backtraces
+    After SetErrorBacktraces(), each call to StreamFormatter::err() also
+    captures the return addresses of the call stack, which takes a few
+    microseconds. A background thread symbolizes them shortly afterwards
+    and writes them to sterr after the error, one frame per line, with the
+    function name and/or the file and offset for addr2line. The error is
+    tagged "(backtrace N)" and its backtrace begins "backtrace N:", so
+    they can be matched even if other output comes between them.
+    FlushBacktraces writes them at once. See Backtrace.h.
+
+    \subsection progress Progress
+    A ProgressReporter shows the progress of a long loop, with its rate,
+    percentage done and estimated time remaining. Each iteration only
+    bumps a counter; the clock is read a few times per reporting period,
+    and a report is written at most once per period, overwriting the
+    previous one on a terminal, or as a separate line otherwise. See
+    Progress.h.
+
+    \subsection threads Threads
+    OStream objects are not themselves thread safe. For programs which
+    write from many threads, SetThreadStaging(true) causes StreamFormatter
+    objects created afterwards to write complete lines into a staging
+    area private to the creating thread. Staged lines from all threads
+    are forwarded to sterr, stlog and stout in batches, in the order in
+    which they were completed, so threads do not contend for the global
+    streams. See ThreadStage.h.
+
+    Where even formatting is too costly for the calling thread,
+    OStream::defer writes a complete line whose arguments are only copied
+    by the caller; a background thread formats and writes deferred lines
+    from all threads in order, producing the same text as OStream::format.
+    See Deferred.h.
+
+    The test_st_stream_stress program writes from many threads, through
+    thread stages, directly under a SinkLock and as deferred lines, while
+    another changes chatter, debug mode and destinations. It checks that
+    every line arrives intact, once and in order, and that throughput is
+    at least half of the baseline recorded in data/stress_baseline (use -r
+    to record a new one on a different machine); a missing baseline is a
+    failure. It is registered as a test with CTest and SCons. Built with
+    -fsanitize=thread, it also checks the library for data races; the
+    throughput is not checked then.
+
     \section chattiness Chattiness
     Two unsigned integers are used by an OStream object to determine
     whether a given piece of information sent to the OStream object
@@ -109,6 +280,22 @@
     may be to think of messages in terms of their priority, where
     priority 0 is the top priority, followed by priority 1, 2, 3, etc.
 
+    The maximum chatter and debug mode may also be changed while a program
+    is running. EnableRuntimeControl starts a background thread which
+    applies a control file (see ApplyControlFile) whenever it changes or
+    the process receives SIGUSR1; SIGUSR2 toggles debug mode. Maximum
+    chatter may also be set for individual components (class names) with
+    SetComponentChatter. Existing streams notice such changes through a
+    single counter, so no locking is needed when writing messages. A
+    change takes effect at the start of the next message, so a message
+    is always displayed or suppressed as a whole.
+
+    Where <sys/sdt.h> is available, the message path contains static
+    tracepoints (USDT probes) for chatter decisions, suppressed writes,
+    message boundaries and writes to destinations, with the message type,
+    chatter and byte counts. They cost nothing until perf or bpftrace
+    attaches to them in a running program. See Trace.h.
+
     \section initialization Initialization
     A global static function, InitStdStreams, is provided in the st_stream
     namespace for initializing the st_stream system. This takes three
@@ -117,6 +304,12 @@
     called by the standard application main, so rarely if ever will a
     developer need to call it explicitly.
 
+    The global streams and settings are constant-initialized, so loading
+    the library runs no initialization code for them, and they may be
+    used from any static initializer. A stream allocates its destinations
+    only when it is first connected; until InitStdStreams connects them,
+    output written to the global streams is discarded.
+
     \section examples Examples
     Please see the test code in src/test/test_st_stream.cxx, which at the
     top has several examples of how one might use st_stream.
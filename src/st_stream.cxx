@@ -2,16 +2,43 @@
     \brief Implementation of globally accessible stream setup and info methods.
     \author James Peachey, HEASARC/GSSC
 */
+#include <pthread.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <functional>
+#include <iostream>
 #include <limits>
+#include <map>
+#include <mutex>
+#include <new>
+#include <sstream>
 #include "st_stream/st_stream.h"
 
 namespace {
 
-  bool & GetNonConstDebugMode() {
-    // Global debug mode flag.
-    static bool s_debug_mode = false;
-    return s_debug_mode;
-  }
+  // Settings which may change at runtime (see EnableRuntimeControl) are atomic, so they may be changed by
+  // another thread or a signal handler while being read on the message path. Settings with constexpr constructors
+  // are constant-initialized, so they are valid before any code runs and reading them needs no guard. Those which
+  // need memory are created on first use instead.
+
+  // Global debug mode flag.
+  std::atomic<bool> s_debug_mode(false);
+
+  // Global chatter maximum.
+  std::atomic<unsigned int> s_global_max_chat(std::numeric_limits<unsigned int>::max());
+
+  // Global flag controlling whether prefixes show the process id.
+  std::atomic<bool> s_show_process_id(false);
+
+  // Global thread staging flag.
+  bool s_thread_staging = false;
+
+  std::mutex s_component_chat_mutex;
+
+  std::atomic<bool> & GetNonConstDebugMode() { return s_debug_mode; }
 
   std::string & GetNonConstExecName() {
     // Name of the current executable.
@@ -19,28 +46,72 @@ namespace {
     return s_exec_name;
   }
 
-  unsigned int & GetNonConstMaxChat() {
-    // Global chatter maximum.
-    static unsigned int s_global_max_chat = std::numeric_limits<unsigned int>::max();
-    return s_global_max_chat;
+  std::atomic<unsigned int> & GetNonConstMaxChat() { return s_global_max_chat; }
+
+  typedef std::map<std::string, unsigned int> ComponentChatCont_t;
+
+  ComponentChatCont_t & GetNonConstComponentChat() {
+    // Maximum chatter for individual components (class names), overriding the global maximum.
+    static ComponentChatCont_t s_component_chat;
+    return s_component_chat;
+  }
+
+  std::mutex & GetComponentChatMutex() { return s_component_chat_mutex; }
+
+  bool & GetNonConstThreadStaging() { return s_thread_staging; }
+
+  std::recursive_mutex & GetSinkMutex() {
+    // Mutex serializing output to shared destinations.
+    static std::recursive_mutex s_sink_mutex;
+    return s_sink_mutex;
+  }
+
+  void prepareFork() {
+    // No other thread may write while the process is copied, and nothing buffered is copied into the child.
+    st_stream::SinkLock::prepareFork();
+    GetComponentChatMutex().lock();
+    st_stream::sterr.flush();
+    st_stream::stlog.flush();
+    st_stream::stout.flush();
+    std::cout.flush();
+    std::clog.flush();
+    std::cerr.flush();
+    std::fflush(0);
+  }
+
+  void parentFork() {
+    GetComponentChatMutex().unlock();
+    st_stream::SinkLock::parentFork();
+  }
+
+  void childFork() {
+    GetComponentChatMutex().unlock();
+    st_stream::SinkLock::childFork();
+    // Prefixes are rebuilt, in case they show the process id.
+    st_stream::OStream::configChanged();
   }
 
 }
 
 namespace st_stream {
 
-  void InitStdStreams(const std::string & exec_name, unsigned int max_chat, bool debug_mode) {
+  void InitStdStreams(const std::string & exec_name, unsigned int max_chat, bool debug_mode, unsigned int options) {
     // Perform initialization only once.
     static bool s_init_done = false;
 
     if (!s_init_done) {
       // Initialize sterr, stlog and stout.
-      OStream::initStdStreams();
+      OStream::initStdStreams(options);
+
+      // Keep output consistent across fork. Modules with buffers or threads of their own register their own
+      // handlers when they are first used.
+      pthread_atfork(prepareFork, parentFork, childFork);
 
       // Set global parameters affecting stream output.
       GetNonConstDebugMode() = debug_mode;
       GetNonConstExecName() = exec_name;
       GetNonConstMaxChat() = max_chat;
+      OStream::configChanged();
       s_init_done = true;
     }
   }
@@ -53,20 +124,102 @@ namespace st_stream {
     return GetNonConstExecName();
   }
 
+  std::string GetDisplayName() {
+    if (!s_show_process_id.load()) return GetNonConstExecName();
+    std::ostringstream name;
+    name << GetNonConstExecName() << '[' << getpid() << ']';
+    return name.str();
+  }
+
+  bool GetShowProcessId() {
+    return s_show_process_id;
+  }
+
   unsigned int GetMaximumChatter() {
     return GetNonConstMaxChat();
   }
 
+  bool GetThreadStaging() {
+    return GetNonConstThreadStaging();
+  }
+
+  bool GetComponentChatter(const std::string & class_name, unsigned int & max_chat) {
+    std::lock_guard<std::mutex> lock(GetComponentChatMutex());
+    ComponentChatCont_t & component_chat(GetNonConstComponentChat());
+    ComponentChatCont_t::const_iterator itor = component_chat.find(class_name);
+    if (component_chat.end() == itor) return false;
+    max_chat = itor->second;
+    return true;
+  }
+
   void SetDebugMode(bool debug_mode) {
     GetNonConstDebugMode() = debug_mode;
+    OStream::configChanged();
   }
 
   void SetExecName(const std::string & exec_name) {
     GetNonConstExecName() = exec_name;
+    OStream::configChanged();
+  }
+
+  void SetShowProcessId(bool show_process_id) {
+    s_show_process_id = show_process_id;
+    OStream::configChanged();
   }
 
   void SetMaximumChatter(unsigned int max_chat) {
     GetNonConstMaxChat() = max_chat;
+    OStream::configChanged();
+  }
+
+  void SetComponentChatter(const std::string & class_name, unsigned int max_chat) {
+    {
+      std::lock_guard<std::mutex> lock(GetComponentChatMutex());
+      GetNonConstComponentChat()[class_name] = max_chat;
+    }
+    OStream::configChanged();
+  }
+
+  void ClearComponentChatter() {
+    {
+      std::lock_guard<std::mutex> lock(GetComponentChatMutex());
+      GetNonConstComponentChat().clear();
+    }
+    OStream::configChanged();
+  }
+
+  void ReplaceComponentChatter(const std::map<std::string, unsigned int> & component_chat) {
+    ComponentChatCont_t copy(component_chat);
+    {
+      std::lock_guard<std::mutex> lock(GetComponentChatMutex());
+      GetNonConstComponentChat().swap(copy);
+    }
+    OStream::configChanged();
+  }
+
+  void SetThreadStaging(bool thread_staging) {
+    GetNonConstThreadStaging() = thread_staging;
+  }
+
+  SinkLock::SinkLock() { GetSinkMutex().lock(); }
+
+  SinkLock::~SinkLock() { GetSinkMutex().unlock(); }
+
+  OStream::DeferredSinkLock::DeferredSinkLock(const Sinks & sinks): m_locked(false) {
+    const DeferredSinkCont_t * shared = s_deferred_sinks.load(std::memory_order_acquire);
+    if (0 == shared) return;
+    for (StdStreamCont_t::const_iterator itor = sinks.m_std_stream_cont.begin();
+      !m_locked && itor != sinks.m_std_stream_cont.end(); ++itor)
+      m_locked = std::binary_search(shared->begin(), shared->end(), itor->first, std::less<const std::ostream *>());
+    if (m_locked) GetSinkMutex().lock();
   }
 
+  OStream::DeferredSinkLock::~DeferredSinkLock() { if (m_locked) GetSinkMutex().unlock(); }
+
+  void SinkLock::prepareFork() { GetSinkMutex().lock(); }
+
+  void SinkLock::parentFork() { GetSinkMutex().unlock(); }
+
+  void SinkLock::childFork() { new (&GetSinkMutex()) std::recursive_mutex; }
+
 }
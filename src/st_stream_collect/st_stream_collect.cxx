@@ -0,0 +1,74 @@
+/** \file st_stream_collect.cxx
+    \brief Utility which receives the lines sent by SocketStream objects in local processes, and writes them to a
+           terminal or file.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <signal.h>
+
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "st_stream/SocketStream.h"
+
+namespace {
+
+  volatile sig_atomic_t s_stop = 0;
+
+  void stop(int) { s_stop = 1; }
+
+  void usage(std::ostream & os) {
+    os << "usage: st_stream_collect socket_path [output_file]" << std::endl;
+    os << "  Receives lines until interrupted, appending them to the output file, or writing them to standard output."
+      << std::endl;
+  }
+
+}
+
+int main(int argc, char ** argv) {
+  std::string socket_path;
+  std::string out_file;
+
+  for (int ii = 1; ii < argc; ++ii) {
+    if ('-' == argv[ii][0]) { usage(std::cerr); return 1; }
+    else if (socket_path.empty()) socket_path = argv[ii];
+    else if (out_file.empty()) out_file = argv[ii];
+    else { usage(std::cerr); return 1; }
+  }
+  if (socket_path.empty()) { usage(std::cerr); return 1; }
+
+  std::ofstream file_os;
+  if (!out_file.empty()) {
+    file_os.open(out_file.c_str(), std::ios::app);
+    if (!file_os) {
+      std::cerr << "st_stream_collect: ERROR: could not open output file " << out_file << std::endl;
+      return 1;
+    }
+  }
+  std::ostream & os(out_file.empty() ? std::cout : file_os);
+
+  // Stop cleanly on interrupt, so that the socket is removed.
+  struct sigaction action;
+  std::memset(&action, 0, sizeof(action));
+  action.sa_handler = stop;
+  sigaction(SIGINT, &action, 0);
+  sigaction(SIGTERM, &action, 0);
+
+  try {
+    st_stream::SocketCollector collector(socket_path);
+    std::string batch;
+    while (!s_stop) {
+      // Wake now and then to notice a signal which arrived outside the wait.
+      if (collector.receive(batch, 200)) os << batch;
+      else os.flush();
+    }
+    os.flush();
+  } catch (const std::exception & x) {
+    std::cerr << "st_stream_collect: ERROR: " << x.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,118 @@
+/** \file st_stream_query.cxx
+    \brief Utility which prints the blocks of a log written by IndexedFileStream which its index shows may hold
+           messages of the requested types, from the requested component, in the requested period.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "st_stream/LogIndex.h"
+
+namespace {
+
+  void usage(std::ostream & os) {
+    os << "usage: st_stream_query [-t types] [-c component] [-b time] [-e time] [-s] log_file" << std::endl;
+    os << "  -t  print only blocks holding messages of the given comma-separated types: debug, error, info," <<
+      std::endl << "      output, warning (default all)" << std::endl;
+    os << "  -c  print only blocks holding messages from the given class, or Class::method" << std::endl;
+    os << "  -b  print only blocks written at or after the given time" << std::endl;
+    os << "  -e  print only blocks written at or before the given time" << std::endl;
+    os << "  -s  report how much of the log was read" << std::endl;
+    os << "Times are seconds since the Epoch, or local times of the form YYYY-MM-DDTHH:MM:SS." << std::endl;
+    os << "Lines are selected a block at a time, so other lines written near those requested are printed too." <<
+      std::endl;
+  }
+
+  bool parseTypes(const std::string & text, unsigned int & type_mask) {
+    static const struct { const char * m_name; unsigned int m_mask; } s_type[] = {
+      { "debug", st_stream::eDebugMask }, { "error", st_stream::eErrorMask }, { "info", st_stream::eInfoMask },
+      { "output", st_stream::eOutputMask }, { "warning", st_stream::eWarningMask }
+    };
+    type_mask = 0;
+    for (std::string::size_type begin = 0; begin <= text.size(); ) {
+      std::string::size_type end = text.find(',', begin);
+      if (std::string::npos == end) end = text.size();
+      std::string name = text.substr(begin, end - begin);
+      std::size_t ii = 0;
+      for (; ii != sizeof(s_type) / sizeof(s_type[0]) && name != s_type[ii].m_name; ++ii) {}
+      if (sizeof(s_type) / sizeof(s_type[0]) == ii) return false;
+      type_mask |= s_type[ii].m_mask;
+      begin = end + 1;
+    }
+    return true;
+  }
+
+  // Return the given time in milliseconds since the Epoch.
+  bool parseTime(const char * text, long long & time) {
+    char * end = 0;
+    double seconds = std::strtod(text, &end);
+    if (end != text && '\0' == *end) {
+      time = static_cast<long long>(seconds * 1000.);
+      return true;
+    }
+    struct tm tm;
+    std::memset(&tm, 0, sizeof(tm));
+    end = strptime(text, "%Y-%m-%dT%H:%M:%S", &tm);
+    if (0 == end || '\0' != *end) return false;
+    tm.tm_isdst = -1;
+    time = static_cast<long long>(std::mktime(&tm)) * 1000;
+    return true;
+  }
+
+}
+
+int main(int argc, char ** argv) {
+  unsigned int type_mask = st_stream::eAllMessageTypes;
+  std::string component;
+  long long begin_time = st_stream::LogIndex::s_min_time;
+  long long end_time = st_stream::LogIndex::s_max_time;
+  bool stats = false;
+  std::string log_file;
+
+  for (int ii = 1; ii < argc; ++ii) {
+    bool has_arg = ii + 1 < argc;
+    if (0 == std::strcmp(argv[ii], "-s")) stats = true;
+    else if (0 == std::strcmp(argv[ii], "-t") && has_arg && parseTypes(argv[ii + 1], type_mask)) ++ii;
+    else if (0 == std::strcmp(argv[ii], "-c") && has_arg) component = argv[++ii];
+    else if (0 == std::strcmp(argv[ii], "-b") && has_arg && parseTime(argv[ii + 1], begin_time)) ++ii;
+    else if (0 == std::strcmp(argv[ii], "-e") && has_arg && parseTime(argv[ii + 1], end_time)) ++ii;
+    else if ('-' != argv[ii][0] && log_file.empty()) log_file = argv[ii];
+    else { usage(std::cerr); return 1; }
+  }
+  if (log_file.empty()) { usage(std::cerr); return 1; }
+
+  try {
+    st_stream::LogIndex index(log_file);
+    std::vector<st_stream::IndexBlock> selected(index.select(type_mask, component, begin_time, end_time));
+
+    std::string text;
+    unsigned long long num_bytes = 0;
+    for (std::vector<st_stream::IndexBlock>::iterator itor = selected.begin(); itor != selected.end(); ++itor) {
+      // Lines are not filtered individually: a line's prefix does not show the type of its message, e.g. for the
+      // frames of a backtrace, so the whole block is printed.
+      index.read(*itor, text);
+      num_bytes += text.size();
+      std::cout.write(text.data(), text.size());
+    }
+    std::cout.flush();
+
+    if (stats) {
+      unsigned long long total_bytes = 0;
+      const std::vector<st_stream::IndexBlock> & block(index.getBlocks());
+      for (std::vector<st_stream::IndexBlock>::const_iterator itor = block.begin(); itor != block.end(); ++itor)
+        total_bytes += itor->m_size;
+      std::cerr << "st_stream_query: read " << selected.size() << " of " << block.size() << " block(s), " <<
+        num_bytes << " of " << total_bytes << " byte(s)" << std::endl;
+    }
+  } catch (const std::exception & x) {
+    std::cerr << "st_stream_query: ERROR: " << x.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
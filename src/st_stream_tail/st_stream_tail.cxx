@@ -0,0 +1,78 @@
+/** \file st_stream_tail.cxx
+    \brief Utility which copies lines from a shared-memory ring buffer written by ShmStream to a terminal or file.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "st_stream/ShmStream.h"
+
+namespace {
+
+  void usage(std::ostream & os) {
+    os << "usage: st_stream_tail [-f] [-r] shm_name [output_file]" << std::endl;
+    os << "  -f  keep waiting for new lines (follow) instead of exiting when the ring is drained" << std::endl;
+    os << "  -r  remove the shared-memory ring before exiting" << std::endl;
+  }
+
+}
+
+int main(int argc, char ** argv) {
+  bool follow = false;
+  bool remove = false;
+  std::string shm_name;
+  std::string out_file;
+
+  for (int ii = 1; ii < argc; ++ii) {
+    if (0 == std::strcmp(argv[ii], "-f")) follow = true;
+    else if (0 == std::strcmp(argv[ii], "-r")) remove = true;
+    else if (shm_name.empty()) shm_name = argv[ii];
+    else if (out_file.empty()) out_file = argv[ii];
+    else { usage(std::cerr); return 1; }
+  }
+  if (shm_name.empty()) { usage(std::cerr); return 1; }
+
+  std::ofstream file_os;
+  if (!out_file.empty()) {
+    file_os.open(out_file.c_str(), std::ios::app);
+    if (!file_os) {
+      std::cerr << "st_stream_tail: ERROR: could not open output file " << out_file << std::endl;
+      return 1;
+    }
+  }
+  std::ostream & os(out_file.empty() ? std::cout : file_os);
+
+  try {
+    st_stream::ShmReader reader(shm_name);
+    unsigned long long num_lost = 0;
+    std::string line;
+    while (true) {
+      if (reader.read(line)) {
+        os << line << '\n';
+        continue;
+      }
+
+      // Report any records which were overwritten before they could be read.
+      if (num_lost != reader.getNumLost()) {
+        std::cerr << "st_stream_tail: WARNING: " << reader.getNumLost() - num_lost << " record(s) lost" << std::endl;
+        num_lost = reader.getNumLost();
+      }
+
+      os.flush();
+      if (!follow) break;
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+  } catch (const std::exception & x) {
+    std::cerr << "st_stream_tail: ERROR: " << x.what() << std::endl;
+    return 1;
+  }
+
+  if (remove) st_stream::ShmStream::remove(shm_name);
+
+  return 0;
+}
@@ -0,0 +1,259 @@
+/** \file test_st_stream_stress.cxx
+    \brief Concurrency stress test for st_stream library. Many threads write through StreamFormatter objects, through
+           thread stages, directly under a SinkLock or as deferred lines, while destinations are connected and
+           disconnected and the chatter and debug mode change. Every line must arrive intact and exactly once, and
+           the throughput must not fall below a recorded baseline.
+    \author James Peachey, HEASARC/GSSC
+*/
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "st_stream/Deferred.h"
+#include "st_stream/Stream.h"
+#include "st_stream/StreamFormatter.h"
+#include "st_stream/ThreadStage.h"
+#include "st_stream/st_stream.h"
+
+#if defined(__SANITIZE_THREAD__)
+#define ST_STREAM_STRESS_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define ST_STREAM_STRESS_TSAN 1
+#endif
+#endif
+
+namespace {
+
+  using namespace st_stream;
+
+  // The test fails if the throughput is below this fraction of the baseline, which allows for noisy machines.
+  const double s_tolerance = 0.5;
+
+  // Every tenth line is an error, and every fourth also writes an information line which may be suppressed.
+  const int s_error_period = 10;
+  const int s_info_period = 4;
+
+  /** \brief The ways the writing threads take turns to write, by thread number.
+  */
+  enum WriteMode { eStaged, eDirect, eDeferred, eNumWriteModes };
+
+  void usage(std::ostream & os) {
+    os << "usage: test_st_stream_stress [-t num_threads] [-n num_lines] [-b baseline_file] [-r]" << std::endl;
+    os << "  -t  number of writing threads (default 8)" << std::endl;
+    os << "  -n  number of checked lines written by each thread (default 20000)" << std::endl;
+    os << "  -b  file holding the baseline throughput (default $ST_STREAMROOT/data/stress_baseline, or else" <<
+      std::endl << "      data/stress_baseline in the source tree)" << std::endl;
+    os << "  -r  record the measured throughput in the baseline file instead of checking it" << std::endl;
+  }
+
+  /** \brief Collects lines from several OStreams into one string. Only written while holding a SinkLock.
+  */
+  class Collector : public std::ostream {
+    public:
+      Collector(): std::ostream(0), m_buf() { rdbuf(&m_buf); }
+
+      std::string str() const { return m_buf.str(); }
+
+    private:
+      std::stringbuf m_buf;
+  };
+
+  void writeLine(StreamFormatter & formatter, int thread_id, int line_num) {
+    OStream & os(0 == line_num % s_error_period ? formatter.err() : formatter.warn(0));
+    os << prefix << "stress thread " << thread_id << " line " << line_num << " end" << std::endl;
+    if (0 == line_num % s_info_period)
+      formatter.info(2) << prefix << "stress info " << thread_id << " " << line_num << std::endl;
+  }
+
+  void writeLines(int thread_id, int num_lines, std::atomic<int> & num_running, std::atomic<int> & num_created) {
+    // Created by this thread, so that one created while staging is enabled writes to this thread's stages.
+    StreamFormatter formatter("Stress", "writeLines", 0);
+    ++num_created;
+    WriteMode mode = WriteMode(thread_id % eNumWriteModes);
+    for (int ii = 0; ii != num_lines; ++ii) {
+      if (eStaged == mode) {
+        writeLine(formatter, thread_id, ii);
+      } else if (eDirect == mode) {
+        // Without stages, destinations shared with other threads are written while holding the lock.
+        SinkLock lock;
+        writeLine(formatter, thread_id, ii);
+      } else {
+        // Deferred to sterr, whose destinations do not change while lines wait.
+        formatter.err().defer(ST_FORMAT("stress thread {} line {} end"), thread_id, ii);
+      }
+    }
+    --num_running;
+  }
+
+  void changeSettings(std::atomic<int> & num_running, Collector & extra, unsigned long & num_changes) {
+    // Change what is displayed, and where, for as long as the writers are running.
+    for (num_changes = 0; 0 != num_running; ++num_changes) {
+      SetMaximumChatter(0 == num_changes % 2 ? 1 : 3);
+      SetDebugMode(0 == num_changes % 3);
+      {
+        // Destinations shared by several threads are changed while holding the lock under which they are written.
+        SinkLock lock;
+        if (0 == num_changes % 2) stlog.connect(extra);
+        else stlog.disconnect(extra);
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(200));
+    }
+    SinkLock lock;
+    stlog.disconnect(extra);
+  }
+
+  // Parse a checked line, which may have any prefix, and return its thread and line number.
+  bool parseLine(const std::string & line, int & thread_id, int & line_num) {
+    std::string::size_type pos = line.find("stress thread ");
+    if (std::string::npos == pos || 0 == pos) return false;
+    std::istringstream iss(line.substr(pos));
+    std::string word[4];
+    if (!(iss >> word[0] >> word[1] >> thread_id >> word[2] >> line_num >> word[3])) return false;
+    std::string rest;
+    return "line" == word[2] && "end" == word[3] && !std::getline(iss, rest);
+  }
+
+  std::string getBaselineFile() {
+    const char * root = std::getenv("ST_STREAMROOT");
+    if (0 != root) return std::string(root) + "/data/stress_baseline";
+#ifdef ST_STREAM_STRESS_BASELINE
+    return ST_STREAM_STRESS_BASELINE;
+#else
+    return std::string();
+#endif
+  }
+
+}
+
+int main(int argc, char ** argv) {
+  int num_threads = 8;
+  int num_lines = 20000;
+  std::string baseline_file = getBaselineFile();
+  bool record = false;
+
+  for (int ii = 1; ii < argc; ++ii) {
+    bool has_arg = ii + 1 < argc;
+    if (0 == std::strcmp(argv[ii], "-t") && has_arg) num_threads = std::atoi(argv[++ii]);
+    else if (0 == std::strcmp(argv[ii], "-n") && has_arg) num_lines = std::atoi(argv[++ii]);
+    else if (0 == std::strcmp(argv[ii], "-b") && has_arg) baseline_file = argv[++ii];
+    else if (0 == std::strcmp(argv[ii], "-r")) record = true;
+    else { usage(std::cerr); return 1; }
+  }
+  if (0 >= num_threads || 0 >= num_lines || (record && baseline_file.empty())) { usage(std::cerr); return 1; }
+
+  // Send all output to collectors rather than to the terminal.
+  InitStdStreams("test_st_stream_stress", 3, false);
+  sterr.disconnect(std::cerr);
+  stlog.disconnect(std::clog);
+  stout.disconnect(std::cout);
+  Collector collector;
+  Collector extra;
+  sterr.connect(collector);
+  stlog.connect(collector);
+  stout.connect(collector);
+
+  // Staging is chosen when each writer creates its formatter, so the staged writers start first, and the others
+  // once every staged writer has created its formatter.
+  std::atomic<int> num_running(num_threads);
+  std::atomic<int> num_created(0);
+  unsigned long num_changes = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  std::vector<std::thread> thread;
+  SetThreadStaging(true);
+  for (int ii = 0; ii < num_threads; ii += eNumWriteModes)
+    thread.push_back(std::thread(writeLines, ii, num_lines, std::ref(num_running), std::ref(num_created)));
+  while (int(thread.size()) != num_created) std::this_thread::yield();
+  SetThreadStaging(false);
+  for (int ii = 0; ii != num_threads; ++ii) {
+    if (eStaged != ii % eNumWriteModes)
+      thread.push_back(std::thread(writeLines, ii, num_lines, std::ref(num_running), std::ref(num_created)));
+  }
+  std::thread changer(changeSettings, std::ref(num_running), std::ref(extra), std::ref(num_changes));
+  for (int ii = 0; ii != num_threads; ++ii) thread[ii].join();
+  changer.join();
+  FlushThreadStages();
+  FlushDeferred();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  // Every checked line must arrive exactly once, intact and in order relative to the others from its thread. Lines
+  // seen by the extra destination, while it was connected, must be intact too.
+  std::vector<int> next_line(num_threads, 0);
+  unsigned long num_bad = 0;
+  unsigned long num_info = 0;
+  std::istringstream iss(collector.str());
+  for (std::string line; std::getline(iss, line); ) {
+    int thread_id = -1;
+    int line_num = -1;
+    if (std::string::npos != line.find("stress info ")) ++num_info;
+    else if (parseLine(line, thread_id, line_num) && 0 <= thread_id && num_threads > thread_id &&
+      next_line[thread_id] == line_num) ++next_line[thread_id];
+    else ++num_bad;
+  }
+  unsigned long num_extra = 0;
+  std::istringstream extra_iss(extra.str());
+  for (std::string line; std::getline(extra_iss, line); ++num_extra) {
+    int thread_id = -1;
+    int line_num = -1;
+    if (std::string::npos == line.find("stress info ") && !parseLine(line, thread_id, line_num)) ++num_bad;
+  }
+  unsigned long num_missing = 0;
+  for (int ii = 0; ii != num_threads; ++ii) num_missing += num_lines - next_line[ii];
+
+  double rate = num_threads * double(num_lines) / elapsed;
+  std::cout << num_threads << " threads wrote " << num_threads * num_lines << " checked lines in " << elapsed <<
+    " s (" << static_cast<unsigned long>(rate) << " lines/s), during " << num_changes << " setting changes; " <<
+    num_info << " information and " << num_extra << " extra lines arrived." << std::endl;
+  int status = 0;
+  if (0 != num_missing || 0 != num_bad) {
+    std::cout << "FAILED: " << num_missing << " line(s) missing or out of order, " << num_bad <<
+      " damaged or unexpected." << std::endl;
+    status = 1;
+  }
+
+  if (record) {
+    std::ofstream baseline(baseline_file.c_str());
+    baseline << "# Checked lines per second written by test_st_stream_stress, which fails below " << s_tolerance <<
+      " of this." << std::endl;
+    baseline << static_cast<unsigned long>(rate) << std::endl;
+    if (!baseline) {
+      std::cout << "FAILED: could not record the baseline in " << baseline_file << std::endl;
+      status = 1;
+    }
+  } else if (!std::ifstream(baseline_file.c_str())) {
+    // A missing baseline would silently turn off the throughput check.
+    std::cout << "FAILED: no baseline" << (baseline_file.empty() ? "" : " in " + baseline_file) <<
+      "; record one with -r." << std::endl;
+    status = 1;
+  } else {
+#ifdef ST_STREAM_STRESS_TSAN
+    // ThreadSanitizer slows everything down many times over, so the throughput means nothing.
+    std::cout << "Throughput not checked under ThreadSanitizer." << std::endl;
+#else
+    std::ifstream baseline(baseline_file.c_str());
+    std::string line;
+    while (std::getline(baseline, line) && (line.empty() || '#' == line[0])) {}
+    double baseline_rate = std::atof(line.c_str());
+    if (0. >= baseline_rate) {
+      std::cout << "FAILED: no baseline throughput in " << baseline_file << std::endl;
+      status = 1;
+    } else if (s_tolerance * baseline_rate > rate) {
+      std::cout << "FAILED: throughput is below " << s_tolerance << " of the baseline of " <<
+        static_cast<unsigned long>(baseline_rate) << " lines/s." << std::endl;
+      status = 1;
+    } else {
+      std::cout << "Throughput is " << static_cast<int>(100. * rate / baseline_rate + .5) << "% of the baseline." <<
+        std::endl;
+    }
+#endif
+  }
+
+  return status;
+}
@@ -2,17 +2,107 @@
     \brief Test program for st_stream library.
     \author James Peachey, HEASARC/GSSC
 */
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <new>
+#include <sstream>
+#include <stdexcept>
 #include <string>
-
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+#include "st_stream/Backtrace.h"
+#include "st_stream/Capture.h"
+#include "st_stream/Context.h"
+#include "st_stream/Deferred.h"
+#include "st_stream/FdStream.h"
+#include "st_stream/GzipStream.h"
+#include "st_stream/LogIndex.h"
+#include "st_stream/MessageBuffer.h"
+#include "st_stream/Metrics.h"
+#include "st_stream/Progress.h"
+#include "st_stream/ScopeTimer.h"
+#include "st_stream/ShmStream.h"
+#include "st_stream/SocketStream.h"
 #include "st_stream/Stream.h"
 #include "st_stream/StreamFormatter.h"
+#include "st_stream/TableWriter.h"
+#include "st_stream/ThreadStage.h"
 #include "st_stream/st_stream.h"
 
 using namespace st_stream;
 
+// Count heap allocations made by each thread, to check that writing messages does not allocate. Other threads,
+// e.g. reporters started by earlier tests, may allocate at any time, so only the testing thread is counted.
+thread_local unsigned long long s_num_heap_allocations = 0;
+
+#if defined(__GNUC__)
+#define ST_STREAM_TEST_NOINLINE __attribute__((noinline))
+#else
+#define ST_STREAM_TEST_NOINLINE
+#endif
+
+namespace {
+  // Out of line, so that the compiler never sees free() applied to a pointer from operator new at a call site.
+  void * countedAlloc(std::size_t size) ST_STREAM_TEST_NOINLINE;
+  void countedFree(void * p) noexcept ST_STREAM_TEST_NOINLINE;
+
+  void * countedAlloc(std::size_t size) {
+    ++s_num_heap_allocations;
+    return std::malloc(0 == size ? 1 : size);
+  }
+
+  void countedFree(void * p) noexcept { std::free(p); }
+}
+
+// Every form of the global allocation and deallocation functions is replaced, so that each pointer is freed by
+// the counterpart of the function which allocated it, whatever the language standard.
+void * operator new(std::size_t size) {
+  void * p = countedAlloc(size);
+  if (0 == p) throw std::bad_alloc();
+  return p;
+}
+
+void * operator new[](std::size_t size) {
+  void * p = countedAlloc(size);
+  if (0 == p) throw std::bad_alloc();
+  return p;
+}
+
+void * operator new(std::size_t size, const std::nothrow_t &) noexcept { return countedAlloc(size); }
+
+void * operator new[](std::size_t size, const std::nothrow_t &) noexcept { return countedAlloc(size); }
+
+void operator delete(void * p) noexcept { countedFree(p); }
+
+void operator delete[](void * p) noexcept { countedFree(p); }
+
+void operator delete(void * p, const std::nothrow_t &) noexcept { countedFree(p); }
+
+void operator delete[](void * p, const std::nothrow_t &) noexcept { countedFree(p); }
+
+void operator delete(void * p, std::size_t) noexcept { countedFree(p); }
+
+void operator delete[](void * p, std::size_t) noexcept { countedFree(p); }
+
 // Single global formatter for sample1.
 StreamFormatter & formatter1() {
   // This cannot simply be instantiated at global scope because the maximum chatter, name of executable, etc.
@@ -179,6 +269,1426 @@ void sample4() {
   b.write();
 }
 
+void testShmStream(std::ostream & std_os) {
+  // Use a name specific to this process so that simultaneous tests do not collide.
+  std::ostringstream name;
+  name << "/test_st_stream-" << getpid();
+  ShmStream::remove(name.str());
+
+  {
+    // Use a small ring (8 slots with 16 byte payloads) so that long lines are split into fragments.
+    ShmStream shm_os(name.str(), 8, 32);
+    OStream shm_out(false);
+    shm_out.connect(shm_os);
+
+    std_os << "The next two lines were read back from a shared-memory ring buffer:" << std::endl;
+    shm_out << "A short line." << std::endl;
+    shm_out << "A line which is long enough to need " << 3 << " slots." << std::endl;
+
+    ShmReader reader(name.str());
+    std::string line;
+    while (reader.read(line)) std_os << line << std::endl;
+
+    // Overrun the ring, and confirm that the reader skips the overwritten records.
+    for (int ii = 1; ii <= 12; ++ii) shm_out << "line " << ii << std::endl;
+    reader.read(line);
+    std_os << "After overrunning the ring, " << reader.getNumLost() << " records were lost, and the next line read was \"" <<
+      line << "\"" << std::endl;
+  }
+
+  {
+    // Simulate a writer which died after reserving a slot, by advancing the head of the ring just as
+    // ShmStreamBuf::commit does, but never completing the record.
+    ShmStream shm_os(name.str(), 8, 32);
+    OStream shm_out(false);
+    shm_out.connect(shm_os);
+    ShmReader reader(name.str(), std::chrono::milliseconds(20));
+    std::string line;
+    while (reader.read(line)) {}
+    unsigned long long num_lost = reader.getNumLost();
+
+    int fd = shm_open(name.str().c_str(), O_RDWR, 0);
+    void * addr = mmap(0, 64, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    // The head follows the magic number, version, number of slots and slot size.
+    reinterpret_cast<std::atomic<unsigned long long> *>(static_cast<char *>(addr) + 24)->fetch_add(1);
+    munmap(addr, 64);
+    shm_out << "line after an abandoned record" << std::endl;
+
+    bool read_early = reader.read(line);
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    bool read_late = reader.read(line);
+    std_os << "Behind an abandoned record, the reader " << (read_early ? "did not wait" : "waited") << ", then " <<
+      (read_late ? "skipped it" : "stalled") << ", losing " << reader.getNumLost() - num_lost <<
+      " record, and read \"" << line << "\"" << std::endl;
+  }
+
+  ShmStream::remove(name.str());
+}
+
+std::string readGzipFile(const std::string & file_name) {
+  std::string text;
+  gzFile gz_file = gzopen(file_name.c_str(), "rb");
+  char buf[128];
+  for (int size = 0; 0 != gz_file && 0 < (size = gzread(gz_file, buf, sizeof(buf))); ) text.append(buf, size);
+  if (0 != gz_file) gzclose(gz_file);
+  return text;
+}
+
+void testGzipStream(std::ostream & std_os) {
+  std::string file_name = "test_st_stream-out.gz";
+
+  {
+    // Use small frames so that the file consists of several gzip members.
+    GzipStream gz_os(file_name, false, 64);
+    OStream gz_out(false);
+    gz_out.connect(gz_os);
+    for (int ii = 1; ii <= 5; ++ii) gz_out << "Compressed line number " << ii << "." << std::endl;
+  }
+
+  std_os << "The next five lines were read back from a compressed file:" << std::endl;
+  gzFile gz_file = gzopen(file_name.c_str(), "rb");
+  char line[128];
+  while (0 != gz_file && 0 != gzgets(gz_file, line, sizeof(line))) std_os << line;
+  if (0 != gz_file) gzclose(gz_file);
+  std::remove(file_name.c_str());
+
+  {
+    // With the default (large) frames, a flushed error is readable before the stream is closed, but other
+    // flushed lines wait for more output, to keep compression efficient.
+    GzipStream gz_os(file_name);
+    OStream gz_out(false);
+    OStream gz_err(false);
+    gz_out.connect(gz_os);
+    gz_err.connect(gz_os);
+    gz_err.setMessageType(eError);
+    gz_out << "An ordinary line which is flushed." << std::endl;
+    std::string text = readGzipFile(file_name);
+    std_os << "Before an error, " << (text.empty() ? "nothing was" : "something was") << " readable in the compressed file." <<
+      std::endl;
+    gz_err << "An error which is flushed." << std::endl;
+    std_os << "After an error, the compressed file held these lines before it was closed:" << std::endl;
+    std_os << readGzipFile(file_name);
+  }
+  std::remove(file_name.c_str());
+}
+
+void stageLines(OStream & dest, int thread_id, int num_lines) {
+  std::ostream & stage(GetThreadStage(dest));
+  for (int ii = 0; ii != num_lines; ++ii) stage << "thread " << thread_id << " line " << ii << std::endl;
+}
+
+/// \brief Stream buffer which labels each piece of text it receives with the type, chat level and component of its
+///        message.
+class MessageLabelBuf : public std::streambuf {
+  public:
+    const std::string & str() const { return m_text; }
+
+  protected:
+    virtual int_type overflow(int_type c) {
+      if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        char ch = traits_type::to_char_type(c);
+        xsputn(&ch, 1);
+      }
+      return traits_type::not_eof(c);
+    }
+
+    virtual std::streamsize xsputn(const char * s, std::streamsize n) {
+      static const char * s_type_name[] = { "debug", "error", "info", "output", "warning", "none" };
+      std::ostringstream label;
+      label << "[" << s_type_name[GetMessageType()] << " " << GetMessageChatLevel() << " " << GetMessageComponent() << "] ";
+      m_text += label.str();
+      m_text.append(s, n);
+      return n;
+    }
+
+  private:
+    std::string m_text;
+};
+
+void testThreadStage(std::ostream & std_os) {
+  // Stage lines from several threads, all destined for one stream.
+  std::ostringstream collected;
+  OStream dest(false);
+  dest.connect(collected);
+
+  const int num_threads = 4;
+  const int num_lines = 1000;
+  std::vector<std::thread> thread;
+  for (int ii = 0; ii != num_threads; ++ii) thread.push_back(std::thread(stageLines, std::ref(dest), ii, num_lines));
+  for (int ii = 0; ii != num_threads; ++ii) thread[ii].join();
+  FlushThreadStages();
+
+  // Every line must arrive whole, exactly once, and in order relative to other lines from the same thread.
+  std::vector<int> next_line(num_threads, 0);
+  int num_good = 0;
+  std::istringstream iss(collected.str());
+  std::string word1;
+  std::string word2;
+  int thread_id = -1;
+  int line_number = -1;
+  while (iss >> word1 >> thread_id >> word2 >> line_number) {
+    if ("thread" == word1 && "line" == word2 && 0 <= thread_id && num_threads > thread_id &&
+      next_line[thread_id] == line_number) {
+      ++next_line[thread_id];
+      ++num_good;
+    }
+  }
+  std_os << "Thread staging forwarded " << num_good << " of " << num_threads * num_lines << " lines intact and in order." <<
+    std::endl;
+
+  // A formatter created while staging is enabled stages its output until the stages are flushed.
+  SetThreadStaging();
+  StreamFormatter staged("", "", 0);
+  SetThreadStaging(false);
+  staged.out() << prefix << "This was written to a staged formatter before the following line." << std::endl;
+  std_os << "The next line was staged, and appears only after FlushThreadStages." << std::endl;
+  FlushThreadStages();
+
+  // Staged lines keep the type, chat level and component of their messages, which destination filters and the
+  // destinations themselves see as if the lines had not been staged.
+  SetThreadStaging();
+  StreamFormatter typed("Typed", "testThreadStage", 2);
+  SetThreadStaging(false);
+  MessageLabelBuf label_buf;
+  std::ostream labelled(&label_buf);
+  std::ostringstream warnings;
+  std::ostringstream low_chat;
+  stlog.connect(labelled);
+  stout.connect(labelled);
+  stlog.connect(warnings, SinkFilter(eWarningMask));
+  stout.connect(warnings, SinkFilter(eWarningMask));
+  stout.connect(low_chat, SinkFilter(eAllMessageTypes, 1));
+  typed.warn(1) << "staged warning, chatter 1" << std::endl;
+  typed.info(2) << "staged information, chatter 2" << std::endl;
+  typed.info(1) << "staged information, chatter 1" << std::endl;
+  typed.out() << "staged output" << std::endl;
+  FlushThreadStages();
+  stlog.disconnect(labelled);
+  stout.disconnect(labelled);
+  stlog.disconnect(warnings);
+  stout.disconnect(warnings);
+  stout.disconnect(low_chat);
+  std_os << "Staged lines arrived as these messages:" << std::endl << label_buf.str();
+  std_os << "A destination which accepts only warnings received:" << std::endl << warnings.str();
+  std_os << "A destination of stout which accepts chatter up to 1 received:" << std::endl << low_chat.str();
+
+  // Only errors are forwarded at once, whatever their destination; debug output staged for the same destination waits.
+  std::ostringstream err_collected;
+  OStream err_dest(false);
+  err_dest.setMessageType(eError);
+  err_dest.connect(err_collected);
+  OStream debug_os(false);
+  debug_os.setMessageType(eDebug);
+  debug_os.connect(GetThreadStage(err_dest));
+  OStream err_os(false);
+  err_os.setMessageType(eError);
+  err_os.connect(GetThreadStage(err_dest));
+  debug_os << "staged debug line" << std::endl;
+  std_os << "After a staged debug line, " << (err_collected.str().empty() ? "nothing was" : "SOMETHING WAS") <<
+    " forwarded." << std::endl;
+  err_os << "staged error line" << std::endl;
+  std_os << "After a staged error line, this was forwarded:" << std::endl << err_collected.str();
+}
+
+void testRuntimeControl(std::ostream & std_os) {
+  unsigned int max_chat = GetMaximumChatter();
+  StreamFormatter component("Component", "", 2);
+  OStream my_out(true);
+  my_out.connect(stout);
+  my_out << Chat(2);
+
+  // Changing the maximum chatter affects existing streams, even those whose chat level is not set again.
+  std_os << "After lowering the maximum chatter to 1, no lines should follow this line." << std::endl;
+  SetMaximumChatter(1);
+  component.warn() << prefix << "THIS SHOULD NOT APPEAR! This was written to component.warn() with chatter 2." << std::endl;
+  my_out << prefix << "THIS SHOULD NOT APPEAR! This was written to my_out with chatter 2." << std::endl;
+
+  // Raise the global maximum chatter to 2, and that of Component to 4.
+  std::string control_file = "test_st_stream-control";
+  {
+    std::ofstream control(control_file.c_str());
+    control << "# Test control file." << std::endl << "chatter = 2" << std::endl << "chatter Component = 4" << std::endl;
+  }
+  ApplyControlFile(control_file);
+  std_os << "After applying a control file, two lines should follow this line." << std::endl;
+  component.warn(4) << prefix << "This was written to component.warn(4) after the control file raised its chatter." <<
+    std::endl;
+  my_out << prefix << "This was written to my_out after the control file raised the maximum chatter." << std::endl;
+
+
+  // Toggle debugging with a signal.
+  EnableRuntimeControl(control_file, 10);
+  bool debug_mode = GetDebugMode();
+  std::raise(SIGUSR2);
+  std_os << "SIGUSR2 " << (debug_mode != GetDebugMode() ? "toggled" : "DID NOT TOGGLE") << " the debug mode." << std::endl;
+  std::raise(SIGUSR2);
+
+  // Restore the original settings by changing the watched control file.
+  {
+    std::ofstream control(control_file.c_str());
+    control << "chatter = " << max_chat << std::endl;
+  }
+  unsigned int component_chat = 0;
+  for (int ii = 0; ii != 500 && (max_chat != GetMaximumChatter() || GetComponentChatter("Component", component_chat)); ++ii)
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  std_os << "Changing the watched control file " <<
+    (max_chat == GetMaximumChatter() && !GetComponentChatter("Component", component_chat) ? "restored" : "DID NOT RESTORE") <<
+    " the original settings." << std::endl;
+  DisableRuntimeControl();
+  std::remove(control_file.c_str());
+
+  // Replacing the component settings removes those not given, and sets the others, in one step.
+  SetComponentChatter("Component", 4);
+  std::map<std::string, unsigned int> replacement;
+  replacement["Other"] = 1;
+  ReplaceComponentChatter(replacement);
+  unsigned int other_chat = 0;
+  std_os << "After replacing the component settings, Component " <<
+    (GetComponentChatter("Component", component_chat) ? "STILL HAD" : "had no") << " setting, and Other had " <<
+    (GetComponentChatter("Other", other_chat) ? other_chat : 99) << "." << std::endl;
+  ClearComponentChatter();
+}
+
+void testSampler(std::ostream & std_os) {
+  StreamFormatter sampled("Sampled", "", 2);
+
+  std_os << "Of ten messages sampled one in four, three lines should follow this line." << std::endl;
+  Sampler every_fourth(4);
+  for (int ii = 0; ii != 10; ++ii)
+    sampled.info(every_fourth) << prefix << "This was message number " << ii << "." << std::endl;
+
+  // Messages suppressed by chatter are not offered to the sampler.
+  Sampler every_one(1);
+  for (int ii = 0; ii != 10; ++ii)
+    sampled.info(GetMaximumChatter() + 1, every_one) << prefix << "THIS SHOULD NOT APPEAR! This was message number " <<
+      ii << "." << std::endl;
+  std_os << "A sampler was offered " << every_one.getNumCalls() << " messages suppressed by chatter." << std::endl;
+
+  // Sampled messages have their chat level, which destination filters respect.
+  std::ostringstream filtered;
+  stout.connect(filtered, SinkFilter(eAllMessageTypes, 2));
+  sampled.info(3, every_one) << "A sampled message with chatter 3." << std::endl;
+  sampled.info(2, every_one) << "A sampled message with chatter 2." << std::endl;
+  stout.disconnect(filtered);
+  std_os << "A destination which accepts chatter up to 2 received: " << filtered.str();
+
+  // Count messages selected at random.
+  Sampler random_sampler(10, Sampler::eRandom);
+  unsigned int num_selected = 0;
+  for (int ii = 0; ii != 100000; ++ii) if (random_sampler.sample()) ++num_selected;
+  std_os << "Sampling 1/10 at random selected " << (9000 < num_selected && 11000 > num_selected ? "about" : "NOT ABOUT") <<
+    " 10000 of " << random_sampler.getNumCalls() << " messages." << std::endl;
+}
+
+struct Point {
+  Point(double x, double y): m_x(x), m_y(y) {}
+  double m_x;
+  double m_y;
+};
+
+std::ostream & operator <<(std::ostream & os, const Point & point) {
+  return os << "(" << point.m_x << ", " << point.m_y << ")";
+}
+
+// Format strings are checked at compile time.
+static_assert(0 == CountPlaceholders("{{}} }} {{"), "escaped braces are not placeholders");
+static_assert(3 == CountPlaceholders("{}{:}{:^10.3f}"), "placeholders with and without specifications");
+static_assert(-1 == CountPlaceholders("{") && -1 == CountPlaceholders("}") && -1 == CountPlaceholders("{:.}") &&
+  -1 == CountPlaceholders("{:5<}") && -1 == CountPlaceholders("{:fd}") && -1 == CountPlaceholders("{x}"),
+  "malformed format strings");
+
+// A format string far longer than the compiler's limit for recursion in constant expressions.
+#define ST_STREAM_TEST_TEXT64 "0123456789 abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXY "
+#define ST_STREAM_TEST_TEXT1024 ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64 \
+  ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64 \
+  ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64 \
+  ST_STREAM_TEST_TEXT64 ST_STREAM_TEST_TEXT64
+
+void testFormat(std::ostream & std_os) {
+  OStream os(false);
+  os.connect(std_os);
+
+  std_os << "The next five lines should show formatted values." << std::endl;
+  std_os << std::setprecision(2);
+  os.format(ST_FORMAT("x={:.3f} n={} hex={:x} oct={:o} flag={} char={}"), 3.14159265, -42, 255u, 8, true, 'z') <<
+    std::endl;
+  os.format(ST_FORMAT("[{:>6}][{:<6}][{:^7}][{:5d}][{:.3s}]"), "right", "left", "mid", 7, std::string("truncated")) <<
+    std::endl;
+  os.format(ST_FORMAT("default={} exp={:.2e} general={:g} {{braces}}"), 1.23456789, 12345.678, 0.0001) << std::endl;
+  os.format(ST_FORMAT("min={} max={}"), std::numeric_limits<long long>::min(), std::numeric_limits<unsigned long long>::max())
+    << std::endl;
+  os.format(ST_FORMAT("A user type, formatted with its operator <<: {}"), Point(1.5, -2.)) << std::endl;
+
+  // Placeholders far into a long format string are found.
+  std::ostringstream long_os;
+  OStream long_out(false);
+  long_out.connect(long_os);
+  long_out.format(ST_FORMAT(ST_STREAM_TEST_TEXT1024 ST_STREAM_TEST_TEXT1024 "{} {:.1f}"), "and", 2.) << std::endl;
+  std::string long_text = long_os.str();
+  std_os << "A format string of " << 2 * 1024 + 9 << " characters was formatted as " << long_text.size() <<
+    " characters ending with \"" << long_text.substr(long_text.size() - 20, 19) << "\"" << std::endl;
+
+  // The format state of the destination is not changed.
+  std_os << "After formatting, precision of the destination was still " << std_os.precision() << "." << std::endl;
+  std_os << std::setprecision(6);
+
+  // Chatter suppresses formatting entirely.
+  StreamFormatter formatter("Format", "testFormat", 2);
+  formatter.info(GetMaximumChatter() + 1).format(ST_FORMAT("THIS SHOULD NOT APPEAR! {}"), 1) << std::endl;
+  formatter.info(1).prefix().format(ST_FORMAT("Formatted with prefix: {:.2f}"), 2.5) << std::endl;
+}
+
+void deferLines(OStream & dest, int thread_id, int num_lines) {
+  for (int ii = 0; ii != num_lines; ++ii) dest.defer(ST_FORMAT("thread {} line {}"), thread_id, ii);
+}
+
+void deferAndWriteLines(OStream & deferred, OStream & direct, int num_lines) {
+  for (int ii = 0; ii != num_lines; ++ii) {
+    deferred.defer(ST_FORMAT("deferred line {}"), ii);
+    direct.format(ST_FORMAT("direct line {}\n"), ii);
+  }
+}
+
+void testDeferred(std::ostream & std_os) {
+  std::ostringstream sync_os;
+  std::ostringstream deferred_os;
+  OStream sync_stream(false);
+  OStream deferred_stream(false);
+  sync_stream.connect(sync_os);
+  deferred_stream.connect(deferred_os);
+  sync_stream.setPrefix("prefix: ");
+  deferred_stream.setPrefix("prefix: ");
+
+  // Write the same lines both ways. The temporary strings are gone before the deferred lines are formatted.
+  for (int ii = 0; ii != 3; ++ii) {
+    sync_stream.prefix().format(ST_FORMAT("{} {:>4} {:.2f} [{:<8}]"), ii, 10 * ii, ii / 3., std::string(ii, '*')) <<
+      std::endl;
+    deferred_stream.defer(ST_FORMAT("{} {:>4} {:.2f} [{:<8}]"), ii, 10 * ii, ii / 3., std::string(ii, '*'));
+  }
+  sync_stream.prefix().format(ST_FORMAT("user type {:<12}|"), Point(1.5, -2.)) << std::endl;
+  deferred_stream.defer(ST_FORMAT("user type {:<12}|"), Point(1.5, -2.));
+  sync_stream.setPrefix("changed: ");
+  deferred_stream.setPrefix("changed: ");
+  sync_stream.prefix().format(ST_FORMAT("no arguments")) << std::endl;
+  deferred_stream.defer(ST_FORMAT("no arguments"));
+  FlushDeferred();
+  std_os << "The next five lines were deferred, and " << (sync_os.str() == deferred_os.str() ? "match" :
+    "DO NOT MATCH") << " the same lines written synchronously." << std::endl;
+  std_os << deferred_os.str();
+
+  // Lines deferred by several threads are written in the order in which they were deferred.
+  std::ostringstream threads_os;
+  OStream threads_stream(false);
+  threads_stream.connect(threads_os);
+  const int num_threads = 4;
+  const int num_lines = 2000;
+  std::vector<std::thread> thread;
+  for (int ii = 0; ii != num_threads; ++ii) thread.push_back(std::thread(deferLines, std::ref(threads_stream), ii,
+    num_lines));
+  for (std::vector<std::thread>::iterator itor = thread.begin(); itor != thread.end(); ++itor) itor->join();
+  FlushDeferred();
+
+  std::istringstream iss(threads_os.str());
+  std::vector<int> next_line(num_threads, 0);
+  int num_read = 0;
+  bool in_order = true;
+  std::string word;
+  int thread_id = 0;
+  int line_number = 0;
+  while (iss >> word >> thread_id >> word >> line_number) {
+    ++num_read;
+    in_order = in_order && 0 <= thread_id && num_threads > thread_id && next_line[thread_id]++ == line_number;
+  }
+  std_os << "Deferred output from " << num_threads << " threads had " << num_read << " lines, " <<
+    (in_order ? "in order." : "NOT IN ORDER!") << std::endl;
+
+  // Output written directly to a destination which also receives deferred output is serialized with the background
+  // thread, which writes deferred lines at the same time. Each direct line is written in one piece so that deferred
+  // lines cannot come between its pieces. Build with -fsanitize=thread to check for data races.
+  std::ostringstream mixed_os;
+  OStream mixed_deferred(false);
+  OStream mixed_direct(false);
+  mixed_deferred.connect(mixed_os);
+  mixed_direct.connect(mixed_os);
+  std::thread mixed_thread(deferAndWriteLines, std::ref(mixed_deferred), std::ref(mixed_direct), 20000);
+  mixed_thread.join();
+  FlushDeferred();
+  std::istringstream mixed_iss(mixed_os.str());
+  int next_mixed[2] = { 0, 0 };
+  bool mixed_intact = true;
+  for (std::string kind, line_word; mixed_iss >> kind >> line_word >> line_number; ) {
+    int index = "deferred" == kind ? 0 : 1;
+    mixed_intact = mixed_intact && ("deferred" == kind || "direct" == kind) && "line" == line_word &&
+      next_mixed[index]++ == line_number;
+  }
+  std_os << "Writing directly and deferring to one destination gave " << next_mixed[0] << " deferred and " <<
+    next_mixed[1] << " direct lines, " << (mixed_intact ? "intact." : "NOT INTACT!") << std::endl;
+
+  // The format string is copied, so it need not outlive the call.
+  std::ostringstream copied_os;
+  OStream copied_stream(false);
+  copied_stream.connect(copied_os);
+  {
+    std::string text("format string which is gone before formatting: {}");
+    copied_stream.defer(FormatString<1>(text.c_str()), 1);
+    text.assign(text.size(), 'X');
+  }
+  FlushDeferred();
+  std_os << "A deferred line written with a " << copied_os.str();
+
+  // Chatter is applied when lines are deferred.
+  StreamFormatter formatter("Deferred", "testDeferred", 2);
+  formatter.info(GetMaximumChatter() + 1).defer(ST_FORMAT("THIS SHOULD NOT APPEAR! {}"), 1);
+  formatter.info(1).defer(ST_FORMAT("This line was deferred with a prefix and {} argument."), "one");
+  FlushDeferred();
+}
+
+void testScopeTimer(std::ostream & std_os) {
+  StreamFormatter timed("Timed", "testScopeTimer", 2);
+  static TimerSite s_site;
+  for (int ii = 0; ii != 100; ++ii) {
+    ScopeTimer timer(timed, s_site);
+  }
+  std_os << "A timer site named \"" << s_site.getName() << "\" measured " << s_site.getCount() << " scopes, and its " <<
+    "statistics were " << (s_site.getMinimum() <= s_site.getPercentile(50.) &&
+    s_site.getPercentile(50.) <= s_site.getPercentile(90.) && s_site.getPercentile(90.) <= s_site.getPercentile(99.) &&
+    s_site.getPercentile(99.) <= s_site.getMaximum() && s_site.getMaximum() <= s_site.getTotal() ? "consistent." :
+    "NOT CONSISTENT!") << std::endl;
+
+  // Percentiles are estimated from a distribution of known times.
+  TimerSite known("known");
+  for (unsigned long long nsec = 1000; nsec <= 1000000; nsec += 1000) known.record(nsec);
+  unsigned long long median = known.getPercentile(50.);
+  std_os << "The estimated median of 1 to 1000 microseconds was " << (400000 < median && 625000 > median ?
+    "close to" : "NOT CLOSE TO") << " 500 microseconds." << std::endl;
+
+  // Each scope may also be reported through the formatter. Capture the report, since the time varies.
+  std::ostringstream report_os;
+  stout.disconnect(std_os);
+  stout.connect(report_os);
+  {
+    ScopeTimer timer(timed, s_site, 1);
+  }
+  {
+    ScopeTimer timer(timed, s_site, GetMaximumChatter() + 1);
+  }
+  stout.disconnect(report_os);
+  stout.connect(std_os);
+  std::string report = report_os.str();
+  std_os << "Reporting two scopes, one above the maximum chatter, wrote " << std::count(report.begin(), report.end(), '\n')
+    << " line, which " << (std::string::npos != report.find("Timed::testScopeTimer took ") ? "named" : "DID NOT NAME") <<
+    " the site." << std::endl;
+
+  // The summary table has a header and one line per site.
+  std::ostringstream table_os;
+  OStream table_stream(false);
+  table_stream.connect(table_os);
+  ReportTimers(table_stream);
+  std::string table = table_os.str();
+  std_os << "The summary table " << (0 == table.find("Site") ? "had" : "DID NOT HAVE") << " a header, and " <<
+    (std::string::npos != table.find("Timed::testScopeTimer       102") ? "included" : "DID NOT INCLUDE") <<
+    " the site with its count." << std::endl;
+}
+
+void contextHelper(StreamFormatter & os) {
+  ContextGuard guard("helper");
+  os.info(1) << prefix << "This line was written from a helper, nested in the caller's method." << std::endl;
+  {
+    ContextGuard inner_guard("inner");
+    os.warn(1) << prefix << "This line was written from a block nested in the helper." << std::endl;
+  }
+  os.info(GetMaximumChatter() + 1) << prefix << "THIS SHOULD NOT APPEAR! This line was suppressed by chatter." <<
+    std::endl;
+}
+
+void testContext(std::ostream & std_os) {
+  StreamFormatter os("Context", "testContext", 2);
+  std_os << "The next five lines should show the method name followed by the context." << std::endl;
+  os.info(1) << prefix << "This line was written before any context was pushed." << std::endl;
+  contextHelper(os);
+  os.info(1) << prefix << "This line was written after the helper's context was popped." << std::endl;
+
+  // A formatter with no method name starts with the first context name.
+  StreamFormatter no_method("Context", "", 2);
+  ContextGuard guard("outer");
+  no_method.err() << prefix << "This line has only the context as its method name." << std::endl;
+}
+
+// Counts how many times objects are formatted.
+struct Counted {
+  static int s_num_formatted;
+};
+
+int Counted::s_num_formatted = 0;
+
+std::ostream & operator <<(std::ostream & os, const Counted &) {
+  ++Counted::s_num_formatted;
+  return os << "counted";
+}
+
+void testSinkFilter(std::ostream & std_os) {
+  // Errors and warnings go to a "console", everything up to chatter 2 goes to a "file".
+  std::ostringstream console;
+  std::ostringstream file;
+  OStream hub(false);
+  hub.connect(console, SinkFilter(eErrorMask | eWarningMask));
+  hub.connect(file, SinkFilter(eAllMessageTypes, 2));
+
+  OStream error_stream(false);
+  error_stream.setMessageType(eError);
+  error_stream.connect(hub);
+  OStream info_stream(false);
+  info_stream.setMessageType(eInfo);
+  info_stream.connect(hub);
+
+  error_stream << "error, chatter 0: ";
+  error_stream.write(Counted()) << std::endl;
+  info_stream << Chat(1) << "info, chatter 1: ";
+  info_stream.write(Counted()) << std::endl;
+  info_stream << Chat(3) << "THIS SHOULD NOT APPEAR! info, chatter 3: ";
+  info_stream.write(Counted()) << std::endl;
+  std_os << "The console received:" << std::endl << console.str();
+  std_os << "The file received:" << std::endl << file.str();
+  std_os << "Objects were formatted " << Counted::s_num_formatted << " times." << std::endl;
+
+  // The format API renders a message once, however many destinations accept it.
+  Counted::s_num_formatted = 0;
+  error_stream.format(ST_FORMAT("{}"), Counted()) << std::endl;
+  info_stream.format(ST_FORMAT("THIS SHOULD NOT APPEAR! {}"), Counted()) << std::endl;
+  std_os << "Formatting for two destinations, then for none, formatted objects " << Counted::s_num_formatted <<
+    " time." << std::endl;
+
+  // Changing a filter takes effect at once for all streams connected through it.
+  hub.connect(console, SinkFilter(eAllMessageTypes));
+  console.str("");
+  info_stream << "info, after changing the filter" << std::endl;
+  std_os << "After changing its filter, the console received: " << console.str();
+}
+
+void useMetrics(std::ostream & std_os, std::ostringstream & log) {
+  StreamFormatter formatter("Reader", "", 2);
+  Counter events(formatter, "events");
+  Gauge depth("queue_depth");
+  Histogram energy(formatter, "energy");
+  for (int ii = 1; ii <= 100; ++ii) {
+    events.add();
+    energy.record(ii);
+  }
+  depth.set(3.);
+  std_os << "Counter " << events.getName() << " counted " << events.get() << ", histogram " << energy.getName() <<
+    " has n=" << energy.getCount() << " mean=" << energy.getMean() << " p50=" << energy.getPercentile(50.) <<
+    " p99=" << energy.getPercentile(99.) << std::endl;
+
+  {
+    Counter retired("retired");
+    retired.add(5);
+  }
+  ReportMetrics();
+  std::string report = log.str();
+  std_os << "The first report " << (std::string::npos != report.find("test_st_stream: METRICS: retired=5 (") ?
+    "included" : "DID NOT INCLUDE") << " the destroyed counter first." << std::endl;
+  const char * expected[] = { "Reader.events=100 (", "queue_depth=3",
+    "Reader.energy=[n=100 mean=50.5 min=1 p50=64 p99=100 max=100]" };
+  for (std::size_t ii = 0; ii != sizeof(expected) / sizeof(expected[0]); ++ii)
+    std_os << "The first report " << (std::string::npos != report.find(expected[ii]) ? "included" :
+      "DID NOT INCLUDE") << " \"" << expected[ii] << "\"" << std::endl;
+
+  // The background reporter writes the same kind of line.
+  log.str("");
+  StartMetricsReporting(10);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  StopMetricsReporting();
+  report = log.str();
+  std_os << "The background reporter " << (std::string::npos == report.find("retired=") &&
+    std::string::npos != report.find("Reader.events=100 (0/s)") ? "reported" : "DID NOT REPORT") <<
+    " current metrics only." << std::endl;
+  log.str("");
+}
+
+void testMetrics(std::ostream & std_os) {
+  // Capture the reports, which include rates, so only their deterministic parts are shown.
+  std::ostringstream log;
+  stlog.disconnect(std_os);
+  stlog.connect(log);
+  useMetrics(std_os, log);
+
+  // Metrics destroyed since the last report are in the next one, with their final values.
+  ReportMetrics();
+  std_os << "After the metrics were destroyed, the report was: " << log.str().substr(log.str().find("METRICS:"));
+  stlog.disconnect(log);
+  stlog.connect(std_os);
+}
+
+void testProgress(std::ostream & std_os) {
+  std::ostringstream log;
+  OStream os(false);
+  os.connect(log);
+
+  // With a period of 0, every iteration is reported. Rates vary, so only the start of each line is shown.
+  {
+    ProgressReporter progress(os, "Reading", 4, 0);
+    for (int ii = 0; ii != 4; ++ii) progress.bump();
+  }
+  std::istringstream lines(log.str());
+  std::string line;
+  while (std::getline(lines, line)) std_os << "Progress line: " << line.substr(0, line.find(")") + 1) << std::endl;
+
+  // On a terminal, reports overwrite each other, and only the final one ends the line.
+  log.str("");
+  {
+    ProgressReporter progress(os, "Reading", 0, 0);
+    progress.setOverwrite(true);
+    progress.bump(1000);
+    progress.bump(1000);
+  }
+  std::string text = log.str();
+  std_os << "Overwriting reports contained " << std::count(text.begin(), text.end(), '\r') << " carriage returns and " <<
+    std::count(text.begin(), text.end(), '\n') << " newline." << std::endl;
+
+  // A fast loop reads the clock rarely and is reported once a period at most.
+  log.str("");
+  unsigned long long num_reports = 0;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  {
+    ProgressReporter progress(os, "Looping", 10000000, 50);
+    for (int ii = 0; ii != 10000000; ++ii) progress.bump();
+    progress.finish();
+    num_reports = progress.getNumReports();
+  }
+  double msec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  std_os << "A fast loop was reported " << (num_reports <= 2 + static_cast<unsigned long long>(msec / 50.) ?
+    "at most once per period." : "TOO OFTEN!") << std::endl;
+}
+
+void testWriteArray(std::ostream & std_os) {
+  std::ostringstream oss;
+  OStream os(false);
+  os.connect(oss);
+
+  int counts[] = { 0, -7, 42, 100, 123456789 };
+  std::vector<double> spectrum;
+  spectrum.push_back(0.);
+  spectrum.push_back(-0.0004);
+  spectrum.push_back(1.0005);
+  spectrum.push_back(2.675);
+  spectrum.push_back(1.e20);
+  os.writeArray(counts) << std::endl;
+  os.writeArray(counts, 3, ArrayFormat().setSeparator(",").setWidth(4).setType('x')) << std::endl;
+  os.writeArray(spectrum) << std::endl;
+  os.writeArray(spectrum, ArrayFormat().setSeparator("|").setWidth(10).setPrecision(3).setType('f')) << std::endl;
+
+  // The same values formatted one at a time.
+  std::string expected;
+  for (std::vector<double>::iterator itor = spectrum.begin(); itor != spectrum.end(); ++itor) {
+    if (itor != spectrum.begin()) expected += '|';
+    FormatArg(*itor).render(expected, ":10.3f", 6);
+  }
+  std_os << "Arrays written with writeArray:" << std::endl << oss.str();
+  std_os << "Formatting elements one at a time gives " << (std::string::npos != oss.str().find(expected) ?
+    "the same" : "DIFFERENT") << " text." << std::endl;
+}
+
+void testTableWriter(std::ostream & std_os) {
+  OStream os(false);
+  os.connect(std_os);
+
+  TableWriter table(os, " | ");
+  table.addColumn("Band", 6, '<').addColumn("Counts", 8).addColumn("Rate", 10, '>', 3, 'f').addColumn("Flags", 4,
+    '\0', -1, 'x');
+  table.writeHeader();
+  table.writeRow("soft", 1234, 5.6789, 10);
+  table.writeRow("hard", 56, 0.0005, 255u);
+  table.writeRow(std::string("medium"), -7, 1.e6, 0);
+
+  try {
+    table.writeRow("short", 1);
+    std_os << "A row with too few values DID NOT THROW!" << std::endl;
+  } catch (const std::logic_error & x) {
+    std_os << "A row with too few values threw: " << x.what() << std::endl;
+  }
+}
+
+void testCapture(std::ostream & std_os) {
+  std::ostringstream sink;
+  OStream os(false);
+  os.connect(sink);
+
+  // Stands in for std::cout, written by code which knows nothing of st_stream.
+  std::stringbuf original;
+  std::ostream third_party(&original);
+  CaptureStreamBuf capture(os, &original);
+  third_party.rdbuf(&capture);
+  third_party << "captured line " << 1 << '\n' << "partial line";
+  std_os << "Before flushing, the capturing destination received: " << sink.str();
+  third_party << std::flush;
+  std_os << "After flushing, the capturing destination received: " << sink.str() << std::endl;
+
+  // Forwarding which leads back to the captured stream goes to its original buffer instead.
+  os.connect(third_party);
+  third_party << "looped line" << std::endl;
+  third_party.rdbuf(&original);
+  std_os << "The original buffer of the captured stream received: " << original.str();
+}
+
+int bytesInPipe(int fd) {
+  int size = 0;
+  ioctl(fd, FIONREAD, &size);
+  return size;
+}
+
+void testFdStream(std::ostream & std_os) {
+  int fd[2];
+  if (0 != pipe(fd)) {
+    std_os << "ERROR: could not create a pipe" << std::endl;
+    return;
+  }
+  {
+    // Both streams write to one pipe, so the order of their output is visible.
+    FdStream out(fd[1], 32);
+    FdStream err(fd[1], 32);
+    out.getBuf().setWriteOnFlush(false);
+    err.getBuf().setWriteOnFlush(true);
+    err.getBuf().setTie(&out.getBuf());
+
+    out << "output line 1" << std::endl;
+    std_os << "After flushing the output stream, the pipe held " << bytesInPipe(fd[0]) << " bytes." << std::endl;
+    err << "error line 1" << std::endl;
+    std_os << "After flushing the error stream, the pipe held " << bytesInPipe(fd[0]) << " bytes." << std::endl;
+    out << "output line 2, which is longer than the buffer of the stream" << std::endl;
+    std_os << "After a line longer than the buffer, the pipe held " << bytesInPipe(fd[0]) << " bytes." << std::endl;
+    out << "output line 3" << std::endl;
+  }
+  close(fd[1]);
+
+  std::string text;
+  char buf[256];
+  for (ssize_t size = 0; 0 < (size = read(fd[0], buf, sizeof(buf))); ) text.append(buf, size);
+  close(fd[0]);
+  std_os << "The pipe received:" << std::endl << text;
+}
+
+void writeFdLines(std::ostream & os, int thread_id, int num_lines) {
+  for (int ii = 0; ii != num_lines; ++ii) {
+    std::ostringstream line;
+    line << "thread " << thread_id << " line " << ii;
+    // The text goes through xsputn and the newline through overflow.
+    os << line.str();
+    os.put('\n');
+    if (0 == ii % 10) os.flush();
+  }
+}
+
+void testFdStreamThreads(std::ostream & std_os) {
+  std::ostringstream path;
+  path << "/tmp/test_st_stream-" << getpid() << ".fd";
+  int fd = open(path.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (0 > fd) {
+    std_os << "ERROR: could not create " << path.str() << std::endl;
+    return;
+  }
+
+  // One thread writes each stream, but flushing the error stream drains the output stream from the other thread.
+  const int num_threads = 2;
+  const int num_lines = 20000;
+  {
+    FdStream out(fd, 256);
+    FdStream err(fd, 256);
+    out.getBuf().setWriteOnFlush(false);
+    err.getBuf().setWriteOnFlush(true);
+    err.getBuf().setTie(&out.getBuf());
+    std::thread out_thread(writeFdLines, std::ref(static_cast<std::ostream &>(out)), 0, num_lines);
+    std::thread err_thread(writeFdLines, std::ref(static_cast<std::ostream &>(err)), 1, num_lines);
+    out_thread.join();
+    err_thread.join();
+  }
+  close(fd);
+
+  std::vector<int> next_line(num_threads, 0);
+  int num_good = 0;
+  std::ifstream ifs(path.str().c_str());
+  std::string word1;
+  std::string word2;
+  int thread_id = -1;
+  int line_number = -1;
+  while (ifs >> word1 >> thread_id >> word2 >> line_number) {
+    if ("thread" == word1 && "line" == word2 && 0 <= thread_id && num_threads > thread_id &&
+      next_line[thread_id] == line_number) {
+      ++next_line[thread_id];
+      ++num_good;
+    }
+  }
+  unlink(path.str().c_str());
+  std_os << "Two threads writing tied direct streams wrote " << num_good << " of " << num_threads * num_lines <<
+    " lines intact and in order." << std::endl;
+}
+
+struct Energy {
+  explicit Energy(double kev): m_kev(kev) {}
+  double m_kev;
+  static int s_num_formatted;
+};
+
+int Energy::s_num_formatted = 0;
+
+namespace st_stream {
+  template <>
+  struct TextFormatter<Energy> {
+    static void format(std::string & buf, const Energy & energy) {
+      ++Energy::s_num_formatted;
+      FormatArg(energy.m_kev).render(buf, ".3f", 3);
+      buf += " keV";
+    }
+  };
+}
+
+void testTextFormatter(std::ostream & std_os) {
+  std::ostringstream first;
+  std::ostringstream second;
+  OStream os(false);
+  os.connect(first);
+  os.connect(second);
+
+  os << "Shifted: " << Energy(1.5) << ", written: ";
+  os.write(Energy(2.25)) << ", formatted: ";
+  os.format(ST_FORMAT("{:>12}"), Energy(100.)) << std::endl;
+  std_os << "With a TextFormatter, the first destination received: " << first.str();
+  std_os << "The second destination received " << (first.str() == second.str() ? "the same" : "DIFFERENT") <<
+    " text, and energies were formatted " << Energy::s_num_formatted << " times." << std::endl;
+}
+
+/// \brief Stream buffer which discards everything, without allocating.
+class NullStreamBuf : public std::streambuf {
+  protected:
+    virtual int_type overflow(int_type c) { return traits_type::not_eof(c); }
+    virtual std::streamsize xsputn(const char *, std::streamsize n) { return n; }
+};
+
+void allocationHelper(StreamFormatter & formatter, OStream & os, int ii) {
+  ContextGuard guard("helper");
+  formatter.info().prefix() << "message " << ii << std::endl;
+  formatter.warn().prefix().format(ST_FORMAT("x={:.3f} energy={} name={}"), 1.5 * ii, Energy(ii), "detector") <<
+    std::endl;
+  double values[] = { 1. * ii, 2. * ii, 3. * ii };
+  os.writeArray(values, ArrayFormat().setPrecision(2).setType('f')) << std::endl;
+}
+
+void testAllocation(std::ostream & std_os) {
+  NullStreamBuf null_buf;
+  std::ostream null_os(&null_buf);
+  OStream os(false);
+  os.connect(null_os);
+  stout.connect(null_os);
+  stlog.connect(null_os);
+  stout.disconnect(std_os);
+  stlog.disconnect(std_os);
+  stout.disconnect(std::cout);
+  stlog.disconnect(std::clog);
+
+  StreamFormatter formatter("Detector", "read", 2);
+  for (int ii = 0; ii != 10; ++ii) allocationHelper(formatter, os, ii);
+  unsigned long long num_buffer_allocations = GetNumBufferAllocations();
+  unsigned long long num_heap_allocations = s_num_heap_allocations;
+  for (int ii = 0; ii != 1000; ++ii) allocationHelper(formatter, os, ii);
+  num_heap_allocations = s_num_heap_allocations - num_heap_allocations;
+  num_buffer_allocations = GetNumBufferAllocations() - num_buffer_allocations;
+
+  stout.connect(std::cout);
+  stlog.connect(std::clog);
+  stout.connect(std_os);
+  stlog.connect(std_os);
+  stout.disconnect(null_os);
+  stlog.disconnect(null_os);
+  std_os << "Writing 3000 messages after warming up made " << num_heap_allocations << " heap allocations and " <<
+    num_buffer_allocations << " buffer allocations." << std::endl;
+}
+
+void testUnconnectedStream(std::ostream & std_os) {
+  // A stream without destinations allocates nothing, and all of its operations are harmless.
+  unsigned long long num_heap_allocations = s_num_heap_allocations;
+  OStream os(false);
+  os << prefix << "This was written to a stream without destinations, so THIS SHOULD NOT APPEAR!" << std::endl;
+  os.precision(4);
+  OStream copy(os);
+  copy = os;
+  bool unallocated = s_num_heap_allocations == num_heap_allocations;
+  copy.setPrefix("copy: ");
+  copy.connect(std_os);
+  copy << prefix << "unconnected stream " << (unallocated ? "allocated nothing" : "allocated memory") <<
+    ", prefix of original is \"" << os.getPrefix() << "\"" << std::endl;
+  copy = os;
+  copy << "THIS SHOULD NOT APPEAR after assigning an unconnected stream!" << std::endl;
+}
+
+bool waitForText(std::ostringstream & probe) {
+  for (int ii = 0; ii != 500; ++ii) {
+    {
+      SinkLock sink_lock;
+      if (!probe.str().empty()) return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return false;
+}
+
+void runWorker(std::ostream & std_os, StreamFormatter & formatter, FdStream & log, OStream & os, int worker,
+  int start_fd) {
+  // Use this process's own copies of the global streams to see the prefix.
+  std::ostringstream prefix_probe;
+  stout.disconnect(std::cout);
+  stout.disconnect(std_os);
+  stout.connect(prefix_probe);
+  formatter.info().prefix() << "hello" << std::endl;
+  std::ostringstream pid_tag;
+  pid_tag << "[" << getpid() << "]";
+  bool own_pid = std::string::npos != prefix_probe.str().find(pid_tag.str());
+
+  // The background thread which writes deferred lines must have been restarted in this process.
+  std::ostringstream deferred_probe;
+  OStream deferred_os(false);
+  deferred_os.connect(deferred_probe);
+  deferred_os.defer(ST_FORMAT("worker {} deferred"), worker);
+  bool deferred = waitForText(deferred_probe);
+
+  // Start writing when all workers can, so their writes overlap.
+  char start = 0;
+  while (0 > read(start_fd, &start, 1) && EINTR == errno) {}
+  for (int ii = 0; ii != 1000; ++ii) os << "worker " << worker << " line " << ii << " of 1000" << std::endl;
+  os << "worker " << worker << ": prefix shows own process id: " << (own_pid ? "yes" : "no") <<
+    ", deferred line written: " << (deferred ? "yes" : "no") << std::endl;
+  log.getBuf().drain();
+}
+
+void testFork(std::ostream & std_os) {
+  std::ostringstream name;
+  name << "test_st_stream-fork-" << getpid() << ".log";
+  std::remove(name.str().c_str());
+
+  const int num_workers = 3;
+  SetShowProcessId(true);
+  StreamFormatter formatter("Worker", "run", 2);
+  // Build the prefixes in this process before forking, without displaying anything.
+  formatter.info(4) << "not displayed" << std::endl;
+  {
+    // The buffer holds only a few lines, so each worker writes many times while the others are writing.
+    FdStream log(name.str(), 64);
+    OStream os(false);
+    os.connect(log);
+    os << "parent: written once, before the workers" << std::endl;
+
+    int start_pipe[2];
+    if (0 != pipe(start_pipe)) {
+      std_os << "ERROR: could not create a pipe" << std::endl;
+      return;
+    }
+    std::vector<pid_t> pid;
+    for (int worker = 0; worker != num_workers; ++worker) {
+      pid_t child = fork();
+      if (0 == child) {
+        close(start_pipe[1]);
+        runWorker(std_os, formatter, log, os, worker, start_pipe[0]);
+        _exit(0);
+      }
+      if (0 < child) pid.push_back(child);
+    }
+    // Closing the pipe starts the workers.
+    close(start_pipe[0]);
+    close(start_pipe[1]);
+    for (std::vector<pid_t>::iterator itor = pid.begin(); itor != pid.end(); ++itor) waitpid(*itor, 0, 0);
+  }
+  SetShowProcessId(false);
+
+  // Every line must be intact, and each worker's lines must be in order.
+  std::ifstream log_file(name.str().c_str());
+  std::vector<int> next_line(num_workers, 0);
+  std::vector<std::string> summary(num_workers);
+  int num_parent_lines = 0;
+  int num_bad_lines = 0;
+  for (std::string line; std::getline(log_file, line); ) {
+    std::istringstream iss(line);
+    std::string word;
+    int worker = -1;
+    int line_num = -1;
+    if ("parent: written once, before the workers" == line) {
+      ++num_parent_lines;
+    } else if (iss >> word >> worker && "worker" == word && 0 <= worker && num_workers > worker) {
+      std::string rest;
+      std::getline(iss, rest);
+      if (0 == rest.find(": ")) summary[worker] = line;
+      else if (std::istringstream(rest) >> word >> line_num && "line" == word && next_line[worker] == line_num &&
+        rest == " line " + std::to_string(line_num) + " of 1000") ++next_line[worker];
+      else ++num_bad_lines;
+    } else {
+      ++num_bad_lines;
+    }
+  }
+  std::remove(name.str().c_str());
+
+  std_os << "The forked workers' log held the parent's line " << num_parent_lines << " time(s), and " <<
+    num_bad_lines << " damaged or misplaced line(s)." << std::endl;
+  for (int worker = 0; worker != num_workers; ++worker)
+    std_os << next_line[worker] << " lines in order; " << summary[worker] << std::endl;
+  // A child may write an error to a compressed stream it inherited, without waiting for the parent's compression
+  // thread, and without writing the parent's frame again.
+  std::string gz_name = "test_st_stream-fork.gz";
+  {
+    GzipStream gz_os(gz_name);
+    OStream gz_out(false);
+    OStream gz_err(false);
+    gz_out.connect(gz_os);
+    gz_err.connect(gz_os);
+    gz_err.setMessageType(eError);
+    gz_out << "parent: compressed before the fork" << std::endl;
+    pid_t child = fork();
+    if (0 == child) {
+      gz_err << "child: compressed error" << std::endl;
+      _exit(0);
+    }
+    if (0 < child) waitpid(child, 0, 0);
+    gz_out << "parent: compressed after the fork" << std::endl;
+  }
+  std_os << "The compressed log written across a fork held:" << std::endl << readGzipFile(gz_name);
+  std::remove(gz_name.c_str());
+}
+
+void testIndexedFile(std::ostream & std_os) {
+  std::string file_name = "test_st_stream-index.log";
+  {
+    // Use small blocks so that the log consists of several.
+    IndexedFileStream log(file_name, false, 128);
+    sterr.connect(log);
+    stlog.connect(log);
+    stout.connect(log);
+    StreamFormatter reader("IndexReader", "read", 0);
+    StreamFormatter writer("IndexWriter", "write", 0);
+    for (int ii = 0; ii != 6; ++ii) reader.info() << prefix << "read record " << ii << std::endl;
+    writer.warn() << prefix << "disk almost full" << std::endl;
+    writer.err() << prefix << "disk full" << std::endl;
+    for (int ii = 6; ii != 12; ++ii) reader.info() << prefix << "read record " << ii << std::endl;
+    sterr.disconnect(log);
+    stlog.disconnect(log);
+    stout.disconnect(log);
+  }
+
+  // Only the blocks which may hold the writer's errors need be read.
+  LogIndex index(file_name);
+  std::vector<IndexBlock> selected(index.select(eErrorMask, "IndexWriter"));
+  std::string text;
+  int num_errors = 0;
+  for (std::vector<IndexBlock>::iterator itor = selected.begin(); itor != selected.end(); ++itor) {
+    index.read(*itor, text);
+    std::istringstream iss(text);
+    for (std::string line; std::getline(iss, line); ) if (eError == ClassifyLine(line.data(), line.size())) ++num_errors;
+  }
+  std_os << "The log index selected " << selected.size() << " of " << index.getBlocks().size() <<
+    " block(s) for errors from IndexWriter, holding " << num_errors << " error(s)." << std::endl;
+  std_os << "Blocks which may hold info from IndexWriter::write: " <<
+    index.select(eInfoMask, "IndexWriter::write").size() << "; from IndexReader: " <<
+    index.select(eInfoMask, "IndexReader").size() << "; from NoSuchClass: " <<
+    index.select(eAllMessageTypes, "NoSuchClass").size() << "." << std::endl;
+  std::remove(file_name.c_str());
+  std::remove(LogIndex::getIndexName(file_name).c_str());
+
+  // Lines without a prefix take the type of the stream which wrote them, including each line of a multi-line text.
+  {
+    IndexedFileStream log(file_name, false, 32);
+    sterr.connect(log);
+    stout.connect(log);
+    stout << "plain output line" << std::endl;
+    sterr << "raw error line" << std::endl;
+    stout << "plain output line" << std::endl;
+    sterr << "  #0 first frame\n  #1 second frame\n" << std::flush;
+    stout << "plain output line" << std::endl;
+    sterr.disconnect(log);
+    stout.disconnect(log);
+  }
+  LogIndex raw_index(file_name);
+  selected = raw_index.select(eErrorMask);
+  std::string error_text;
+  for (std::vector<IndexBlock>::iterator itor = selected.begin(); itor != selected.end(); ++itor) {
+    raw_index.read(*itor, text);
+    error_text += text;
+  }
+  std_os << "The log index selected " << selected.size() << " of " << raw_index.getBlocks().size() <<
+    " block(s) for errors written without a prefix, holding:" << std::endl << error_text;
+  std::remove(file_name.c_str());
+  std::remove(LogIndex::getIndexName(file_name).c_str());
+
+  // A flushed error ends the block at once, while other flushed lines wait for the block to fill.
+  {
+    IndexedFileStream log(file_name);
+    OStream log_out(false);
+    OStream log_err(false);
+    log_out.connect(log);
+    log_err.connect(log);
+    log_err.setMessageType(eError);
+    log_out << "ordinary indexed line" << std::endl;
+    std::size_t num_blocks = LogIndex(file_name).getBlocks().size();
+    log_err << "flushed indexed error" << std::endl;
+    LogIndex flushed_index(file_name);
+    selected = flushed_index.select(eErrorMask);
+    error_text.clear();
+    for (std::vector<IndexBlock>::iterator itor = selected.begin(); itor != selected.end(); ++itor) {
+      flushed_index.read(*itor, text);
+      error_text += text;
+    }
+    std_os << "Before an error was flushed, the log held " << num_blocks << " block(s); after it, the index " <<
+      "selected " << selected.size() << " block(s) for errors, holding:" << std::endl << error_text;
+  }
+  std::remove(file_name.c_str());
+  std::remove(LogIndex::getIndexName(file_name).c_str());
+
+  // A block pending when the process forks is written once, and the child may keep writing.
+  {
+    IndexedFileStream log(file_name);
+    OStream log_out(false);
+    log_out.connect(log);
+    log_out << "indexed before the fork" << std::endl;
+    pid_t child = fork();
+    if (0 == child) {
+      log_out << "indexed by the child" << std::endl;
+      log.close();
+      _exit(0);
+    }
+    if (0 < child) waitpid(child, 0, 0);
+    log_out << "indexed after the fork" << std::endl;
+  }
+  LogIndex fork_index(file_name);
+  std::string fork_text;
+  for (std::vector<IndexBlock>::const_iterator itor = fork_index.getBlocks().begin();
+    itor != fork_index.getBlocks().end(); ++itor) {
+    fork_index.read(*itor, text);
+    fork_text += text;
+  }
+  std_os << "A log written across a fork was indexed in " << fork_index.getBlocks().size() << " block(s), holding:" <<
+    std::endl << fork_text;
+  std::remove(file_name.c_str());
+  std::remove(LogIndex::getIndexName(file_name).c_str());
+
+  // Streams appending to the same log index each block where it was written.
+  {
+    IndexedFileStream log1(file_name, true, 32);
+    IndexedFileStream log2(file_name, true, 32);
+    OStream os1(false);
+    OStream os2(false);
+    os1.connect(log1);
+    os2.connect(log2);
+    for (int ii = 0; ii != 5; ++ii) {
+      os1 << "first stream line " << ii << std::endl;
+      os2 << "second stream line " << ii << std::endl;
+    }
+  }
+  LogIndex append_index(file_name);
+  int num_misplaced = 0;
+  for (std::vector<IndexBlock>::const_iterator itor = append_index.getBlocks().begin();
+    itor != append_index.getBlocks().end(); ++itor) {
+    append_index.read(*itor, text);
+    std::istringstream iss(text);
+    std::string first_word;
+    unsigned int num_lines = 0;
+    bool same_stream = true;
+    for (std::string line; std::getline(iss, line); ++num_lines) {
+      std::string word = line.substr(0, line.find(' '));
+      if (first_word.empty()) first_word = word;
+      same_stream = same_stream && word == first_word && std::string::npos != line.find(" stream line ");
+    }
+    if (!same_stream || 0 == num_lines || itor->m_num_lines != num_lines || '\n' != text[text.size() - 1])
+      ++num_misplaced;
+  }
+  std_os << "Two streams appending to one log indexed " << append_index.getBlocks().size() << " block(s), " <<
+    num_misplaced << " of them misplaced." << std::endl;
+  std::remove(file_name.c_str());
+  std::remove(LogIndex::getIndexName(file_name).c_str());
+}
+
+void failWithBacktrace(StreamFormatter & formatter) {
+  formatter.err() << prefix << "failed, with a backtrace if enabled" << std::endl;
+}
+
+void testBacktrace(std::ostream & std_os) {
+  // Collect the errors separately, since backtraces differ from build to build.
+  std::ostringstream errors;
+  sterr.disconnect(std_os);
+  sterr.connect(errors);
+  StreamFormatter formatter("Tracer", "fail", 0);
+  BacktraceMode mode[] = { eSymbolizedBacktraces, eRawBacktraces, eNoBacktraces };
+  for (int ii = 0; ii != 3; ++ii) {
+    SetErrorBacktraces(mode[ii]);
+    failWithBacktrace(formatter);
+    FlushBacktraces();
+  }
+  SetErrorBacktraces(eNoBacktraces);
+  sterr.disconnect(errors);
+  sterr.connect(std_os);
+
+  // Each backtrace follows its error, and every frame names the file which contains it and the offset in the file.
+  int num_errors = 0;
+  int num_backtraces = 0;
+  int num_frames = 0;
+  int num_located = 0;
+  int num_named = 0;
+  bool in_order = true;
+  std::string last_line;
+  std::istringstream iss(errors.str());
+  for (std::string line; std::getline(iss, line); last_line = line) {
+    if (std::string::npos != line.find("failed, with a backtrace")) {
+      ++num_errors;
+    } else if (std::string::npos != line.find("Tracer::fail: backtrace ")) {
+      ++num_backtraces;
+      in_order = in_order && std::string::npos != last_line.find("failed, with a backtrace");
+    } else if (0 == line.find("  #")) {
+      ++num_frames;
+      if (std::string::npos != line.find("+0x") && ')' == line[line.size() - 1]) ++num_located;
+      // Raw frames begin with the file, in parentheses; symbolized frames with the function, where it is known.
+      std::string::size_type frame = line.find(' ', 3) + 1;
+      if ('(' != line[frame] && 0 != line.compare(frame, 2, "??")) ++num_named;
+    }
+  }
+  std_os << num_errors << " error(s) were written, followed by " << num_backtraces << " backtrace(s)" <<
+    (in_order ? "" : " OUT OF ORDER") << "; " << (0 != num_frames && num_frames == num_located ? "every" : "NOT EVERY") <<
+    " frame was located, and " << (0 != num_named ? "some" : "NO") << " functions were named." << std::endl;
+
+  // Forking while the background thread writes backtraces must not deadlock, even when a fork handler registered
+  // after the first backtrace, e.g. that of SocketStream, runs before the one for backtraces.
+  std::ostringstream fork_errors;
+  sterr.disconnect(std_os);
+  sterr.connect(fork_errors);
+  SetErrorBacktraces(eSymbolizedBacktraces);
+  failWithBacktrace(formatter);
+  std::ostringstream path;
+  path << "/tmp/test_st_stream-" << getpid() << "-backtrace.sock";
+  int num_forks = 0;
+  {
+    SocketStream socket_os(path.str());
+    for (int ii = 0; ii != 50; ++ii) {
+      failWithBacktrace(formatter);
+      pid_t child = fork();
+      if (0 == child) _exit(0);
+      if (0 < child && child == waitpid(child, 0, 0)) ++num_forks;
+    }
+  }
+  FlushBacktraces();
+  SetErrorBacktraces(eNoBacktraces);
+  sterr.disconnect(fork_errors);
+  sterr.connect(std_os);
+  std_os << num_forks << " of 50 forks completed while backtraces were being written." << std::endl;
+
+  // Without FlushBacktraces, the background thread writes each backtrace later, after any deferred errors. Each
+  // error names its backtrace, which must follow it.
+  std::ostringstream tagged;
+  sterr.disconnect(std_os);
+  sterr.connect(tagged);
+  SetErrorBacktraces(eRawBacktraces);
+  const int num_tagged = 6;
+  for (int ii = 0; ii != num_tagged; ++ii) {
+    if (0 == ii % 2) formatter.err().defer(ST_FORMAT("deferred failure {}"), ii);
+    else formatter.err() << prefix << "direct failure " << ii << std::endl;
+  }
+  SetErrorBacktraces(eNoBacktraces);
+  std::string tagged_text;
+  for (int num_headers = 0, ii = 0; num_tagged != num_headers && ii != 100; ++ii) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    {
+      SinkLock lock;
+      tagged_text = tagged.str();
+    }
+    num_headers = 0;
+    for (std::string::size_type pos = 0; std::string::npos != (pos = tagged_text.find(": backtrace ", pos)); ++pos)
+      ++num_headers;
+  }
+  sterr.disconnect(tagged);
+  sterr.connect(std_os);
+
+  // Match each backtrace header to the error carrying its number, which must come earlier.
+  std::map<std::string, int> error_line;
+  int num_matched = 0;
+  int line_num = 0;
+  std::istringstream tagged_iss(tagged_text);
+  for (std::string line; std::getline(tagged_iss, line); ++line_num) {
+    std::string::size_type tag = line.find("(backtrace ");
+    std::string::size_type header = line.find(": backtrace ");
+    if (std::string::npos != tag) {
+      error_line[line.substr(tag + 11, line.find(')', tag) - tag - 11)] = line_num;
+    } else if (std::string::npos != header) {
+      std::string number = line.substr(header + 12, line.find(':', header + 12) - header - 12);
+      std::map<std::string, int>::iterator error = error_line.find(number);
+      if (error_line.end() != error && error->second < line_num) ++num_matched;
+    }
+  }
+  std_os << num_matched << " of " << num_tagged << " backtraces written without flushing followed the error " <<
+    "naming them." << std::endl;
+}
+
+void testSocketStream(std::ostream & std_os) {
+  std::ostringstream path;
+  path << "/tmp/test_st_stream-" << getpid() << ".sock";
+  std::remove(path.str().c_str());
+
+  // Without a collector, lines are kept in the small spill buffer until it is full, then dropped, without blocking.
+  SocketStream socket_os(path.str(), 128, 512);
+  OStream os(false);
+  os.connect(socket_os);
+  for (int ii = 0; ii != 40; ++ii) os << "socket line " << ii << std::endl;
+  socket_os.getBuf().drain();
+  std_os << "Without a collector, " << socket_os.getBuf().getSpillSize() << " bytes were kept and " <<
+    socket_os.getBuf().getNumDropped() << " line(s) dropped." << std::endl;
+
+  // Once the collector starts, the kept lines arrive first, in whole-line batches.
+  SocketCollector collector(path.str());
+  for (int ii = 40; ii != 50; ++ii) os << "socket line " << ii << std::endl;
+  socket_os.getBuf().drain();
+  std::string batch;
+  std::string received;
+  int num_batches = 0;
+  int num_torn = 0;
+  while (collector.receive(batch, 1000)) {
+    ++num_batches;
+    if (batch.empty() || '\n' != batch[batch.size() - 1]) ++num_torn;
+    received += batch;
+    if (std::string::npos != batch.find("socket line 49\n")) break;
+  }
+  std::istringstream iss(received);
+  int num_lines = 0;
+  int last_line = -1;
+  bool in_order = true;
+  std::string word1;
+  std::string word2;
+  for (int line_num = 0; iss >> word1 >> word2 >> line_num; ++num_lines) {
+    in_order = in_order && "socket" == word1 && "line" == word2 && last_line < line_num;
+    last_line = line_num;
+  }
+  std_os << "The collector then received " << num_lines << " line(s) " << (in_order ? "in order" : "OUT OF ORDER") <<
+    ", ending with line " << last_line << ", in " << (1 < num_batches ? "several" : "ONE") << " batch(es), " << num_torn <<
+    " of them ending in a partial line." << std::endl;
+
+  // A lone line is sent by the background thread once it has waited, without another flush or drain.
+  os << "socket line 50" << std::endl;
+  bool lone_sent = collector.receive(batch, 1000) && "socket line 50\n" == batch;
+
+  // An error is sent as soon as it is flushed.
+  OStream err_os(false);
+  err_os.setMessageType(eError);
+  err_os.connect(socket_os);
+  err_os << "socket error line" << std::endl;
+  bool error_sent = collector.receive(batch, 0) && "socket error line\n" == batch;
+  std_os << "A lone line was " << (lone_sent ? "sent after a delay" : "NOT SENT") << ", and an error line was " <<
+    (error_sent ? "sent at once" : "NOT SENT AT ONCE") << "." << std::endl;
+  // A line still waiting for its batch when the process forks is sent once, not once by each process.
+  os << "socket line before fork" << std::endl;
+  pid_t child = fork();
+  if (0 == child) {
+    socket_os.getBuf().drain();
+    _exit(0);
+  }
+  if (0 < child) waitpid(child, 0, 0);
+  socket_os.getBuf().drain();
+  int num_copies = 0;
+  while (collector.receive(batch, 300))
+    for (std::string::size_type pos = batch.find("socket line before fork\n"); std::string::npos != pos;
+      pos = batch.find("socket line before fork\n", pos + 1)) ++num_copies;
+  std_os << "A line written before a fork was received " << num_copies << " time(s)." << std::endl;
+}
+
 int main() {
   // Before initializing standard streams, write to stout. This should have no effect.
   stout << prefix << "This was written before initializing standard streams, so THIS SHOULD NOT APPEAR on any stream!" << std::endl;
@@ -332,6 +1842,32 @@ int main() {
   // Restore debugging state.
   sf2.setDebugMode(debug_mode);
 
+  // Test additional kinds of destinations.
+  testShmStream(std_os);
+  testGzipStream(std_os);
+  testThreadStage(std_os);
+  testRuntimeControl(std_os);
+  testSampler(std_os);
+  testFormat(std_os);
+  testDeferred(std_os);
+  testScopeTimer(std_os);
+  testContext(std_os);
+  testSinkFilter(std_os);
+  testMetrics(std_os);
+  testProgress(std_os);
+  testWriteArray(std_os);
+  testTableWriter(std_os);
+  testCapture(std_os);
+  testFdStream(std_os);
+  testFdStreamThreads(std_os);
+  testTextFormatter(std_os);
+  testAllocation(std_os);
+  testUnconnectedStream(std_os);
+  testFork(std_os);
+  testIndexedFile(std_os);
+  testBacktrace(std_os);
+  testSocketStream(std_os);
+
   // Test setting stream precision.
   double a_double = 1.23456789012;
 
@@ -0,0 +1,58 @@
+/** \file Backtrace.h
+    \brief Declarations for backtraces of error messages, which are captured cheaply when an error is reported and
+           symbolized later, off the thread which reported it.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_Backtrace_h
+#define st_stream_Backtrace_h
+
+#include <string>
+
+namespace st_stream {
+
+  /** \brief What, if anything, is written about the call path of each error message.
+
+             eRawBacktraces writes each frame as the file of the executable or shared library containing it and the
+             offset in that file, which addr2line can symbolize offline, e.g. addr2line -Cfe my_tool 0x12ab.
+             eSymbolizedBacktraces also writes the name of the function, where the dynamic symbol table has it;
+             functions of the executable itself are only named if it was linked with -rdynamic.
+  */
+  enum BacktraceMode { eNoBacktraces, eRawBacktraces, eSymbolizedBacktraces };
+
+  /** \func SetErrorBacktraces
+      \brief Select whether StreamFormatter::err() captures the call path of each error message.
+
+             Capturing only copies the return addresses of the current call stack, which takes microseconds. The
+             addresses are queued together with the error prefix and a number, and a background thread, started
+             when the first backtrace is captured, symbolizes them and writes them to sterr a short time later,
+             after any deferred output (see Deferred.h), so that they normally follow the error message they
+             belong to. They are also written when the process exits, and when FlushBacktraces is called. Each
+             error message carries the number of its backtrace, e.g. "(backtrace 3)", and the backtrace begins
+             with "backtrace 3:", so the two can be matched however far apart they are written. The default is
+             eNoBacktraces.
+      \param mode The backtrace mode.
+  */
+  void SetErrorBacktraces(BacktraceMode mode = eSymbolizedBacktraces);
+
+  /** \func GetErrorBacktraces
+      \brief Return the current backtrace mode (see SetErrorBacktraces).
+  */
+  BacktraceMode GetErrorBacktraces();
+
+  /** \func CaptureBacktrace
+      \brief Capture the call path of the caller's caller, if backtraces are enabled, and queue it to be written
+             with the given prefix. Return the number of the backtrace, with which the caller tags its error
+             message, or 0 if backtraces are disabled. StreamFormatter::err() calls this.
+      \param prefix The prefix of the lines written for the backtrace.
+  */
+  unsigned long long CaptureBacktrace(const std::string & prefix);
+
+  /** \func FlushBacktraces
+      \brief Symbolize and write all queued backtraces to sterr at once, in the order in which they were captured.
+             Call this after writing an error message if its backtrace must follow it immediately.
+  */
+  void FlushBacktraces();
+
+}
+
+#endif
@@ -0,0 +1,75 @@
+/** \file Capture.h
+    \brief Declaration of CaptureStreamBuf class, and functions which redirect the standard C++ streams into
+           the global OStream objects.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_Capture_h
+#define st_stream_Capture_h
+
+#include <streambuf>
+#include <string>
+
+namespace st_stream {
+
+  class OStream;
+
+  /** \class CaptureStreamBuf
+      \brief Stream buffer which forwards everything written to it to an OStream, so that output written by
+             code which knows nothing of st_stream (e.g. to std::cout) goes to the destinations of the OStream.
+             Complete lines are forwarded as they are written; a partial line is forwarded when the stream is
+             flushed. The buffer has no put area, so every write takes the SinkLock, and it may be shared by
+             several threads.
+
+             If forwarding leads back to this buffer (for example because the OStream is itself connected to the
+             stream being captured), the output is written to the original stream buffer instead.
+  */
+  class CaptureStreamBuf : public std::streambuf {
+    public:
+      /** \brief Create a buffer which forwards to the given stream.
+          \param dest The stream to which output is forwarded.
+          \param original The stream buffer used when forwarding would lead back to this buffer. May be 0,
+                 in which case such output is discarded.
+      */
+      CaptureStreamBuf(OStream & dest, std::streambuf * original);
+
+      virtual ~CaptureStreamBuf();
+
+      /** \brief Return the stream buffer given to the constructor.
+      */
+      std::streambuf * getOriginal() const { return m_original; }
+
+    protected:
+      virtual int_type overflow(int_type c);
+
+      virtual std::streamsize xsputn(const char * s, std::streamsize n);
+
+      virtual int sync();
+
+    private:
+      /** \brief Forward complete lines, or everything if flush is true, and remove them from the pending text.
+      */
+      void forward(bool flush);
+
+      OStream & m_dest;
+      std::streambuf * m_original;
+      std::string m_pending;
+      bool m_forwarding;
+  };
+
+  /** \func CaptureStdStreams
+      \brief Replace the stream buffers of std::cout, std::cerr and std::clog so that output written to them goes
+             to stout, sterr and stlog respectively, and through them to all of their destinations. The global
+             streams must not be connected to the standard streams themselves (see InitStdStreams, which connects
+             them to the file descriptors when capturing). The original buffers are restored at exit.
+  */
+  void CaptureStdStreams();
+
+  /** \func ReleaseStdStreams
+      \brief Forward any pending partial lines, and restore the original stream buffers of std::cout, std::cerr and
+             std::clog. Has no effect if they are not captured.
+  */
+  void ReleaseStdStreams();
+
+}
+
+#endif
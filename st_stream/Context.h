@@ -0,0 +1,76 @@
+/** \file Context.h
+    \brief Declarations of ContextStack and ContextGuard classes, which maintain a stack of names describing what
+           the current thread is doing, for use in the prefixes of StreamFormatter objects.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_Context_h
+#define st_stream_Context_h
+
+namespace st_stream {
+
+  /** \class ContextStack
+      \brief Stack of context names belonging to one thread. Each different state of the stack has a different
+             identifier, so users can tell cheaply whether the stack changed since they last looked at it.
+  */
+  struct ContextStack {
+    /** \brief Maximum number of names kept. Deeper contexts are counted but not named.
+    */
+    static const unsigned int s_max_depth = 32;
+
+    const char * m_name[s_max_depth];
+    unsigned int m_depth;
+    unsigned long long m_id;
+    unsigned long long m_next_id;
+  };
+
+  /** \func GetContextStack
+      \brief Return the context stack of the calling thread.
+  */
+  inline ContextStack & GetContextStack() {
+    // Zero-initialized, so it needs no construction when a thread first uses it.
+    static thread_local ContextStack s_stack;
+    return s_stack;
+  }
+
+  /** \class ContextGuard
+      \brief Helper which pushes a name on the calling thread's context stack for the lifetime of the guard. The
+             prefixes of StreamFormatter objects include the names on the stack after the method name, separated
+             by '>', so a helper function called from Class::outer may write:
+
+             void helper() {
+               st_stream::ContextGuard guard("inner");
+               os.info() << prefix << "..." << std::endl; // Prefix includes "Class::outer>inner: ".
+             }
+
+             Only a pointer to the name is kept, so it must outlive the guard; normally it is a string literal.
+             Pushing and popping cost only a few stores; prefixes are rebuilt only when a message is displayed.
+  */
+  class ContextGuard {
+    public:
+      /** \brief Push the given name on the calling thread's context stack.
+          \param name The name.
+      */
+      explicit ContextGuard(const char * name): m_stack(GetContextStack()), m_prev_id(m_stack.m_id) {
+        if (ContextStack::s_max_depth > m_stack.m_depth) m_stack.m_name[m_stack.m_depth] = name;
+        ++m_stack.m_depth;
+        m_stack.m_id = ++m_stack.m_next_id;
+      }
+
+      /** \brief Pop the name, restoring the stack to the state it had before the guard was created.
+      */
+      ~ContextGuard() {
+        --m_stack.m_depth;
+        m_stack.m_id = m_prev_id;
+      }
+
+    private:
+      ContextGuard(const ContextGuard &);
+      ContextGuard & operator =(const ContextGuard &);
+
+      ContextStack & m_stack;
+      unsigned long long m_prev_id;
+  };
+
+}
+
+#endif
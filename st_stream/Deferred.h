@@ -0,0 +1,37 @@
+/** \file Deferred.h
+    \brief Declarations for deferred output, which moves the formatting and writing of messages off the threads
+           which produce them.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_Deferred_h
+#define st_stream_Deferred_h
+
+#include "st_stream/Stream.h"
+
+namespace st_stream {
+
+  /** \func FlushDeferred
+      \brief Format and write all lines deferred by all threads (see OStream::defer), in the order in which they
+             were deferred, and flush their destinations.
+
+             Deferred lines are kept in a queue private to the calling thread, together with copies of their
+             arguments and a pointer to the prefix of the stream. A background thread, started when the first
+             line is deferred, formats and writes the lines from all threads in order, while holding a SinkLock,
+             whenever a thread has queued enough lines, and otherwise a few times per second. Lines are also
+             written when a thread exits, when a stream to which lines were deferred is destroyed, when the
+             process exits, and when this function is called.
+
+             Output written directly to a stream (e.g. with operator <<) is not delayed, so it may appear before
+             lines deferred earlier. Call this function first if the order matters. Once a line has been deferred
+             to a stream, output written directly to any of its std::ostream destinations, through any OStream, is
+             written while holding the SinkLock too, so it never overlaps the background thread's writes. A
+             deferred line may still come between the pieces of a message written directly in several pieces;
+             write such a message in one piece (e.g. with OStream::format) if that matters. Streams to which lines are
+             deferred must not be connected to thread stages (see ThreadStage.h), and their destinations must not
+             be changed while lines deferred to them are waiting to be written.
+  */
+  void FlushDeferred();
+
+}
+
+#endif
@@ -0,0 +1,173 @@
+/** \file FdStream.h
+    \brief Declaration of FdStream class, which writes output directly to a file descriptor.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_FdStream_h
+#define st_stream_FdStream_h
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace st_stream {
+
+  /** \class FdStreamBuf
+      \brief Stream buffer which writes output to a file descriptor with write(2) and writev(2), without going
+             through stdio. Output is collected in a large buffer; text too long to fit is written together
+             with the buffered text in a single writev call, without copying.
+
+             Whether flushing the stream (e.g. with std::endl) writes the buffered output at once is a policy:
+             by default it does only if the descriptor is a terminal, so that output redirected to a file is
+             written in large blocks rather than a line at a time. Buffered output is always written when the
+             buffer is full, by drain(), and when the buffer is destroyed.
+
+             A buffer may be tied to another one, whose output is then written first whenever this one writes,
+             so that, for example, an error message never appears before the ordinary output preceding it.
+             The descriptor is not closed when the buffer is destroyed.
+
+             In whole-line mode, output is written only in complete lines, each write call carrying one or more
+             of them, except for a line longer than the buffer or an incomplete line when the stream is flushed.
+             Several processes appending to the same file (opened with O_APPEND) then never interleave parts
+             of their lines. Before the process forks, all buffers are drained, so their contents are written
+             once rather than by both processes.
+
+             The buffer is safe to use from several threads at once, e.g. through streams for direct output: all
+             output passes through overflow() or xsputn(), which take the buffer's own lock, so text written by
+             one thread is never lost or torn by another. A buffer holds its lock while draining the buffer it
+             is tied to, so ties must not form a cycle.
+  */
+  class FdStreamBuf : public std::streambuf {
+    public:
+      /** \brief Create a buffer which writes to the given file descriptor.
+          \param fd The file descriptor, e.g. STDOUT_FILENO.
+          \param buffer_size The number of bytes collected before they are written.
+      */
+      explicit FdStreamBuf(int fd, std::size_t buffer_size = s_default_buffer_size);
+
+      virtual ~FdStreamBuf();
+
+      /** \brief Write all buffered output now, regardless of the flush policy. Return false on error.
+      */
+      bool drain();
+
+      /** \brief Return the file descriptor.
+      */
+      int getFd() const { return m_fd; }
+
+      /** \brief Return whether flushing the stream writes buffered output at once.
+      */
+      bool getWriteOnFlush() const { return m_write_on_flush; }
+
+      /** \brief Choose whether flushing the stream writes buffered output at once.
+          \param write_on_flush Whether flushing writes buffered output.
+      */
+      void setWriteOnFlush(bool write_on_flush) { m_write_on_flush = write_on_flush; }
+
+      /** \brief Return whether output is written only in complete lines.
+      */
+      bool getWholeLines() const { return m_whole_lines; }
+
+      /** \brief Choose whether output is written only in complete lines.
+          \param whole_lines Whether output is written only in complete lines.
+      */
+      void setWholeLines(bool whole_lines) { m_whole_lines = whole_lines; }
+
+      /** \brief Tie this buffer to another one, whose output is written before any output of this one.
+          \param tie The other buffer, or 0 to untie.
+      */
+      void setTie(FdStreamBuf * tie) { m_tie = tie; }
+
+      /** \brief Default number of bytes collected before they are written.
+      */
+      static const std::size_t s_default_buffer_size = 64 * 1024;
+
+      /** \brief Take the lock of every buffer and drain it in a handler run before the process forks (see
+                 pthread_atfork). The locks are released by parentFork or childFork.
+      */
+      static void prepareFork();
+
+      /** \brief Release the locks taken by prepareFork, in the parent process.
+      */
+      static void parentFork();
+
+      /** \brief Release the locks taken by prepareFork, in the child process, by replacing them with unlocked ones.
+      */
+      static void childFork();
+
+    protected:
+      virtual int_type overflow(int_type c);
+
+      virtual std::streamsize xsputn(const char * s, std::streamsize n);
+
+      virtual int sync();
+
+    private:
+      /** \brief Write all buffered output; the caller holds the lock. Return false on error.
+      */
+      bool writeBuffer();
+
+      /** \brief Buffer or write the given text; the caller holds the lock. Return the number of characters
+                 accepted.
+      */
+      std::streamsize put(const char * s, std::streamsize n);
+
+      /** \brief Write the given pieces completely, retrying after interruptions and partial writes. Return false
+                 on error.
+      */
+      bool writeAll(struct iovec * iov, int num_iov);
+
+      /** \brief Write the complete lines in the buffer, keeping an incomplete last line buffered. If the buffer
+                 holds no complete line, write all of it. The caller holds the lock. Return false on error.
+      */
+      bool writeLines();
+
+      // Recursive, so that the thread preparing a fork, which holds every lock, may still drain each buffer.
+      std::recursive_mutex m_mutex;
+      std::vector<char> m_buf;
+      std::size_t m_size;
+      FdStreamBuf * m_tie;
+      int m_fd;
+      bool m_write_on_flush;
+      bool m_whole_lines;
+      bool m_error;
+  };
+
+  /** \class FdStream
+      \brief Output stream which writes directly to a file descriptor. This may be connected to an OStream
+             like any other std::ostream. See FdStreamBuf for the buffering policy.
+  */
+  class FdStream : public std::ostream {
+    public:
+      /** \brief Create a stream which writes to the given file descriptor.
+          \param fd The file descriptor, e.g. STDOUT_FILENO.
+          \param buffer_size The number of bytes collected before they are written.
+      */
+      explicit FdStream(int fd, std::size_t buffer_size = FdStreamBuf::s_default_buffer_size);
+
+      /** \brief Create a stream which appends whole lines to the given file, creating it if necessary. Several
+                 processes may share the file without interleaving parts of their lines. The file is closed when
+                 the stream is destroyed.
+          \param file_name The name of the file.
+          \param buffer_size The number of bytes collected before they are written.
+      */
+      explicit FdStream(const std::string & file_name, std::size_t buffer_size = FdStreamBuf::s_default_buffer_size);
+
+      virtual ~FdStream();
+
+      /** \brief Return the stream buffer, e.g. to change its flush policy.
+      */
+      FdStreamBuf & getBuf() { return m_buf; }
+
+    private:
+      FdStreamBuf m_buf;
+      bool m_close;
+  };
+
+}
+
+#endif
@@ -0,0 +1,323 @@
+/** \file Format.h
+    \brief Declarations of FormatString and FormatArg classes, which support formatting messages with format strings
+           which are checked at compile time.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_Format_h
+#define st_stream_Format_h
+
+#include <cstddef>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+/** \brief Create a FormatString from a string literal, checking its placeholders at compile time, e.g.:
+
+           os.format(ST_FORMAT("x={:.3f} n={}"), x, n);
+
+           Placeholders have the form {} or {:spec}, where spec is [align][width][.precision][type]:
+           align is one of < > ^, type is one of d x X o (integers), f e E g G (floating point), or s (strings).
+           Literal braces are written {{ and }}. A malformed format string, or a mismatch between the number of
+           placeholders and the number of arguments, is a compile-time error.
+*/
+#define ST_FORMAT(text) st_stream::FormatString<st_stream::CountPlaceholders(text)>(text)
+
+namespace st_stream {
+
+  /** \brief States of the scanner which checks a format string: in plain text, after an opening brace, after a
+             closing brace in plain text, after the colon of a specification, in its width, after its decimal point,
+             in its precision, and after its type.
+  */
+  enum FormatScanState { eFormatText, eFormatOpen, eFormatClose, eFormatColon, eFormatWidth, eFormatPoint,
+    eFormatPrecision, eFormatType };
+
+  /** \brief Return the result of scanning one character of a format string: the number of placeholders it
+             completes times 16, plus the following scanner state, or -1 if the format string is malformed.
+      \param c The character.
+      \param state The scanner state before the character.
+  */
+  constexpr int FormatScanChar(char c, int state) {
+    return eFormatText == state ? ('{' == c ? eFormatOpen : ('}' == c ? eFormatClose : eFormatText)) :
+      eFormatOpen == state ? ('{' == c ? eFormatText : ('}' == c ? 16 + eFormatText : (':' == c ? eFormatColon : -1))) :
+      eFormatClose == state ? ('}' == c ? eFormatText : -1) :
+      eFormatPoint == state ? (('0' <= c && '9' >= c) ? eFormatPrecision : -1) :
+      '}' == c ? 16 + eFormatText :
+      eFormatType == state ? -1 :
+      ('0' <= c && '9' >= c) ? (eFormatPrecision == state ? eFormatPrecision : eFormatWidth) :
+      (eFormatColon == state && ('<' == c || '>' == c || '^' == c)) ? eFormatWidth :
+      ('.' == c && eFormatPrecision != state) ? eFormatPoint :
+      ('d' == c || 'x' == c || 'X' == c || 'o' == c || 'f' == c || 'e' == c || 'E' == c || 'g' == c || 'G' == c ||
+        's' == c) ? eFormatType : -1;
+  }
+
+  constexpr int FormatScan(const char * text, std::size_t begin, std::size_t end, int state);
+
+  /** \brief Combine the result of scanning the first part of a range with that of scanning the rest.
+  */
+  constexpr int FormatScanJoin(int first, int rest) { return 0 > rest ? -1 : first - first % 16 + rest; }
+
+  constexpr int FormatScanRest(const char * text, std::size_t mid, std::size_t end, int first) {
+    return 0 > first ? -1 : FormatScanJoin(first, FormatScan(text, mid, end, first % 16));
+  }
+
+  /** \brief Return the result of scanning a range of a format string (see FormatScanChar). The range is split in
+             half at each step, so that the depth of recursion grows only with the logarithm of its length, and
+             long format strings stay within the compiler's limit for constant expressions.
+      \param text The format string.
+      \param begin The index of the first character of the range.
+      \param end The index following the last character of the range.
+      \param state The scanner state at the start of the range.
+  */
+  constexpr int FormatScan(const char * text, std::size_t begin, std::size_t end, int state) {
+    return begin == end ? state : (begin + 1 == end ? FormatScanChar(text[begin], state) :
+      FormatScanRest(text, begin + (end - begin) / 2, end, FormatScan(text, begin, begin + (end - begin) / 2, state)));
+  }
+
+  constexpr int FormatScanCount(int result) { return 0 > result || eFormatText != result % 16 ? -1 : result / 16; }
+
+  /** \brief Return the number of placeholders in the given format string, or -1 if it is malformed. The text must
+             be a string literal (or other character array) so that its length is known.
+      \param text The format string.
+  */
+  template <std::size_t Size>
+  constexpr int CountPlaceholders(const char (&text)[Size]) {
+    return FormatScanCount(FormatScan(text, 0, Size - 1, eFormatText));
+  }
+
+  /** \class FormatString
+      \brief Format string whose number of placeholders is known at compile time. Normally created with the
+             ST_FORMAT macro rather than directly.
+  */
+  template <int NumPlaceholders>
+  class FormatString {
+    public:
+      static_assert(0 <= NumPlaceholders, "st_stream: malformed format string");
+
+      /** \brief Number of placeholders in the format string.
+      */
+      static const int s_num_placeholders = NumPlaceholders;
+
+      /** \brief Create a format string. The text must be the same as that used to compute NumPlaceholders.
+          \param text The text of the format string.
+      */
+      constexpr explicit FormatString(const char * text): m_text(text) {}
+
+      /** \brief Return the text of the format string.
+      */
+      constexpr const char * c_str() const { return m_text; }
+
+    private:
+      const char * m_text;
+  };
+
+  /** \class TextFormatter
+      \brief Extension point which lets a type render itself directly into a message buffer. By default objects
+             are rendered with their operator << through a std::ostringstream. A specialization in namespace
+             st_stream replaces this with a static format method which appends the text, e.g.:
+
+             namespace st_stream {
+               template <>
+               struct TextFormatter<Energy> {
+                 static void format(std::string & buf, const Energy & energy) {
+                   FormatArg(energy.getKeV()).render(buf, ".3f", 3);
+                   buf += " keV";
+                 }
+               };
+             }
+
+             OStream::write, OStream::format and OStream::defer then render such objects once into a buffer,
+             however many destinations they go to, and objects may be shifted to an OStream with operator <<.
+             Specializations must not define the Unspecialized type.
+  */
+  template <typename T>
+  struct TextFormatter {
+    /// \brief Marks the default; used to detect whether a type has a specialization.
+    typedef void Unspecialized;
+  };
+
+  /** \class HasTextFormatter
+      \brief Trait whose value is true if TextFormatter is specialized for the given type.
+  */
+  template <typename T>
+  class HasTextFormatter {
+    private:
+      template <typename U>
+      static char test(typename TextFormatter<U>::Unspecialized *);
+
+      template <typename U>
+      static long test(...);
+
+    public:
+      static const bool value = sizeof(char) != sizeof(test<T>(0));
+  };
+
+  /** \class FormatArg
+      \brief Type-erased reference to one argument of a formatted message. Arithmetic values are copied;
+             strings and other objects are referred to, so a FormatArg must not outlive its argument.
+  */
+  class FormatArg {
+    public:
+      /** \brief Kinds of argument.
+      */
+      enum Type { eBool, eChar, eSigned, eUnsigned, eFloat, eString, eGeneric };
+
+      FormatArg(bool value): m_type(eBool) { m_value.m_unsigned = value; }
+      FormatArg(char value): m_type(eChar) { m_value.m_signed = value; }
+      FormatArg(signed char value): m_type(eSigned) { m_value.m_signed = value; }
+      FormatArg(signed short value): m_type(eSigned) { m_value.m_signed = value; }
+      FormatArg(signed int value): m_type(eSigned) { m_value.m_signed = value; }
+      FormatArg(signed long value): m_type(eSigned) { m_value.m_signed = value; }
+      FormatArg(signed long long value): m_type(eSigned) { m_value.m_signed = value; }
+      FormatArg(unsigned char value): m_type(eUnsigned) { m_value.m_unsigned = value; }
+      FormatArg(unsigned short value): m_type(eUnsigned) { m_value.m_unsigned = value; }
+      FormatArg(unsigned int value): m_type(eUnsigned) { m_value.m_unsigned = value; }
+      FormatArg(unsigned long value): m_type(eUnsigned) { m_value.m_unsigned = value; }
+      FormatArg(unsigned long long value): m_type(eUnsigned) { m_value.m_unsigned = value; }
+      FormatArg(float value): m_type(eFloat) { m_value.m_float = value; }
+      FormatArg(double value): m_type(eFloat) { m_value.m_float = value; }
+      FormatArg(long double value): m_type(eFloat) { m_value.m_float = value; }
+      FormatArg(const char * value): m_type(eString) {
+        m_value.m_string.m_data = value;
+        m_value.m_string.m_size = length(value);
+      }
+      FormatArg(const std::string & value): m_type(eString) {
+        m_value.m_string.m_data = value.data();
+        m_value.m_string.m_size = value.size();
+      }
+
+      /** \brief Refer to the given characters, which need not be null-terminated.
+          \param data The characters.
+          \param size The number of characters.
+      */
+      FormatArg(const char * data, std::size_t size): m_type(eString) {
+        m_value.m_string.m_data = data;
+        m_value.m_string.m_size = size;
+      }
+
+      /** \brief Refer to an object of any other type, which will be rendered using its TextFormatter if it has
+                 one, or its operator << otherwise.
+          \param value The object.
+      */
+      template <typename T>
+      FormatArg(const T & value): m_type(eGeneric) {
+        m_value.m_generic.m_object = &value;
+        m_value.m_generic.m_render = &renderGeneric<T>;
+      }
+
+      /** \brief Return the kind of argument.
+      */
+      Type getType() const { return m_type; }
+
+      /** \brief Return the characters referred to by a string argument.
+      */
+      const char * getData() const { return m_value.m_string.m_data; }
+
+      /** \brief Return the number of characters referred to by a string argument.
+      */
+      std::size_t getSize() const { return m_value.m_string.m_size; }
+
+      /** \brief Append the argument to the given buffer, according to the given placeholder specification.
+          \param buf The buffer.
+          \param spec The specification, i.e. the text between the opening and closing braces of the placeholder.
+          \param spec_size The number of characters in the specification.
+      */
+      void render(std::string & buf, const char * spec, std::size_t spec_size) const;
+
+      /** \brief Append the text of a format string to the given buffer, replacing its placeholders with the given
+                 arguments.
+          \param buf The buffer.
+          \param text The format string, which must already have been checked.
+          \param arg The arguments.
+          \param num_args The number of arguments.
+      */
+      static void format(std::string & buf, const char * text, const FormatArg * arg, std::size_t num_args);
+
+    private:
+      template <typename T>
+      static void renderGeneric(std::string & buf, const void * object) {
+        renderObject(buf, *static_cast<const T *>(object), std::integral_constant<bool, HasTextFormatter<T>::value>());
+      }
+
+      template <typename T>
+      static void renderObject(std::string & buf, const T & object, std::true_type) {
+        TextFormatter<T>::format(buf, object);
+      }
+
+      template <typename T>
+      static void renderObject(std::string & buf, const T & object, std::false_type) {
+        std::ostringstream oss;
+        oss << object;
+        buf += oss.str();
+      }
+
+      static std::size_t length(const char * value) {
+        std::size_t size = 0;
+        if (0 != value) while ('\0' != value[size]) ++size;
+        return size;
+      }
+
+      Type m_type;
+      union {
+        long long m_signed;
+        unsigned long long m_unsigned;
+        long double m_float;
+        struct {
+          const char * m_data;
+          std::size_t m_size;
+        } m_string;
+        struct {
+          const void * m_object;
+          void (*m_render)(std::string &, const void *);
+        } m_generic;
+      } m_value;
+  };
+
+  /** \class ArrayFormat
+      \brief Layout of numeric arrays written by OStream::writeArray: the separator between elements, and the
+             width, precision and type of every element, with the same meanings as in a placeholder
+             specification, e.g. ArrayFormat().setSeparator(", ").setWidth(10).setPrecision(3).setType('f').
+             By default elements are separated by one space and written as std::ostream would write them.
+  */
+  class ArrayFormat {
+    public:
+      ArrayFormat(): m_separator(" "), m_width(0), m_precision(-1), m_type('\0') {}
+
+      ArrayFormat & setSeparator(const std::string & separator) { m_separator = separator; return *this; }
+      ArrayFormat & setWidth(std::size_t width) { m_width = width; return *this; }
+      ArrayFormat & setPrecision(int precision) { m_precision = precision; return *this; }
+      ArrayFormat & setType(char type) { m_type = type; return *this; }
+
+      const std::string & getSeparator() const { return m_separator; }
+      std::size_t getWidth() const { return m_width; }
+      int getPrecision() const { return m_precision; }
+      char getType() const { return m_type; }
+
+    private:
+      std::string m_separator;
+      std::size_t m_width;
+      int m_precision;
+      char m_type;
+  };
+
+  /** \func FormatArray
+      \brief Append the elements of a numeric array to the given buffer, laid out according to the given format.
+             Integers are converted two digits at a time, and floating point values in fixed format ('f') with
+             up to 15 decimals are converted through integers, falling back to the C library only where that
+             could round differently, so the text is the same as that written by OStream::format.
+      \param buf The buffer.
+      \param data The elements.
+      \param size The number of elements.
+      \param format The layout.
+  */
+  void FormatArray(std::string & buf, const signed int * data, std::size_t size, const ArrayFormat & format);
+  void FormatArray(std::string & buf, const signed long * data, std::size_t size, const ArrayFormat & format);
+  void FormatArray(std::string & buf, const signed long long * data, std::size_t size, const ArrayFormat & format);
+  void FormatArray(std::string & buf, const unsigned int * data, std::size_t size, const ArrayFormat & format);
+  void FormatArray(std::string & buf, const unsigned long * data, std::size_t size, const ArrayFormat & format);
+  void FormatArray(std::string & buf, const unsigned long long * data, std::size_t size, const ArrayFormat & format);
+  void FormatArray(std::string & buf, const float * data, std::size_t size, const ArrayFormat & format);
+  void FormatArray(std::string & buf, const double * data, std::size_t size, const ArrayFormat & format);
+
+}
+
+#endif
@@ -0,0 +1,146 @@
+/** \file GzipStream.h
+    \brief Declaration of GzipStream class, which writes compressed output to a file using a background thread.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_GzipStream_h
+#define st_stream_GzipStream_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace st_stream {
+
+  /** \class GzipStreamBuf
+      \brief Stream buffer which collects output into frames and compresses each frame on a background thread.
+
+             Each frame is written to the file as a complete, independent gzip member, so the file may be read
+             with gunzip/zcat, and a file left behind by a crashed process is readable up to its last complete
+             frame. Frames end at line boundaries whenever possible. Since small frames would defeat the
+             compression, flushing the stream (e.g. with std::endl) ends a frame only if its oldest line has
+             waited s_max_delay. The exception is an error message (see GetMessageType): flushing it ends the frame
+             at once, and waits until it is written, so the lines which explain a crash are not lost with it.
+             Otherwise, frames end when they are full, or when the stream is closed. Before the process forks,
+             every frame is written, so that the child may keep writing to the stream without repeating them.
+  */
+  class GzipStreamBuf : public std::streambuf {
+    public:
+      /** \brief Open the named file for writing compressed output, and start the compression thread.
+          \param file_name The name of the output file.
+          \param append Flag indicating whether to append to an existing file rather than replacing it.
+          \param frame_size The uncompressed size of each frame.
+          \param level The zlib compression level, from 1 (fastest) to 9 (smallest).
+      */
+      GzipStreamBuf(const std::string & file_name, bool append = false, std::size_t frame_size = s_default_frame_size,
+        int level = s_default_level);
+
+      virtual ~GzipStreamBuf();
+
+      /** \brief Compress and write all output so far, wait until it is written, and close the file.
+      */
+      void close();
+
+      /** \brief Default uncompressed size of each frame.
+      */
+      static const std::size_t s_default_frame_size = 1024 * 1024;
+
+      /** \brief Default compression level; low levels are nearly as effective as high ones for repetitive text.
+      */
+      static const int s_default_level = 3;
+
+      /** \brief Longest time a line waits for its frame to fill, provided the stream is flushed after it.
+      */
+      static const std::chrono::milliseconds s_max_delay;
+
+      /** \brief Hand off the current frame of every open buffer, wait until it is written, and take the buffer's
+                 lock, in a handler run before the process forks (see pthread_atfork). The locks are released by
+                 parentFork or childFork.
+      */
+      static void prepareFork();
+
+      /** \brief Release the locks taken by prepareFork, in the parent process.
+      */
+      static void parentFork();
+
+      /** \brief Replace the locks taken by prepareFork with unlocked ones in the child process, and restart the
+                 compression threads there.
+      */
+      static void childFork();
+
+    protected:
+      virtual int_type overflow(int_type c);
+
+      virtual int sync();
+
+    private:
+      /** \brief Hand the given number of bytes from the start of the current frame to the compression thread,
+                 and move any remaining bytes to the start of a new frame.
+          \param size The number of bytes to hand off.
+      */
+      void queueFrame(std::size_t size);
+
+      /** \brief Hand the complete lines in the current frame, or all of it if it holds no newline, to the
+                 compression thread.
+      */
+      void endFrame();
+
+      /** \brief Body of the compression thread.
+      */
+      void run();
+
+      /** \brief Compress one frame as a gzip member, and write it to the file. Return false on error.
+          \param frame The frame to compress.
+          \param compressed Buffer for the compressed data.
+      */
+      bool writeFrame(const std::string & frame, std::vector<unsigned char> & compressed);
+
+      std::vector<char> m_frame;
+      std::deque<std::string> m_queue;
+      std::mutex m_mutex;
+      std::condition_variable m_cond;
+      std::thread m_thread;
+      std::chrono::steady_clock::time_point m_frame_time;
+      unsigned long long m_num_queued;
+      unsigned long long m_num_written;
+      std::FILE * m_file;
+      int m_level;
+      bool m_done;
+      bool m_error;
+  };
+
+  /** \class GzipStream
+      \brief Output stream which writes compressed output to a file. This may be connected to an OStream
+             like any other std::ostream, e.g. stlog.connect(gzip_stream).
+  */
+  class GzipStream : public std::ostream {
+    public:
+      /** \brief Open the named file for writing compressed output.
+          \param file_name The name of the output file.
+          \param append Flag indicating whether to append to an existing file rather than replacing it.
+          \param frame_size The uncompressed size of each frame.
+          \param level The zlib compression level, from 1 (fastest) to 9 (smallest).
+      */
+      GzipStream(const std::string & file_name, bool append = false,
+        std::size_t frame_size = GzipStreamBuf::s_default_frame_size, int level = GzipStreamBuf::s_default_level);
+
+      virtual ~GzipStream();
+
+      /** \brief Compress and write all output so far, wait until it is written, and close the file.
+      */
+      void close();
+
+    private:
+      GzipStreamBuf m_buf;
+  };
+
+}
+
+#endif
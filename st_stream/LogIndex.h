@@ -0,0 +1,248 @@
+/** \file LogIndex.h
+    \brief Declaration of IndexedFileStream class, which writes a log file together with a compact sidecar index,
+           and LogIndex class, which uses the index to read only the parts of a large log which may be of interest.
+    \author James Peachey, HEASARC/GSSC
+
+    The log is written in blocks of whole lines. For each block, the index holds one fixed-size record with the
+    block's offset and size in the log, the range of times at which its lines were written, the types of its
+    messages and a filter of the components (see OStream::setComponent) which wrote them. The index is named after
+    the log, with the suffix ".idx". It begins with the 8 characters "STIDX01\n", followed by one record per
+    block; all numbers are little-endian:
+\verbatim
+    offset      8 bytes   offset of the block in the log
+    size        4 bytes   size of the block in bytes
+    num_lines   4 bytes   number of lines in the block
+    begin_time  8 bytes   time the first line was written, in milliseconds since the Epoch
+    end_time    8 bytes   time the last line was written, in milliseconds since the Epoch
+    type_mask   4 bytes   the types of the messages in the block, a combination of MessageTypeMask values
+    flags       4 bytes   1 if some lines of the block have no component
+    filter     32 bytes   Bloom filter of the components of the block's lines, and of their class names
+\endverbatim
+*/
+#ifndef st_stream_LogIndex_h
+#define st_stream_LogIndex_h
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "st_stream/Stream.h"
+
+namespace st_stream {
+
+  /** \class IndexBlock
+      \brief Description of one block of an indexed log file.
+  */
+  struct IndexBlock {
+    /** \brief Bits of the flags field.
+    */
+    enum Flags { eUntagged = 1 };
+
+    /** \brief Size of one record in the index file.
+    */
+    static const std::size_t s_record_size = 72;
+
+    /** \brief Return whether the block may contain lines from the given component, either a class name or a
+               component such as "Class::method". False positives are possible, false negatives are not.
+        \param component The component.
+    */
+    bool mayContain(const std::string & component) const;
+
+    /** \brief Return whether any line of the block was written in the given period.
+        \param begin_time The start of the period, in milliseconds since the Epoch.
+        \param end_time The end of the period, in milliseconds since the Epoch.
+    */
+    bool overlaps(long long begin_time, long long end_time) const {
+      return m_begin_time <= end_time && begin_time <= m_end_time;
+    }
+
+    unsigned long long m_offset;
+    unsigned long long m_filter[4];
+    long long m_begin_time;
+    long long m_end_time;
+    unsigned int m_size;
+    unsigned int m_num_lines;
+    unsigned int m_type_mask;
+    unsigned int m_flags;
+  };
+
+  /** \func ClassifyLine
+      \brief Return the type of a line of a log, read from the prefix written by StreamFormatter. A line whose prefix
+             names no message type is output.
+      \param line The start of the line.
+      \param size The size of the line.
+  */
+  MessageType ClassifyLine(const char * line, std::size_t size);
+
+  /** \class IndexedFileStreamBuf
+      \brief Stream buffer which writes a log file in blocks of whole lines, and appends a record describing each
+             block to the log's index. The type and component of each line are those of the message which wrote
+             it (see GetMessageType and GetMessageComponent), so that e.g. the frames of a backtrace written to
+             sterr are indexed as errors; only a line written outside any message has its type read from its
+             prefix. Lines which do not come from an OStream with a component have none, and the index
+             conservatively matches their blocks to any component. As with GzipStream, flushing the stream (e.g.
+             with std::endl) ends a block only if its oldest line has waited s_max_delay, or at once if the
+             message is an error (see GetMessageType). Otherwise, blocks end when they are full, or when the
+             stream is closed. Before the process forks, the current block is written, so that the child may keep
+             writing to the stream without repeating it. Each block's offset is read from the log after it is
+             written, so several streams may append to the same log and index.
+  */
+  class IndexedFileStreamBuf : public std::streambuf {
+    public:
+      /** \brief Open the named log file and its index for writing.
+          \param file_name The name of the log file.
+          \param append Flag indicating whether to append to an existing log and index rather than replacing them.
+          \param block_size The size of each block. Lines longer than this get a block of their own.
+      */
+      IndexedFileStreamBuf(const std::string & file_name, bool append = false,
+        std::size_t block_size = s_default_block_size);
+
+      virtual ~IndexedFileStreamBuf();
+
+      /** \brief Write all output so far as a final block, and close the log and its index.
+      */
+      void close();
+
+      /** \brief Default size of each block.
+      */
+      static const std::size_t s_default_block_size = 64 * 1024;
+
+      /** \brief Longest time a line waits for its block to fill, provided the stream is flushed after it.
+      */
+      static const std::chrono::milliseconds s_max_delay;
+
+      /** \brief Write the current block of every open buffer in a handler run before the process forks (see
+                 pthread_atfork). The lock this takes is released by parentFork or childFork.
+      */
+      static void prepareFork();
+
+      /** \brief Release the lock taken by prepareFork, in the parent process.
+      */
+      static void parentFork();
+
+      /** \brief Release the lock taken by prepareFork, in the child process.
+      */
+      static void childFork();
+
+    protected:
+      virtual int_type overflow(int_type c);
+
+      virtual std::streamsize xsputn(const char * s, std::streamsize n);
+
+      virtual int sync();
+
+    private:
+      /** \brief Time, component and message type of a line in the current block. The component is kept as the
+                 hashes of its name and of its class name, both 0 if the line has no component. The type is
+                 eNumMessageTypes if the line was written outside any message.
+      */
+      struct LineMark {
+        std::size_t m_begin;
+        long long m_time;
+        unsigned long long m_hash[2];
+        MessageType m_type;
+      };
+
+      /** \brief Return the mark of a line beginning at the given position in the current block, written now by
+                 the current message.
+          \param begin The position of the start of the line.
+      */
+      LineMark currentMark(std::size_t begin) const;
+
+      /** \brief Note the start of a line at the current position, if the position is the start of a line.
+      */
+      void markLine();
+
+      /** \brief Write the given number of bytes from the start of the current block as a block, index them, and
+                 move any remaining bytes to the start of a new block.
+          \param size The number of bytes to write.
+      */
+      void writeBlock(std::size_t size);
+
+      std::vector<char> m_block;
+      std::vector<LineMark> m_mark;
+      std::chrono::steady_clock::time_point m_block_time;
+      std::FILE * m_file;
+      std::FILE * m_index;
+      std::size_t m_block_size;
+      bool m_error;
+  };
+
+  /** \class IndexedFileStream
+      \brief Output stream which writes a log file with a sidecar index, so that LogIndex and the st_stream_query
+             tool can later read only the blocks of the log holding messages of given types, from given components
+             or written in a given period. This may be connected to an OStream like any other std::ostream, e.g.
+             stlog.connect(indexed_stream).
+  */
+  class IndexedFileStream : public std::ostream {
+    public:
+      /** \brief Open the named log file and its index for writing.
+          \param file_name The name of the log file.
+          \param append Flag indicating whether to append to an existing log and index rather than replacing them.
+          \param block_size The size of each block.
+      */
+      IndexedFileStream(const std::string & file_name, bool append = false,
+        std::size_t block_size = IndexedFileStreamBuf::s_default_block_size);
+
+      virtual ~IndexedFileStream();
+
+      /** \brief Write all output so far as a final block, and close the log and its index.
+      */
+      void close();
+
+    private:
+      IndexedFileStreamBuf m_buf;
+  };
+
+  /** \class LogIndex
+      \brief The index of a log file written by IndexedFileStream, used to select and read the blocks of the log
+             which may hold the messages of interest. Any part of the log after its last indexed block, e.g. when
+             the writer did not close the log, is treated as one more block which matches everything.
+  */
+  class LogIndex {
+    public:
+      /** \brief Read the index of the named log file.
+          \param file_name The name of the log file (not of its index).
+      */
+      explicit LogIndex(const std::string & file_name);
+
+      /** \brief Return all the blocks of the log.
+      */
+      const std::vector<IndexBlock> & getBlocks() const { return m_block; }
+
+      /** \brief Return the blocks which may hold messages of the given types from the given component, written in
+                 the given period.
+          \param type_mask The message types, a combination of MessageTypeMask values.
+          \param component The component, a class name or e.g. "Class::method", or empty for any component.
+          \param begin_time The start of the period, in milliseconds since the Epoch.
+          \param end_time The end of the period, in milliseconds since the Epoch.
+      */
+      std::vector<IndexBlock> select(unsigned int type_mask = eAllMessageTypes, const std::string & component = "",
+        long long begin_time = s_min_time, long long end_time = s_max_time) const;
+
+      /** \brief Read the text of the given block from the log.
+          \param block The block.
+          \param text Receives the text.
+      */
+      void read(const IndexBlock & block, std::string & text) const;
+
+      /** \brief Return the name of the index of the named log file.
+          \param file_name The name of the log file.
+      */
+      static std::string getIndexName(const std::string & file_name);
+
+      static const long long s_min_time = -0x7fffffffffffffffll - 1;
+      static const long long s_max_time = 0x7fffffffffffffffll;
+
+    private:
+      std::string m_file_name;
+      std::vector<IndexBlock> m_block;
+  };
+
+}
+
+#endif
@@ -0,0 +1,54 @@
+/** \file MessageBuffer.h
+    \brief Declaration of MessageBuffer class, which lends out text buffers from a pool belonging to the calling
+           thread, so that rendering messages does not allocate memory once the buffers are large enough.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_MessageBuffer_h
+#define st_stream_MessageBuffer_h
+
+#include <cstddef>
+#include <string>
+
+namespace st_stream {
+
+  /** \class MessageBuffer
+      \brief Scoped loan of an empty buffer from a pool belonging to the calling thread. The buffer is returned
+             to the pool, with its capacity, when the loan ends, so after the first few messages rendering needs
+             no heap allocation. Loans may be nested, e.g. when rendering an argument of a message itself
+             renders a message. Buffers grown beyond s_max_capacity are released instead of being kept.
+  */
+  class MessageBuffer {
+    public:
+      /** \brief Largest capacity a buffer may keep when it is returned to the pool.
+      */
+      static const std::size_t s_max_capacity = 64 * 1024;
+
+      /** \brief Borrow an empty buffer.
+      */
+      MessageBuffer();
+
+      /** \brief Return the buffer to the pool.
+      */
+      ~MessageBuffer();
+
+      /** \brief Return the buffer.
+      */
+      std::string & get() { return *m_buf; }
+
+    private:
+      MessageBuffer(const MessageBuffer &);
+      MessageBuffer & operator =(const MessageBuffer &);
+
+      std::string * m_buf;
+      std::size_t m_capacity;
+  };
+
+  /** \func GetNumBufferAllocations
+      \brief Return the number of times, in all threads, that a pooled buffer had to be created or to grow, each of
+             which allocates memory. This stops increasing once the buffers suffice for the messages being written.
+  */
+  unsigned long long GetNumBufferAllocations();
+
+}
+
+#endif
@@ -0,0 +1,183 @@
+/** \file Metrics.h
+    \brief Declarations of Counter, Gauge and Histogram classes, which aggregate metrics cheaply and report them
+           periodically as a single line on stlog, instead of writing a line for every event.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_Metrics_h
+#define st_stream_Metrics_h
+
+#include <atomic>
+#include <ostream>
+#include <string>
+
+namespace st_stream {
+
+  class StreamFormatter;
+
+  /** \class Metric
+      \brief Base class for metrics. Each metric has a name, and is included in every metrics report while it
+             exists. When a metric is destroyed, its final value is included in the next report.
+  */
+  class Metric {
+    public:
+      virtual ~Metric();
+
+      /** \brief Return the name of the metric.
+      */
+      const std::string & getName() const;
+
+      /** \brief Write a summary of the metric to the given stream. Called by the reporter only.
+          \param os The stream.
+          \param elapsed The time in seconds since the previous report.
+      */
+      virtual void summarize(std::ostream & os, double elapsed) = 0;
+
+    protected:
+      /** \brief Create a metric with the given name.
+          \param name The name.
+      */
+      explicit Metric(const std::string & name);
+
+      /** \brief Create a metric named after the class name of the given formatter, e.g. "ClassName.name".
+          \param os The formatter.
+          \param name The name.
+      */
+      Metric(const StreamFormatter & os, const std::string & name);
+
+      /** \brief Keep the final summary for the next report, and stop reporting this metric. Each derived class
+                 must call this in its destructor, while its own data still exist.
+      */
+      void retire();
+
+    private:
+      Metric(const Metric &);
+      Metric & operator =(const Metric &);
+
+      void registerMetric();
+
+      std::string m_name;
+      bool m_retired;
+  };
+
+  /** \class Counter
+      \brief Metric which counts events. Reports show the count and the rate since the previous report.
+  */
+  class Counter : public Metric {
+    public:
+      explicit Counter(const std::string & name): Metric(name), m_value(0), m_reported(0) {}
+
+      Counter(const StreamFormatter & os, const std::string & name): Metric(os, name), m_value(0), m_reported(0) {}
+
+      virtual ~Counter() { retire(); }
+
+      /** \brief Add to the count.
+          \param n The number of events.
+      */
+      void add(unsigned long long n = 1) { m_value.fetch_add(n, std::memory_order_relaxed); }
+
+      /** \brief Return the count.
+      */
+      unsigned long long get() const { return m_value.load(std::memory_order_relaxed); }
+
+      virtual void summarize(std::ostream & os, double elapsed);
+
+    private:
+      std::atomic<unsigned long long> m_value;
+      unsigned long long m_reported;
+  };
+
+  /** \class Gauge
+      \brief Metric which holds the latest value of some quantity. Reports show the value.
+  */
+  class Gauge : public Metric {
+    public:
+      explicit Gauge(const std::string & name): Metric(name), m_value(0.) {}
+
+      Gauge(const StreamFormatter & os, const std::string & name): Metric(os, name), m_value(0.) {}
+
+      virtual ~Gauge() { retire(); }
+
+      /** \brief Set the value.
+          \param value The value.
+      */
+      void set(double value) { m_value.store(value, std::memory_order_relaxed); }
+
+      /** \brief Return the value.
+      */
+      double get() const { return m_value.load(std::memory_order_relaxed); }
+
+      virtual void summarize(std::ostream & os, double elapsed);
+
+    private:
+      std::atomic<double> m_value;
+  };
+
+  /** \class Histogram
+      \brief Metric which collects the distribution of some quantity. Reports show the number of values, their
+             mean, minimum and maximum, and estimates of the median and 99th percentile, all since the metric
+             was created. Percentiles are estimated from power-of-two buckets, so they are accurate to within a
+             factor of two.
+  */
+  class Histogram : public Metric {
+    public:
+      /** \brief Number of buckets, covering values from 2^-32 to 2^31.
+      */
+      static const int s_num_buckets = 64;
+
+      explicit Histogram(const std::string & name);
+
+      Histogram(const StreamFormatter & os, const std::string & name);
+
+      virtual ~Histogram() { retire(); }
+
+      /** \brief Add a value to the distribution.
+          \param value The value.
+      */
+      void record(double value);
+
+      /** \brief Return the number of values recorded.
+      */
+      unsigned long long getCount() const { return m_count.load(std::memory_order_relaxed); }
+
+      /** \brief Return the mean of the values recorded, or 0 if none were.
+      */
+      double getMean() const;
+
+      /** \brief Return an estimate of the given percentile of the values recorded.
+          \param percent The percentile, from 0 to 100.
+      */
+      double getPercentile(double percent) const;
+
+      virtual void summarize(std::ostream & os, double elapsed);
+
+    private:
+      void init();
+
+      std::atomic<unsigned long long> m_count;
+      std::atomic<double> m_sum;
+      std::atomic<double> m_min;
+      std::atomic<double> m_max;
+      std::atomic<unsigned long long> m_bucket[s_num_buckets];
+  };
+
+  /** \func ReportMetrics
+      \brief Write one line summarizing all metrics to stlog, e.g.:
+             "my_tool: METRICS: Reader.events=120000 (11999.8/s), Reader.queue_depth=3"
+  */
+  void ReportMetrics();
+
+  /** \func StartMetricsReporting
+      \brief Start a background thread which calls ReportMetrics periodically. Metrics are also reported once when
+             the process exits.
+      \param period_ms The interval in milliseconds between reports.
+  */
+  void StartMetricsReporting(unsigned int period_ms = 10000);
+
+  /** \func StopMetricsReporting
+      \brief Stop the background thread started by StartMetricsReporting.
+  */
+  void StopMetricsReporting();
+
+}
+
+#endif
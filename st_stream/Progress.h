@@ -0,0 +1,104 @@
+/** \file Progress.h
+    \brief Declaration of ProgressReporter class, which reports the progress of long-running loops at a limited rate.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_Progress_h
+#define st_stream_Progress_h
+
+#include <chrono>
+#include <string>
+
+namespace st_stream {
+
+  class OStream;
+
+  /** \class ProgressReporter
+      \brief Helper which reports the progress of a loop, showing the count, rate, and if the total is known,
+             the percentage done and estimated time remaining, e.g.:
+
+             "Reading events: 45000/100000 (45.0%) 15000.0/s ETA 0:00:04"
+
+             The loop calls bump() on each iteration, which only increments a counter and compares it to a
+             threshold. The clock is read only when the threshold is reached, and the threshold adapts to the
+             rate of the loop so that the clock is read a few times per reporting period, however fast or slow
+             the iterations are. A report is written at most once per period.
+
+             On a terminal, each report overwrites the previous one in place; otherwise each report is a
+             separate line. A final report is written by finish(), or when the reporter is destroyed. A reporter
+             must be used by only one thread.
+  */
+  class ProgressReporter {
+    public:
+      /** \brief Create a reporter which writes to the given stream. Reports overwrite each other if the stream
+                 is stout, sterr or stlog and the corresponding standard stream is a terminal.
+          \param os The stream.
+          \param label The text at the start of each report.
+          \param total The number of iterations expected, or 0 if unknown.
+          \param period_ms The minimum interval in milliseconds between reports.
+      */
+      ProgressReporter(OStream & os, const std::string & label, unsigned long long total = 0,
+        unsigned int period_ms = 1000);
+
+      /** \brief Write the final report, if finish() was not called.
+      */
+      ~ProgressReporter();
+
+      /** \brief Count iterations, and report if the period has elapsed since the last report.
+          \param n The number of iterations.
+      */
+      void bump(unsigned long long n = 1) {
+        m_count += n;
+        if (m_count >= m_next_check) check();
+      }
+
+      /** \brief Write the final report, ending the line if reports overwrite each other. Later calls have no
+                 effect.
+      */
+      void finish();
+
+      /** \brief Return the number of iterations counted.
+      */
+      unsigned long long getCount() const { return m_count; }
+
+      /** \brief Return the number of reports written.
+      */
+      unsigned long long getNumReports() const { return m_num_reports; }
+
+      /** \brief Return whether reports overwrite each other.
+      */
+      bool getOverwrite() const { return m_overwrite; }
+
+      /** \brief Choose whether reports overwrite each other, instead of the choice made at construction.
+          \param overwrite Whether reports overwrite each other.
+      */
+      void setOverwrite(bool overwrite) { m_overwrite = overwrite; }
+
+    private:
+      typedef std::chrono::steady_clock clock_type;
+
+      ProgressReporter(const ProgressReporter &);
+      ProgressReporter & operator =(const ProgressReporter &);
+
+      void check();
+
+      void report(clock_type::time_point now, bool final);
+
+      OStream & m_os;
+      std::string m_label;
+      clock_type::duration m_period;
+      clock_type::time_point m_start;
+      clock_type::time_point m_last_check;
+      clock_type::time_point m_last_report;
+      unsigned long long m_total;
+      unsigned long long m_count;
+      unsigned long long m_next_check;
+      unsigned long long m_last_check_count;
+      unsigned long long m_num_reports;
+      std::string::size_type m_width;
+      bool m_overwrite;
+      bool m_finished;
+  };
+
+}
+
+#endif
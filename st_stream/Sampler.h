@@ -0,0 +1,81 @@
+/** \file Sampler.h
+    \brief Declaration of Sampler class, used to display only a sample of high-frequency messages.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_Sampler_h
+#define st_stream_Sampler_h
+
+#include <atomic>
+
+namespace st_stream {
+
+  /** \class Sampler
+      \brief Helper which selects a sample of the messages written at one place in the code. A Sampler is normally
+             declared as a function-level static object at the point where messages are written, and passed to
+             StreamFormatter::info, e.g.:
+
+             static st_stream::Sampler s_sampler(1000);
+             m_os.info(4, s_sampler) << prefix << "Event energy was " << energy << std::endl;
+
+             Messages which are selected carry the sampling rate in their prefix. A Sampler may be shared by
+             several threads.
+  */
+  class Sampler {
+    public:
+      /** \brief Method used to select messages.
+      */
+      enum Mode {
+        eEveryNth, //!< Select the first message and every rate-th message after it.
+        eRandom //!< Select each message independently, with probability 1 / rate.
+      };
+
+      /** \brief Create a sampler which selects one in every rate messages.
+          \param rate The number of messages for each one selected. 0 and 1 both select every message.
+          \param mode The method used to select messages.
+      */
+      explicit Sampler(unsigned int rate, Mode mode = eEveryNth): m_num_calls(0),
+        m_rate(0 == rate ? 1 : rate), m_mode(mode) {}
+
+      /** \brief Return whether the current message is selected.
+      */
+      bool sample() {
+        unsigned long long call = m_num_calls.fetch_add(1, std::memory_order_relaxed);
+        if (eEveryNth == m_mode) return 0 == call % m_rate;
+        return 0 == randomNumber() % m_rate;
+      }
+
+      /** \brief Return the number of messages for each one selected.
+      */
+      unsigned int getRate() const { return m_rate; }
+
+      /** \brief Return the method used to select messages.
+      */
+      Mode getMode() const { return m_mode; }
+
+      /** \brief Return the number of messages offered to this sampler so far, whether selected or not.
+      */
+      unsigned long long getNumCalls() const { return m_num_calls.load(std::memory_order_relaxed); }
+
+    private:
+      /** \brief Return the next number from a fast pseudo-random sequence private to the calling thread.
+      */
+      static unsigned long long randomNumber();
+
+      std::atomic<unsigned long long> m_num_calls;
+      unsigned int m_rate;
+      Mode m_mode;
+  };
+
+  inline unsigned long long Sampler::randomNumber() {
+    // xorshift64* generator; the seed is taken from the address of the state, which differs between threads.
+    static thread_local unsigned long long s_state = 0;
+    if (0 == s_state) s_state = reinterpret_cast<unsigned long long>(&s_state) * 0x9e3779b97f4a7c15ULL | 1;
+    s_state ^= s_state >> 12;
+    s_state ^= s_state << 25;
+    s_state ^= s_state >> 27;
+    return (s_state * 0x2545f4914f6cdd1dULL) >> 32;
+  }
+
+}
+
+#endif
@@ -0,0 +1,163 @@
+/** \file ScopeTimer.h
+    \brief Declarations of TimerSite and ScopeTimer classes, which measure and report the time spent in scopes.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_ScopeTimer_h
+#define st_stream_ScopeTimer_h
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+
+#include "st_stream/Stream.h"
+
+namespace st_stream {
+
+  class StreamFormatter;
+
+  /** \class TimerSite
+      \brief Statistics of the times measured at one place in the code: count, total, minimum, maximum and an
+             approximate distribution, from which percentiles are estimated. A TimerSite is normally declared as a
+             function-level static object and passed to ScopeTimer objects, e.g.:
+
+             static st_stream::TimerSite s_site;
+             st_stream::ScopeTimer timer(m_os, s_site);
+
+             All sites are reported together by ReportTimers. A TimerSite may be shared by several threads.
+  */
+  class TimerSite {
+    public:
+      /** \brief Number of buckets in the distribution of times. Each power of two nanoseconds is divided into
+                 s_sub_buckets buckets, so percentiles are estimated to within about 20%.
+      */
+      static const unsigned int s_sub_buckets = 4;
+      static const unsigned int s_num_buckets = 64 * s_sub_buckets;
+
+      /** \brief Create a site with the given name.
+          \param name The name used in reports. If blank, the class and method names of the StreamFormatter used by
+                 the first ScopeTimer at this site are used.
+      */
+      explicit TimerSite(const std::string & name = std::string());
+
+      ~TimerSite();
+
+      /** \brief Add one measured time to the statistics.
+          \param nsec The time in nanoseconds.
+      */
+      void record(unsigned long long nsec);
+
+      /** \brief Return the name used in reports.
+      */
+      std::string getName() const;
+
+      /** \brief Return whether the site has been named, either when it was created or by setDefaultName.
+      */
+      bool hasName() const { return m_has_name.load(std::memory_order_acquire); }
+
+      /** \brief Set the name used in reports, if it is still blank.
+          \param name The name.
+      */
+      void setDefaultName(const std::string & name);
+
+      /** \brief Return the number of times measured.
+      */
+      unsigned long long getCount() const { return m_count.load(std::memory_order_relaxed); }
+
+      /** \brief Return the total of the times measured, in nanoseconds.
+      */
+      unsigned long long getTotal() const { return m_total.load(std::memory_order_relaxed); }
+
+      /** \brief Return the shortest time measured, in nanoseconds, or 0 if none was measured.
+      */
+      unsigned long long getMinimum() const;
+
+      /** \brief Return the longest time measured, in nanoseconds.
+      */
+      unsigned long long getMaximum() const { return m_max.load(std::memory_order_relaxed); }
+
+      /** \brief Return an estimate of the given percentile of the times measured, in nanoseconds.
+          \param percent The percentile, from 0 to 100.
+      */
+      unsigned long long getPercentile(double percent) const;
+
+      /** \brief Discard all measured times.
+      */
+      void reset();
+
+    private:
+      TimerSite(const TimerSite &);
+      TimerSite & operator =(const TimerSite &);
+
+      static unsigned int bucket(unsigned long long nsec);
+
+      static unsigned long long bucketLimit(unsigned int index);
+
+      mutable std::mutex m_name_mutex;
+      std::string m_name;
+      std::atomic<bool> m_has_name;
+      std::atomic<unsigned long long> m_count;
+      std::atomic<unsigned long long> m_total;
+      std::atomic<unsigned long long> m_min;
+      std::atomic<unsigned long long> m_max;
+      std::atomic<unsigned long long> m_bucket[s_num_buckets];
+  };
+
+  /** \class ScopeTimer
+      \brief Timer which measures the time between its construction and destruction with a monotonic clock, and
+             adds it to a TimerSite. Optionally, each time is also reported on the info stream of a StreamFormatter
+             at a given chat level.
+  */
+  class ScopeTimer {
+    public:
+      /** \brief Start timing a scope, adding the result to the given site.
+          \param os The formatter whose class and method names name the site, if the site has no name.
+          \param site The site.
+      */
+      ScopeTimer(StreamFormatter & os, TimerSite & site);
+
+      /** \brief Start timing a scope, adding the result to the given site, and reporting it on the info stream
+                 of the given formatter at the given chat level.
+          \param os The formatter.
+          \param site The site.
+          \param chat_level The chat level at which each time is reported.
+      */
+      ScopeTimer(StreamFormatter & os, TimerSite & site, unsigned int chat_level);
+
+      /** \brief Stop timing, and record (and possibly report) the time.
+      */
+      ~ScopeTimer();
+
+      /** \brief Return the time elapsed so far, in nanoseconds.
+      */
+      unsigned long long elapsed() const;
+
+    private:
+      ScopeTimer(const ScopeTimer &);
+      ScopeTimer & operator =(const ScopeTimer &);
+
+      void nameSite();
+
+      StreamFormatter & m_os;
+      TimerSite & m_site;
+      std::chrono::steady_clock::time_point m_start;
+      unsigned int m_chat_level;
+      bool m_report;
+  };
+
+  /** \func ReportTimers
+      \brief Write a table summarizing every TimerSite which has measured any times: count, total, mean, minimum,
+             estimated median, 90th and 99th percentiles, and maximum. Times are given in microseconds.
+      \param os The stream to which to write the table.
+  */
+  void ReportTimers(OStream & os);
+
+  /** \func SetTimerReportAtExit
+      \brief Set whether ReportTimers writes its table to stlog when the process exits.
+      \param report_at_exit The new setting.
+  */
+  void SetTimerReportAtExit(bool report_at_exit = true);
+
+}
+
+#endif
@@ -0,0 +1,135 @@
+/** \file ShmStream.h
+    \brief Declaration of ShmStream class, which sends complete lines of output to a shared-memory ring buffer.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_ShmStream_h
+#define st_stream_ShmStream_h
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <streambuf>
+#include <string>
+
+namespace st_stream {
+
+  struct ShmRing;
+
+  /** \class ShmStreamBuf
+      \brief Stream buffer which collects characters into lines, and writes each complete line as a single
+             record into a POSIX shared-memory ring buffer.
+
+             The ring consists of fixed-size slots. A writer reserves all the slots needed for a line with a single
+             atomic increment, so any number of writers (threads or processes), each with its own ShmStreamBuf,
+             may share one ring without locks. Lines are never torn or interleaved. If readers fall behind by more
+             than the size of the ring, the oldest records are overwritten; readers detect and skip them.
+  */
+  class ShmStreamBuf : public std::streambuf {
+    public:
+      /** \brief Attach to the named shared-memory ring, creating it if it does not exist.
+          \param name The name of the shared-memory object, e.g. "/my_job_log".
+          \param num_slots The number of slots in the ring if it is created.
+          \param slot_size The size in bytes of each slot if the ring is created.
+      */
+      ShmStreamBuf(const std::string & name, std::size_t num_slots = s_default_num_slots,
+        std::size_t slot_size = s_default_slot_size);
+
+      virtual ~ShmStreamBuf();
+
+      /** \brief Default number of slots in a newly created ring.
+      */
+      static const std::size_t s_default_num_slots = 16384;
+
+      /** \brief Default size of each slot in a newly created ring.
+      */
+      static const std::size_t s_default_slot_size = 256;
+
+    protected:
+      virtual int_type overflow(int_type c);
+
+      virtual std::streamsize xsputn(const char * s, std::streamsize n);
+
+    private:
+      /** \brief Write the current line (which may or may not end in a newline) to the ring.
+      */
+      void commit();
+
+      ShmRing * m_ring;
+      std::string m_line;
+  };
+
+  /** \class ShmStream
+      \brief Output stream which writes to a shared-memory ring buffer. This may be connected to an OStream
+             like any other std::ostream, e.g. stlog.connect(shm_stream). See ShmReader for the reading side.
+  */
+  class ShmStream : public std::ostream {
+    public:
+      /** \brief Attach to the named shared-memory ring, creating it if it does not exist.
+          \param name The name of the shared-memory object, e.g. "/my_job_log".
+          \param num_slots The number of slots in the ring if it is created.
+          \param slot_size The size in bytes of each slot if the ring is created.
+      */
+      ShmStream(const std::string & name, std::size_t num_slots = ShmStreamBuf::s_default_num_slots,
+        std::size_t slot_size = ShmStreamBuf::s_default_slot_size);
+
+      virtual ~ShmStream();
+
+      /** \brief Remove the named shared-memory object. Processes which have it attached may continue to use it.
+          \param name The name of the shared-memory object.
+      */
+      static void remove(const std::string & name);
+
+    private:
+      ShmStreamBuf m_buf;
+  };
+
+  /** \class ShmReader
+      \brief Reader for a shared-memory ring buffer written by one or more ShmStream objects.
+
+             A record reserved by a writer which then died, or was killed, before completing it would otherwise
+             hold up the reader until the ring wrapped around. A record still incomplete after the reader has
+             waited max_wait for it is therefore skipped and counted as lost.
+  */
+  class ShmReader {
+    public:
+      /** \brief Attach read-only to the named shared-memory ring, which must already exist. Reading starts
+                 with the oldest record still present in the ring.
+          \param name The name of the shared-memory object.
+          \param max_wait The longest time to wait for a reserved record to be completed before skipping it.
+      */
+      ShmReader(const std::string & name, std::chrono::milliseconds max_wait = s_default_max_wait);
+
+      ~ShmReader();
+
+      /** \brief Read the next complete line, without its trailing newline. Return true if a line was read,
+                 false if no complete line is available yet.
+          \param line The line read.
+      */
+      bool read(std::string & line);
+
+      /** \brief Return the number of records which were overwritten before this reader could read them, or
+                 skipped because their writers never completed them.
+      */
+      unsigned long long getNumLost() const;
+
+      /** \brief Default longest time to wait for a reserved record to be completed.
+      */
+      static const std::chrono::milliseconds s_default_max_wait;
+
+    private:
+      ShmReader(const ShmReader &);
+      ShmReader & operator =(const ShmReader &);
+
+      ShmRing * m_ring;
+      std::chrono::steady_clock::time_point m_wait_start;
+      std::chrono::milliseconds m_max_wait;
+      unsigned long long m_next;
+      unsigned long long m_wait_record;
+      unsigned long long m_num_lost;
+      std::string m_pending;
+      bool m_in_line;
+  };
+
+}
+
+#endif
@@ -0,0 +1,206 @@
+/** \file SocketStream.h
+    \brief Declaration of SocketStream class, which sends output in batches of complete lines to a local collector
+           process over a Unix-domain datagram socket, and SocketCollector class, which receives them.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_SocketStream_h
+#define st_stream_SocketStream_h
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace st_stream {
+
+  /** \class SocketStreamBuf
+      \brief Stream buffer which sends complete lines to a collector through a Unix-domain datagram socket. Each
+             datagram holds one or more whole lines, except for parts of a line longer than a batch, so lines from
+             several processes never interleave.
+
+             Lines are collected into a batch, which is sent when it is full, by drain(), and when the buffer is
+             destroyed. A batch is also sent once its oldest line has waited s_max_delay: by a flush after that
+             time, or else by a background thread shared by all buffers, which also retries spilled lines. Flushing
+             an error message (see GetMessageType) sends its lines at once. Sending never blocks: if the collector
+             is not running or cannot keep up, batches are kept in a spill buffer and sent first once it can
+             receive them again. Whole lines which do not fit in the spill buffer are dropped and counted.
+
+             Since the background thread sends batches, all output passes through overflow() or xsputn(), which
+             take the buffer's lock.
+  */
+  class SocketStreamBuf : public std::streambuf {
+    public:
+      /** \brief Create a buffer which sends to the collector bound to the given socket path. The collector need
+                 not be running yet.
+          \param socket_path The path of the collector's socket.
+          \param batch_size The largest number of bytes sent in one datagram, at most 64 KiB; a line longer than this
+                 is split.
+          \param max_spill The largest number of bytes kept while the collector cannot receive them.
+      */
+      explicit SocketStreamBuf(const std::string & socket_path, std::size_t batch_size = s_default_batch_size,
+        std::size_t max_spill = s_default_max_spill);
+
+      virtual ~SocketStreamBuf();
+
+      /** \brief Send all complete lines now, together with any spilled lines. Return false if some lines are still
+                 waiting in the spill buffer.
+      */
+      bool drain();
+
+      /** \brief Return the number of lines dropped because the spill buffer was full.
+      */
+      unsigned long long getNumDropped() const;
+
+      /** \brief Return the number of bytes waiting in the spill buffer.
+      */
+      std::size_t getSpillSize() const;
+
+      /** \brief Default largest number of bytes sent in one datagram.
+      */
+      static const std::size_t s_default_batch_size = 16 * 1024;
+
+      /** \brief Default largest number of bytes kept while the collector cannot receive them.
+      */
+      static const std::size_t s_default_max_spill = 1024 * 1024;
+
+      /** \brief Longest time a complete line waits for its batch to fill.
+      */
+      static const std::chrono::milliseconds s_max_delay;
+
+      /** \brief Take the lock of the background thread and of every buffer, and send the complete lines of each
+                 buffer, in a handler run before the process forks (see pthread_atfork). The locks are released by
+                 parentFork or childFork.
+      */
+      static void prepareFork();
+
+      /** \brief Release the locks taken by prepareFork, in the parent process.
+      */
+      static void parentFork();
+
+      /** \brief Replace the locks taken by prepareFork with unlocked ones in the child process, and restart the
+                 background thread there.
+      */
+      static void childFork();
+
+    protected:
+      virtual int_type overflow(int_type c);
+
+      virtual std::streamsize xsputn(const char * s, std::streamsize n);
+
+      virtual int sync();
+
+    private:
+      /** \brief Body of the background thread, which sends the batches which have waited too long.
+      */
+      static void runFlusher();
+
+      /** \brief Collect the given text, sending batches as they fill; the caller holds the lock.
+          \param s The text.
+          \param n The number of bytes of text.
+      */
+      void put(const char * s, std::size_t n);
+
+      /** \brief Send all complete lines, together with any spilled lines; the caller holds the lock.
+      */
+      void sendLines();
+
+      /** \brief Send the complete lines if the oldest has waited s_max_delay, otherwise only retry spilled lines;
+                 the caller holds the lock.
+      */
+      void sendStale();
+
+      /** \brief Send the first size bytes of the batch, and keep the rest.
+          \param size The number of bytes to send.
+      */
+      void sendBatch(std::size_t size);
+
+      /** \brief Send as much of the spill buffer as the collector will take. Return true if all of it was sent.
+      */
+      bool sendSpill();
+
+      /** \brief Send one datagram without blocking. Return false if the collector did not take it.
+          \param s The text to send.
+          \param n The number of bytes to send.
+      */
+      bool sendDatagram(const char * s, std::size_t n);
+
+      /** \brief Keep as many whole lines of the given text in the spill buffer as fit, and count the rest.
+          \param s The text to keep.
+          \param n The number of bytes of text.
+      */
+      void spill(const char * s, std::size_t n);
+
+      mutable std::mutex m_mutex;
+      std::vector<char> m_buf;
+      std::string m_spill;
+      std::string m_socket_path;
+      std::chrono::steady_clock::time_point m_batch_time;
+      unsigned long long m_num_dropped;
+      std::size_t m_size;
+      std::size_t m_max_spill;
+      int m_fd;
+      bool m_connected;
+  };
+
+  /** \class SocketStream
+      \brief Output stream which sends output to a local collector process (see SocketStreamBuf). This may be
+             connected to an OStream like any other std::ostream, e.g. stlog.connect(socket_stream), so that several
+             tools on one node write to one log through the collector rather than each to its own files.
+  */
+  class SocketStream : public std::ostream {
+    public:
+      /** \brief Create a stream which sends to the collector bound to the given socket path.
+          \param socket_path The path of the collector's socket.
+          \param batch_size The largest number of bytes sent in one datagram.
+          \param max_spill The largest number of bytes kept while the collector cannot receive them.
+      */
+      explicit SocketStream(const std::string & socket_path,
+        std::size_t batch_size = SocketStreamBuf::s_default_batch_size,
+        std::size_t max_spill = SocketStreamBuf::s_default_max_spill);
+
+      virtual ~SocketStream();
+
+      /** \brief Return the underlying stream buffer.
+      */
+      SocketStreamBuf & getBuf() { return m_buf; }
+
+    private:
+      SocketStreamBuf m_buf;
+  };
+
+  /** \class SocketCollector
+      \brief Receiver of the batches sent by SocketStream objects. The st_stream_collect utility uses this to write
+             them to a file.
+  */
+  class SocketCollector {
+    public:
+      /** \brief Bind a socket to the given path, replacing any socket left there by an earlier collector.
+          \param socket_path The path of the socket.
+      */
+      explicit SocketCollector(const std::string & socket_path);
+
+      /** \brief Close the socket and remove its path.
+      */
+      ~SocketCollector();
+
+      /** \brief Wait for the next batch of lines. Return true if one was received, false if none arrived in time.
+          \param batch The lines received.
+          \param timeout The longest time to wait, in milliseconds, or -1 to wait indefinitely.
+      */
+      bool receive(std::string & batch, int timeout);
+
+    private:
+      SocketCollector(const SocketCollector &);
+      SocketCollector & operator =(const SocketCollector &);
+
+      std::vector<char> m_buf;
+      std::string m_socket_path;
+      int m_fd;
+  };
+
+}
+
+#endif
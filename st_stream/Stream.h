@@ -5,44 +5,217 @@
 #ifndef st_stream_Stream_h
 #define st_stream_Stream_h
 
+#include <atomic>
 #include <iostream>
-#include <set>
+#include <limits>
+#include <map>
 #include <string>
+#include <type_traits>
+#include <vector>
+
+#include "st_stream/Format.h"
+#include "st_stream/MessageBuffer.h"
+#include "st_stream/Trace.h"
 
 namespace st_stream {
 
+  class DeferredLog;
+
+  /** \brief Types of message. Each message has the type of the OStream to which it was first written, which
+             destination filters use to select messages (see SinkFilter).
+  */
+  enum MessageType { eDebug, eError, eInfo, eOutput, eWarning, eNumMessageTypes };
+
+  /** \brief Masks used to select sets of message types.
+  */
+  enum MessageTypeMask {
+    eDebugMask = 1 << eDebug,
+    eErrorMask = 1 << eError,
+    eInfoMask = 1 << eInfo,
+    eOutputMask = 1 << eOutput,
+    eWarningMask = 1 << eWarning,
+    eAllMessageTypes = (1 << eNumMessageTypes) - 1
+  };
+
+  /** \brief Options for the initialization of the global streams sterr, stlog and stout (see InitStdStreams).
+             eDirectOutput connects the global streams to FdStream objects which write to the standard output
+             and error file descriptors directly, instead of to std::cout, std::cerr and std::clog. Standard
+             output is then written in large blocks unless it is a terminal, and standard error at every flush,
+             after any pending standard output. Both are written in whole lines (see FdStreamBuf), so processes
+             sharing them do not split each other's lines. eCaptureStdStreams implies eDirectOutput, and also redirects
+             std::cout, std::cerr and std::clog into the global streams, so that output written to the standard
+             streams by other libraries takes the same path as the program's own.
+  */
+  enum StdStreamOption { eCaptureStdStreams = 1 << 0, eDirectOutput = 1 << 1 };
+
+  /** \class SinkFilter
+      \brief Selects which messages an OStream forwards to one of its destinations, by message type and chatter
+             level. For example, to send only errors and warnings to the terminal, but everything to a log file:
+
+             stout.connect(std::cout, SinkFilter(eErrorMask | eWarningMask));
+             stout.connect(log_file);
+  */
+  class SinkFilter {
+    public:
+      /** \brief Create a filter which accepts messages of the given types up to the given chatter level. The
+                 default filter accepts all messages.
+          \param type_mask The message types accepted, a combination of MessageTypeMask values.
+          \param max_chat The highest message chatter level accepted.
+      */
+      explicit SinkFilter(unsigned int type_mask = eAllMessageTypes,
+        unsigned int max_chat = std::numeric_limits<unsigned int>::max()):
+        m_type_mask(type_mask), m_max_chat(max_chat) {}
+
+      /** \brief Return whether a message of the given type and chatter level is accepted.
+          \param type The message type.
+          \param chat_level The message chatter level.
+      */
+      bool accepts(MessageType type, unsigned int chat_level) const { return chat_level < getLimit(type); }
+
+      /** \brief Return one more than the highest chatter level accepted for the given message type, or 0 if
+                 messages of that type are not accepted at all.
+          \param type The message type.
+      */
+      unsigned long long getLimit(MessageType type) const {
+        return 0 != (m_type_mask & (1U << type)) ? m_max_chat + 1ULL : 0ULL;
+      }
+
+      /** \brief Return the message types accepted, a combination of MessageTypeMask values.
+      */
+      unsigned int getTypeMask() const { return m_type_mask; }
+
+      /** \brief Return the highest message chatter level accepted.
+      */
+      unsigned int getMaxChat() const { return m_max_chat; }
+
+    private:
+      unsigned int m_type_mask;
+      unsigned int m_max_chat;
+  };
+
   /** \class OStream
       \brief Output stream class which connects its output to one or more std::ostreams, and/or to
              one or more other OStreams.
   */
   class OStream {
     public:
-      /** \brief Type of container of std::ostreams. */
-      typedef std::set<std::ostream *> StdStreamCont_t;
+      /** \brief Type of container of std::ostreams, with the filter for each. */
+      typedef std::map<std::ostream *, SinkFilter> StdStreamCont_t;
 
-      /** \brief Type of container of OStreams. */
-      typedef std::set<OStream *> OStreamCont_t;
+      /** \brief Type of container of OStreams, with the filter for each. */
+      typedef std::map<OStream *, SinkFilter> OStreamCont_t;
 
       /** \brief Perform initializations of globally accessible streams sterr, stlog and stout.
+          \param options Bitwise or of StdStreamOption values.
       */
-      static void initStdStreams();
+      static void initStdStreams(unsigned int options = 0);
 
-      /** \brief Create an OStream with the given client maximum chatter.
+      /** \brief Create an OStream with the given client maximum chatter. The stream has no destinations and
+                 allocates nothing until it is first connected or given a prefix, so a stream with static storage
+                 duration, such as sterr, is constant-initialized and may be used before its own translation unit
+                 is initialized; output to it is then discarded.
           \param use_chatter Determines whether or not chatter is respected by the stream.
       */
-      OStream(bool use_chatter);
+      constexpr OStream(bool use_chatter): m_sinks(0), m_deferred_prefix(0),
+        m_topology_generation(std::numeric_limits<unsigned long>::max()), m_accept_limit{ {0}, {0}, {0}, {0}, {0} },
+        m_config_generation(0), m_chat_level(0), m_message_type(eOutput), m_enabled(true), m_use_chatter(use_chatter),
+        m_in_message(false), m_deferred(false) {}
+
+      /** \brief Create a copy of the given stream, with the same destinations, prefix and chatter.
+          \param os The stream to copy.
+      */
+      OStream(const OStream & os);
+
+      /** \brief Destruct the stream, first forwarding any deferred output written to it (see defer).
+      */
+      ~OStream();
+
+      /** \brief Make this stream a copy of the given stream, with the same destinations, prefix and chatter.
+          \param os The stream to copy.
+      */
+      OStream & operator =(const OStream & os);
 
       /** \brief Write this stream's prefix, (respecting chatter, if enabled) and return the stream.
       */
       OStream & prefix();
 
       /** \brief Shift the given object to the destination stream(s), but only if the current
-                 message chatter level is less than or equal to the maximum chatter level.
+                 message chatter level is less than or equal to the maximum chatter level. Objects whose type
+                 has a TextFormatter are rendered once, and the text written to all destinations.
           \param t The object to shift.
       */
       template <typename T>
       OStream & write(const T & t);
 
+      /** \brief Write the given characters to the destination stream(s) without any formatting, as
+                 std::ostream::write does, but only if the current message chatter level is less than or
+                 equal to the maximum chatter level.
+          \param s The characters to write.
+          \param n The number of characters to write.
+      */
+      OStream & write(const char * s, std::streamsize n);
+
+      /** \brief Format the given arguments according to the given format string, and write the result to the
+                 destination stream(s) with a single unformatted write, but only if the current message chatter
+                 level is less than or equal to the maximum chatter level. The format state of the destination
+                 streams (precision, width, flags, etc.) is neither used nor changed. Format strings are normally
+                 created with the ST_FORMAT macro, which checks them at compile time, e.g.:
+
+                 os.prefix().format(ST_FORMAT("x={:.3f} n={}"), x, n) << std::endl;
+          \param fmt The format string.
+          \param args The arguments; their number must match the number of placeholders in the format string.
+      */
+      template <int NumPlaceholders, typename... Args>
+      OStream & format(const FormatString<NumPlaceholders> & fmt, const Args &... args);
+
+      /** \brief Format the elements of a numeric array according to the given layout, and write the result to the
+                 destination stream(s) with a single unformatted write, but only if the current message chatter
+                 level is less than or equal to the maximum chatter level. As with format, the format state of the
+                 destination streams is neither used nor changed, e.g.:
+
+                 os.writeArray(spectrum, num_channels, ArrayFormat().setWidth(12).setPrecision(4).setType('f'));
+          \param data The elements, of type int, long, long long, their unsigned counterparts, float or double.
+          \param size The number of elements.
+          \param format The layout of the elements.
+      */
+      template <typename T>
+      OStream & writeArray(const T * data, std::size_t size, const ArrayFormat & format = ArrayFormat());
+
+      /** \brief Format and write all elements of a built-in array, as writeArray(data, N, format) does.
+          \param data The array.
+          \param format The layout of the elements.
+      */
+      template <typename T, std::size_t N>
+      OStream & writeArray(const T (& data)[N], const ArrayFormat & format = ArrayFormat()) {
+        return writeArray(data + 0, N, format);
+      }
+
+      /** \brief Format and write all elements of a container with contiguous storage, such as std::vector or
+                 std::array, as writeArray(data.data(), data.size(), format) does.
+          \param data The container.
+          \param format The layout of the elements.
+      */
+      template <typename Container>
+      OStream & writeArray(const Container & data, const ArrayFormat & format = ArrayFormat()) {
+        return writeArray(data.data(), data.size(), format);
+      }
+
+      /** \brief Write a complete line, consisting of this stream's prefix followed by the given arguments formatted
+                 according to the given format string, but only if the current message chatter level is less than
+                 or equal to the maximum chatter level. The result is the same as that of
+
+                 os.prefix().format(fmt, args...) << std::endl;
+
+                 except that the calling thread only copies the arguments, and the formatting and output are done
+                 later by a background thread (see Deferred.h). Strings, including the format string, are copied,
+                 so they need not outlive the call. Arguments of other than arithmetic and string types are rendered
+                 immediately.
+          \param fmt The format string, normally created with the ST_FORMAT macro.
+          \param args The arguments; their number must match the number of placeholders in the format string.
+      */
+      template <int NumPlaceholders, typename... Args>
+      OStream & defer(const FormatString<NumPlaceholders> & fmt, const Args &... args);
+
       /** \brief Pass the given stream modifier to the destination stream(s), but only if the current
                  message chatter level is less than or equal to the maximum chatter level.
           \param func The stream modifier.
@@ -71,7 +244,9 @@ namespace st_stream {
                  effect on the maximum chatter level currently selected by the user/client.
 
                  If the message chatter level is greater than the maximum client chatter level, future
-                 output will not be sent to any of this stream's destinations.
+                 output will not be sent to any of this stream's destinations. Changes to the maximum chatter or debug
+                 mode made on another thread take effect at the start of the next message, that is after the next
+                 prefix, std::endl or std::flush, so that a message is never cut short or started part way through.
           \param chat_level The new chatter level for messages to be written to the output stream.
       */
       OStream & setChatLevel(unsigned int chat_level);
@@ -83,7 +258,28 @@ namespace st_stream {
       /** \brief Set the prefix string which precedes each new line of output on this stream.
           \param prefix The new prefix to use.
       */
-      void setPrefix(const std::string prefix);
+      void setPrefix(const std::string & prefix);
+
+      /** \brief Return the name of the component which writes to this stream (see setComponent).
+      */
+      const std::string & getComponent() const;
+
+      /** \brief Set the name of the component which writes to this stream, e.g. "Class::method". While this
+                 stream writes a message, destinations may find out where it came from with GetMessageComponent.
+                 StreamFormatter sets this for its streams. By default it is empty.
+          \param component The name of the component.
+      */
+      void setComponent(const std::string & component);
+
+      /** \brief Return the type of messages written to this stream.
+      */
+      MessageType getMessageType() const;
+
+      /** \brief Set the type of messages written to this stream. Messages keep this type when they are forwarded
+                 through other OStreams. The default type is eOutput.
+          \param type The new message type.
+      */
+      void setMessageType(MessageType type);
 
       /** \brief Connect a destination stream to the output of this stream. Output from this stream will
                  be forwarded to the destination.
@@ -91,6 +287,16 @@ namespace st_stream {
       */
       void connect(std::ostream & dest);
 
+      /** \brief Connect a destination stream to the output of this stream, forwarding only the messages accepted
+                 by the given filter. If the destination is already connected, only its filter is changed.
+
+                 Messages which no destination accepts are discarded before any formatting is done. Format state
+                 changed by methods such as precision and flags is applied to all destinations regardless of filters.
+          \param dest The destination stream being connected.
+          \param filter The filter selecting the messages forwarded to the destination.
+      */
+      void connect(std::ostream & dest, const SinkFilter & filter);
+
       /** \brief Disconnect a destination stream to the output of this stream. Output from this stream will
                  no longer be forwarded to the destination.
           \param dest The destination stream being disconnected.
@@ -103,12 +309,24 @@ namespace st_stream {
       */
       void connect(OStream & dest);
 
+      /** \brief Connect a destination stream to the output of this stream, forwarding only the messages accepted
+                 by the given filter. If the destination is already connected, only its filter is changed.
+          \param dest The destination stream being connected.
+          \param filter The filter selecting the messages forwarded to the destination.
+      */
+      void connect(OStream & dest, const SinkFilter & filter);
+
       /** \brief Disconnect a destination stream to the output of this stream. Output from this stream will
                  no longer be forwarded to the destination.
           \param dest The destination stream being disconnected.
       */
       void disconnect(OStream & dest);
 
+      /** \brief Flush all destinations of this stream, directly or through other streams, regardless of chatter
+                 and filters.
+      */
+      OStream & flush();
+
       /** \brief Return current setting of stream format flags. See std::ios_base documentation for more details.
       */
       std::ios_base::fmtflags flags() const;
@@ -185,7 +403,95 @@ namespace st_stream {
       // Enable/disable the stream. When enabled, equivalent to chatter > maximum chatter for that stream.
       void enable(bool enable_state = true) { m_enabled = enable_state; }
 
+      /** \brief Note that a global setting which affects existing streams (e.g. the maximum chatter) has changed.
+                 Each stream which uses chatter re-evaluates its message chatter level the next time it is used.
+      */
+      static void configChanged() { s_config_generation.fetch_add(1, std::memory_order_relaxed); }
+
+      /** \brief Return a number which changes whenever configChanged is called. This is cheap enough to be
+                 checked for every message.
+      */
+      static unsigned long getConfigGeneration() { return s_config_generation.load(std::memory_order_relaxed); }
+
     private:
+      friend class DeferredLog;
+      friend void FlushThreadStages();
+
+      /** \brief Queue a deferred line for the background thread. Implemented in Deferred.cxx.
+          \param text The format string.
+          \param arg The arguments.
+          \param num_args The number of arguments.
+      */
+      void deferFormat(const char * text, const FormatArg * arg, std::size_t num_args);
+
+      /** \brief Shift the given object to each destination which accepts a message of the given type and chatter
+                 level, without checking whether this stream itself is enabled.
+          \param t The object to shift.
+          \param type The message type.
+          \param chat_level The message chatter level.
+      */
+      template <typename T>
+      void forward(const T & t, MessageType type, unsigned int chat_level);
+
+      /** \brief Shift the given object to each destination which accepts the current message.
+          \param t The object to shift.
+      */
+      template <typename T>
+      void forwardValue(const T & t, std::false_type) { forward(t, m_message_type, m_chat_level); }
+
+      /** \brief Render the given object with its TextFormatter, and write the text to each destination which
+                 accepts the current message.
+          \param t The object to render.
+      */
+      template <typename T>
+      void forwardValue(const T & t, std::true_type) {
+        MessageBuffer buf;
+        TextFormatter<T>::format(buf.get(), t);
+        forward(buf.get().data(), buf.get().size(), m_message_type, m_chat_level);
+      }
+
+      /** \brief Write the given characters to each destination which accepts a message of the given type and
+                 chatter level, without checking whether this stream itself is enabled. Deferred output uses
+                 this, since the chatter level of the stream belongs to the thread which deferred the output.
+          \param s The characters to write.
+          \param n The number of characters to write.
+          \param type The message type.
+          \param chat_level The message chatter level.
+      */
+      void forward(const char * s, std::streamsize n, MessageType type, unsigned int chat_level);
+
+      /** \brief Flush all destinations, regardless of this stream's chatter level.
+      */
+      void forwardFlush();
+
+      /** \brief Return whether output to this stream is currently forwarded to its destinations, first
+                 re-evaluating the message chatter level if global settings changed since it was last set.
+      */
+      bool isEnabled();
+
+      /** \brief Return whether the current message is to be forwarded at all, that is whether this stream is
+                 enabled and at least one destination, directly or through other OStreams, accepts it.
+      */
+      bool isAccepted();
+
+      /** \brief Note that the current message has ended, so the next one re-evaluates the chatter.
+      */
+      void endMessage();
+
+      /** \brief Recompute which messages any destination accepts, after destinations changed anywhere.
+      */
+      void updateAcceptLimit();
+
+      /** \brief For each message type, raise the given limit to one more than the highest chatter level accepted
+                 by any destination of this stream, directly or through other OStreams.
+          \param limit The limits, one per message type.
+      */
+      void computeAcceptLimit(unsigned long long * limit) const;
+
+      /** \brief Note that destinations or filters of some stream changed.
+      */
+      static void topologyChanged() { s_topology_generation.fetch_add(1, std::memory_order_release); }
+
       /** \brief Utility method to assist with the family of methods which get stream formatting information,
                  e.g. precision() const, flags() const, etc.
 
@@ -214,12 +520,83 @@ namespace st_stream {
       template <typename T, typename Stream_t>
       T setStreamState(T (Stream_t::*stdMethod)(T), T (OStream::*method)(T), T (OStream::*getMethod)() const, T arg);
 
-      StdStreamCont_t m_std_stream_cont;
-      OStreamCont_t m_stream_cont;
-      std::string m_prefix;
+      /** \brief Destinations and prefix of a stream, allocated when first set.
+      */
+      struct Sinks {
+        StdStreamCont_t m_std_stream_cont;
+        OStreamCont_t m_stream_cont;
+        std::string m_prefix;
+        std::string m_component;
+      };
+
+      /** \brief Makes the type, chat level and component of a stream those of the message being written by the
+                 calling thread, for the lifetime of this object, unless the message already has them. A stream
+                 without a component leaves the component unset.
+      */
+      class MessageScope {
+        public:
+          MessageScope(const Sinks & sinks, MessageType type, unsigned int chat_level);
+
+          /** \brief Restore the type, chat level and component of a message written earlier, e.g. by a thread
+                     stage which forwards it later.
+          */
+          MessageScope(const std::string * component, MessageType type, unsigned int chat_level);
+
+          ~MessageScope();
+
+        private:
+          const std::string * m_previous;
+          bool m_set_component;
+          bool m_set_type;
+      };
+
+      /** \brief Holds the SinkLock (see st_stream.h) for the lifetime of this object if any std::ostream
+                 destination of a stream also receives deferred output, which the background thread writes while
+                 holding that lock (see Deferred.h). Otherwise it does nothing.
+      */
+      class DeferredSinkLock {
+        public:
+          explicit DeferredSinkLock(const Sinks & sinks);
+          ~DeferredSinkLock();
+
+        private:
+          bool m_locked;
+      };
+
+      typedef std::vector<const std::ostream *> DeferredSinkCont_t;
+
+      /** \brief Add the std::ostream destinations reached through this stream to those which receive deferred
+                 output, so that output written to them directly is serialized with the background thread. This
+                 must be called while holding a SinkLock.
+      */
+      void shareDeferredSinks();
+
+      /** \brief Add the std::ostream destinations reached through this stream, directly or through other OStreams,
+                 to the given container.
+          \param sinks The container.
+      */
+      void collectSinks(DeferredSinkCont_t & sinks) const;
+
+      /** \brief Return the destinations and prefix of this stream, creating them if necessary.
+      */
+      Sinks & getSinks();
+
+      Sinks * m_sinks;
+      std::atomic<const std::string *> m_deferred_prefix;
+      std::atomic<unsigned long> m_topology_generation;
+      std::atomic<unsigned long long> m_accept_limit[eNumMessageTypes];
+      static_assert(5 == eNumMessageTypes, "OStream constructor must initialize one accept limit per message type");
+      unsigned long m_config_generation;
       unsigned int m_chat_level;
+      MessageType m_message_type;
       bool m_enabled;
       bool m_use_chatter;
+      bool m_in_message;
+      std::atomic<bool> m_deferred;
+
+      static std::atomic<unsigned long> s_config_generation;
+      static std::atomic<const DeferredSinkCont_t *> s_deferred_sinks;
+      static std::atomic<unsigned long> s_topology_generation;
   };
 
   /** \class Chat
@@ -253,76 +630,139 @@ namespace st_stream {
   */
   inline OStream & operator <<(OStream & os, const Chat & chat) { return chat(os); }
 
+  /** \brief Shift an object whose type has a TextFormatter to the given stream.
+      \param os The stream.
+      \param t The object.
+  */
   template <typename T>
-  inline OStream & OStream::write(const T & t) {
-    // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter.
-    if (m_enabled) {
-      // Iterate over std::ostreams, shifting object to each in turn.
-      for (StdStreamCont_t::iterator itor = m_std_stream_cont.begin(); itor != m_std_stream_cont.end(); ++itor) {
-        *(*itor) << t;
-      }
-      // Iterate over OStreams, shifting object to each in turn.
-      for (OStreamCont_t::iterator itor = m_stream_cont.begin(); itor != m_stream_cont.end(); ++itor) {
-        *(*itor) << t;
+  inline typename std::enable_if<HasTextFormatter<T>::value, OStream &>::type operator <<(OStream & os, const T & t) {
+    return os.write(t);
+  }
+
+  inline bool OStream::isEnabled() {
+    if (m_use_chatter && m_config_generation != getConfigGeneration()) setChatLevel(m_chat_level);
+    return m_enabled;
+  }
+
+  inline bool OStream::isAccepted() {
+    // Decide once per message whether chatter allows it, so that a concurrent change does not split the message.
+    bool accepted = m_in_message ? m_enabled : isEnabled();
+    if (m_use_chatter) m_in_message = true;
+    if (accepted) {
+      if (m_topology_generation.load(std::memory_order_acquire) !=
+        s_topology_generation.load(std::memory_order_relaxed))
+        updateAcceptLimit();
+      accepted = m_chat_level < m_accept_limit[m_message_type].load(std::memory_order_relaxed);
+    }
+    if (!accepted) ST_STREAM_TRACE2(suppressed, int(m_message_type), m_chat_level);
+    return accepted;
+  }
+
+  inline void OStream::endMessage() {
+    // Only streams which respect chatter use the flag, so the shared global streams are not written.
+    if (m_in_message) m_in_message = false;
+  }
+
+  template <typename T>
+  inline void OStream::forward(const T & t, MessageType type, unsigned int chat_level) {
+    if (0 == m_sinks) return;
+    MessageScope scope(*m_sinks, type, chat_level);
+    DeferredSinkLock lock(*m_sinks);
+    // Iterate over std::ostreams, shifting object to each which accepts the message.
+    for (StdStreamCont_t::iterator itor = m_sinks->m_std_stream_cont.begin(); itor != m_sinks->m_std_stream_cont.end();
+      ++itor) {
+      if (itor->second.accepts(type, chat_level)) {
+        ST_STREAM_TRACE3(sink_write, int(type), chat_level, -1);
+        *itor->first << t;
       }
     }
+    // Iterate over OStreams, forwarding object to each which accepts the message and is itself enabled.
+    for (OStreamCont_t::iterator itor = m_sinks->m_stream_cont.begin(); itor != m_sinks->m_stream_cont.end(); ++itor) {
+      if (itor->second.accepts(type, chat_level) && itor->first->isEnabled()) itor->first->forward(t, type, chat_level);
+    }
+  }
+
+  template <typename T>
+  inline OStream & OStream::write(const T & t) {
+    // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter,
+    // and some destination accepts the message.
+    if (isAccepted()) forwardValue(t, std::integral_constant<bool, HasTextFormatter<T>::value>());
     return *this;
   }
 
-  inline OStream & OStream::operator <<(std::ostream & (*func)(std::ostream &)) {
-    // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter.
-    if (m_enabled) {
-      // Iterate over std::ostreams, shifting object to each in turn.
-      for (StdStreamCont_t::iterator itor = m_std_stream_cont.begin(); itor != m_std_stream_cont.end(); ++itor) {
-        *(*itor) << func;
-      }
-      // Iterate over OStreams, shifting object to each in turn.
-      for (OStreamCont_t::iterator itor = m_stream_cont.begin(); itor != m_stream_cont.end(); ++itor) {
-        *(*itor) << func;
-      }
+  inline OStream & OStream::write(const char * s, std::streamsize n) {
+    // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter,
+    // and some destination accepts the message.
+    if (isAccepted()) forward(s, n, m_message_type, m_chat_level);
+    return *this;
+  }
+
+  template <int NumPlaceholders, typename... Args>
+  inline OStream & OStream::format(const FormatString<NumPlaceholders> & fmt, const Args &... args) {
+    static_assert(NumPlaceholders == sizeof...(Args), "st_stream: number of arguments does not match format string");
+    if (isAccepted()) {
+      // Render the whole message once, then send it to all destinations. The extra argument avoids an empty array.
+      const FormatArg arg[] = { FormatArg(args)..., FormatArg(false) };
+      MessageBuffer buf;
+      FormatArg::format(buf.get(), fmt.c_str(), arg, sizeof...(Args));
+      forward(buf.get().data(), buf.get().size(), m_message_type, m_chat_level);
     }
     return *this;
   }
 
-  inline OStream & OStream::operator <<(std::ios & (*func)(std::ios &)) {
-    // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter.
-    if (m_enabled) {
-      // Iterate over std::ostreams, shifting object to each in turn.
-      for (StdStreamCont_t::iterator itor = m_std_stream_cont.begin(); itor != m_std_stream_cont.end(); ++itor) {
-        *(*itor) << func;
-      }
-      // Iterate over OStreams, shifting object to each in turn.
-      for (OStreamCont_t::iterator itor = m_stream_cont.begin(); itor != m_stream_cont.end(); ++itor) {
-        *(*itor) << func;
-      }
+  template <typename T>
+  inline OStream & OStream::writeArray(const T * data, std::size_t size, const ArrayFormat & format) {
+    if (isAccepted()) {
+      MessageBuffer buf;
+      FormatArray(buf.get(), data, size, format);
+      forward(buf.get().data(), buf.get().size(), m_message_type, m_chat_level);
     }
     return *this;
   }
 
-  inline OStream & OStream::operator <<(std::ios_base & (*func)(std::ios_base &)) {
-    // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter.
-    if (m_enabled) {
-      // Iterate over std::ostreams, shifting object to each in turn.
-      for (StdStreamCont_t::iterator itor = m_std_stream_cont.begin(); itor != m_std_stream_cont.end(); ++itor) {
-        *(*itor) << func;
-      }
-      // Iterate over OStreams, shifting object to each in turn.
-      for (OStreamCont_t::iterator itor = m_stream_cont.begin(); itor != m_stream_cont.end(); ++itor) {
-        *(*itor) << func;
-      }
+  template <int NumPlaceholders, typename... Args>
+  inline OStream & OStream::defer(const FormatString<NumPlaceholders> & fmt, const Args &... args) {
+    static_assert(NumPlaceholders == sizeof...(Args), "st_stream: number of arguments does not match format string");
+    if (isAccepted()) {
+      const FormatArg arg[] = { FormatArg(args)..., FormatArg(false) };
+      deferFormat(fmt.c_str(), arg, sizeof...(Args));
     }
     return *this;
   }
 
+  inline OStream & OStream::operator <<(std::ostream & (*func)(std::ostream &)) {
+    ST_STREAM_TRACE2(message_end, int(m_message_type), m_chat_level);
+    // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter,
+    // and some destination accepts the message. The manipulator belongs to the message it ends.
+    if (isAccepted()) forward(func, m_message_type, m_chat_level);
+    endMessage();
+    return *this;
+  }
+
+  inline OStream & OStream::operator <<(std::ios & (*func)(std::ios &)) {
+    // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter,
+    // and some destination accepts the message.
+    if (isAccepted()) forward(func, m_message_type, m_chat_level);
+    return *this;
+  }
+
+  inline OStream & OStream::operator <<(std::ios_base & (*func)(std::ios_base &)) {
+    // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter,
+    // and some destination accepts the message.
+    if (isAccepted()) forward(func, m_message_type, m_chat_level);
+    return *this;
+  }
+
   inline OStream & OStream::operator <<(OStream & (*func)(OStream &)) { return func(*this); }
 
   template <typename T, typename Stream_t>
   inline T OStream::getStreamState(T (Stream_t::*stdMethod)() const, T (OStream::*method)() const) const {
     T orig = T();
+    if (0 == m_sinks) return orig;
     // First try getting the information from the first std::stream object which is referred to by this stream.
-    if (!m_std_stream_cont.empty()) orig = ((*m_std_stream_cont.begin())->*stdMethod)();
+    if (!m_sinks->m_std_stream_cont.empty()) orig = (m_sinks->m_std_stream_cont.begin()->first->*stdMethod)();
     // First try getting the information from the first OStream object which is referred to by this stream.
-    else if (!m_stream_cont.empty()) orig = ((*m_stream_cont.begin())->*method)();
+    else if (!m_sinks->m_stream_cont.empty()) orig = (m_sinks->m_stream_cont.begin()->first->*method)();
     return orig;
   }
 
@@ -333,19 +773,36 @@ namespace st_stream {
     T orig = (this->*getMethod)();
 
     // Only modify destination streams if message chatter is less than or equal to maximum user/client chatter.
-    if (m_enabled) {
+    if (0 != m_sinks && isEnabled()) {
       // Call stdMethod for each std::ostream object.
-      for (StdStreamCont_t::iterator itor = m_std_stream_cont.begin(); itor != m_std_stream_cont.end(); ++itor)
-        ((*itor)->*stdMethod)(arg);
+      for (StdStreamCont_t::iterator itor = m_sinks->m_std_stream_cont.begin();
+        itor != m_sinks->m_std_stream_cont.end(); ++itor)
+        (itor->first->*stdMethod)(arg);
 
       // Call method for each OStream object.
-      for (OStreamCont_t::iterator itor = m_stream_cont.begin(); itor != m_stream_cont.end(); ++itor)
-        ((*itor)->*method)(arg);
+      for (OStreamCont_t::iterator itor = m_sinks->m_stream_cont.begin(); itor != m_sinks->m_stream_cont.end(); ++itor)
+        (itor->first->*method)(arg);
     }
 
     return orig;
   }
 
+  /** \brief Return the component (see OStream::setComponent) of the message which the calling thread is writing
+             to a destination stream, or an empty string if the message has none. A destination may call this from
+             its stream buffer's methods to learn where the text it receives came from.
+  */
+  const std::string & GetMessageComponent();
+
+  /** \brief Return the type of the message which the calling thread is writing to a destination stream, or
+             eNumMessageTypes if it is not writing one, e.g. because the destination was written to directly.
+  */
+  MessageType GetMessageType();
+
+  /** \brief Return the chat level of the message which the calling thread is writing to a destination stream, or 0
+             if it is not writing one.
+  */
+  unsigned int GetMessageChatLevel();
+
   /** \brief Error stream, parallel to std::cerr. This stream has the highest possible maximum chatter, so all
              output sent directly to it will be displayed. This stream has no prefix.
   */
@@ -7,6 +7,8 @@
 
 #include <string>
 
+#include "st_stream/Context.h"
+#include "st_stream/Sampler.h"
 #include "st_stream/Stream.h"
 
 namespace st_stream {
@@ -33,12 +35,16 @@ namespace st_stream {
 
       virtual ~StreamFormatter() throw();
 
+      /** \brief Return the name of the class.
+      */
+      const std::string & getClassName() const;
+
       /** \brief Return the name of the method.
       */
       const std::string & getMethod() const;
 
       /** \brief Set the name of the method. This is used in combination with the class name to set the
-                 prefix.
+                 prefix. To describe nested work without replacing the method name, use ContextGuard instead.
           \param method_name The new value for the method name.
       */
       void setMethod(const std::string & method_name);
@@ -56,7 +62,8 @@ namespace st_stream {
       /** \brief Return a stream which is set up for unsuppressible error messages.
 
                  Output to this stream will be sent to sterr, regardless of any chatter levels. The output will
-                 be preceded by the error prefix.
+                 be preceded by the error prefix. If backtraces are enabled (see SetErrorBacktraces), the prefix of
+                 the message also carries the number of its backtrace, e.g. "(backtrace 3) ".
       */
       OStream & err();
 
@@ -79,6 +86,21 @@ namespace st_stream {
       */
       OStream & info(unsigned int chat_level);
 
+      /** \brief Return a stream which is set up for suppressible discretionary output, like info(), but which forwards
+                 only a sample of the messages written to it, as selected by the given sampler. The prefix of each
+                 message which is forwarded includes the sampling rate.
+          \param sampler The sampler, normally a static object declared where the message is written.
+      */
+      OStream & info(Sampler & sampler);
+
+      /** \brief Return a stream which is set up for suppressible discretionary output, like info(unsigned int), but
+                 which forwards only a sample of the messages written to it, as selected by the given sampler. The
+                 prefix of each message which is forwarded includes the sampling rate.
+          \param chat_level The chat level. The default chat level will be unaffected.
+          \param sampler The sampler, normally a static object declared where the message is written.
+      */
+      OStream & info(unsigned int chat_level, Sampler & sampler);
+
       /** \brief Return a stream which is set up for unsuppressible output messages.
 
                  Output to this stream will be sent to stout, regardless of any chatter levels. The output
@@ -105,7 +127,8 @@ namespace st_stream {
       OStream & warn(unsigned int chat_level);
 
       /** \brief Explicitly turn debugging on or off. Warning: this is for temporary use by developers while
-                 actively debugging, and should not be checked in or used in production code.
+                 actively debugging, and should not be checked in or used in production code. Any later change to
+                 global settings (e.g. SetDebugMode, ApplyControlFile) replaces this setting.
           \param debug_mode The new setting for the debug mode.
       */
       void setDebugMode(bool debug_mode = true);
@@ -132,6 +155,35 @@ namespace st_stream {
         const std::string & method_name, const std::string & message_type);
 
     private:
+      /** \brief Adopt any changes to global settings (debug mode, maximum chatter for this component) made since
+                 they were last checked. This is cheap when there are no changes.
+      */
+      void refresh();
+
+      /** \brief Rebuild the prefixes if the calling thread's context stack changed since they were last built.
+                 Called only when a message may be displayed.
+      */
+      void refreshContext();
+
+      /** \brief Append the method name followed by the names on the context stack, separated by '>', to the
+                 given string.
+          \param method_name The string.
+      */
+      void appendContextMethod(std::string & method_name) const;
+
+      /** \brief Set the chat level of one of this object's streams, respecting any maximum chatter set for this
+                 component, and return the stream.
+          \param os The stream.
+          \param chat_level The chat level.
+      */
+      OStream & setChatLevel(OStream & os, unsigned int chat_level);
+
+      /** \brief Return whether a message with the given chat level would be displayed, respecting any maximum chatter
+                 set for this component.
+          \param chat_level The chat level.
+      */
+      bool isDisplayed(unsigned int chat_level) const;
+
       std::string m_class_name;
       std::string m_method_name;
       OStream m_debug_stream;
@@ -139,8 +191,18 @@ namespace st_stream {
       OStream m_info_stream;
       OStream m_out_stream;
       OStream m_warn_stream;
+      OStream m_sampled_stream;
+      std::string m_prefix_method;
+      std::string m_err_prefix;
+      const ContextStack * m_context_stack;
+      unsigned long long m_context_id;
+      unsigned long m_config_generation;
+      unsigned int m_sampled_rate;
       unsigned int m_default_chat_level;
+      unsigned int m_component_chat;
       bool m_debug_mode;
+      bool m_use_component_chat;
+      bool m_err_tagged;
   };
 
 }
@@ -0,0 +1,95 @@
+/** \file TableWriter.h
+    \brief Declaration of TableWriter class, which writes fixed-width tables one row at a time.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_TableWriter_h
+#define st_stream_TableWriter_h
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "st_stream/Format.h"
+
+namespace st_stream {
+
+  class OStream;
+
+  /** \class TableWriter
+      \brief Helper which writes a table with fixed-width columns to an OStream. The columns are described once,
+             then each row is rendered into a buffer and written with a single unformatted write, without
+             changing the width, precision or flags of the stream between cells, e.g.:
+
+             TableWriter table(formatter.out());
+             table.addColumn("Band", 8, '<').addColumn("Counts", 10).addColumn("Rate", 12, '>', 4, 'f');
+             table.writeHeader();
+             table.writeRow("soft", 1234, 5.6789);
+
+             Cells are rendered as OStream::format renders placeholders, so any argument format accepts may be
+             used as a value.
+  */
+  class TableWriter {
+    public:
+      /** \brief Create a table with no columns.
+          \param os The stream to which rows are written.
+          \param separator The text written between cells.
+      */
+      explicit TableWriter(OStream & os, const std::string & separator = " ");
+
+      /** \brief Add a column to the right of any existing ones.
+          \param name The name, shown in the header. The column is widened if necessary to fit the name, which
+                 is aligned like the values, or to the right if the alignment is not given but the type is.
+          \param width The minimum width of each cell.
+          \param align The alignment of each cell: '<' (left), '>' (right) or '^' (centered). By default numbers
+                 are right-aligned and other values left-aligned.
+          \param precision The precision of floating point values, or the maximum length of strings. By
+                 default it is 6 for floating point values, and strings are not truncated.
+          \param type The presentation of values, as in a format string placeholder, e.g. 'f' or 'x'.
+      */
+      TableWriter & addColumn(const std::string & name, std::size_t width, char align = '\0', int precision = -1,
+        char type = '\0');
+
+      /** \brief Write a row showing the column names, followed by a row of dashes under each column.
+      */
+      void writeHeader();
+
+      /** \brief Write one row.
+          \param args The values of the cells, one per column; throws std::logic_error if their number does
+                 not match the number of columns.
+      */
+      template <typename... Args>
+      void writeRow(const Args &... args) {
+        // The extra argument avoids an empty array.
+        const FormatArg arg[] = { FormatArg(args)..., FormatArg(false) };
+        writeRow(arg, sizeof...(Args));
+      }
+
+      /** \brief Write one row.
+          \param arg The values of the cells.
+          \param num_args The number of values, which must match the number of columns.
+      */
+      void writeRow(const FormatArg * arg, std::size_t num_args);
+
+      /** \brief Return the number of columns.
+      */
+      std::size_t getNumColumns() const { return m_column.size(); }
+
+    private:
+      struct Column {
+        std::string m_name;
+        std::string m_spec;
+        std::string m_header_spec;
+        std::size_t m_width;
+      };
+
+      void write();
+
+      OStream & m_os;
+      std::string m_separator;
+      std::vector<Column> m_column;
+      std::string m_buf;
+  };
+
+}
+
+#endif
@@ -0,0 +1,42 @@
+/** \file ThreadStage.h
+    \brief Declarations of per-thread output staging, which lets many threads write through StreamFormatter
+           objects without contending for the global streams.
+    \author James Peachey, HEASARC/GSSC
+*/
+#ifndef st_stream_ThreadStage_h
+#define st_stream_ThreadStage_h
+
+#include <ostream>
+
+#include "st_stream/Stream.h"
+
+namespace st_stream {
+
+  /** \func GetThreadStage
+      \brief Return a stream private to the calling thread, which collects complete lines of output destined for
+             the given stream.
+
+             Each complete line is given a sequence number and kept in the calling thread's staging area. Lines
+             from all threads are forwarded to their destinations together, in order of sequence number, whenever
+             any thread has staged enough output, whenever an error message (see GetMessageType) is completed, when
+             a thread exits, and when FlushThreadStages is called. Each line is forwarded with the type, chat
+             level and component of the message it completed, so destination filters and indexes treat it as if
+             it had not been staged. The returned stream must only be used by the calling thread, and the
+             destination must outlive any output staged for it.
+
+             StreamFormatter objects created while thread staging is enabled (see SetThreadStaging) connect their
+             streams to the creating thread's stages for sterr, stlog and stout, so each such formatter must only
+             be used by the thread which created it.
+      \param dest The destination for lines written to the returned stream.
+  */
+  std::ostream & GetThreadStage(OStream & dest);
+
+  /** \func FlushThreadStages
+      \brief Forward all complete lines staged by all threads to their destinations, in the order in which they
+             were completed, and flush the destinations.
+  */
+  void FlushThreadStages();
+
+}
+
+#endif
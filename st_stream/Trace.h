@@ -0,0 +1,45 @@
+/** \file Trace.h
+    \brief Static tracepoints in the message path, so the cost of logging in a running program can be measured with
+           perf or bpftrace without rebuilding it.
+    \author James Peachey, HEASARC/GSSC
+
+    The tracepoints are USDT probes in the provider "st_stream". They are compiled in wherever <sys/sdt.h> (from
+    systemtap-sdt-dev) is available, unless ST_STREAM_NO_TRACE is defined. A probe is a single no-op instruction
+    until a tracer attaches to it. Where the header is missing, the macros expand to nothing and their arguments
+    are not evaluated. The probes and their arguments are:
+
+    - suppressed(type, chat_level): a write to an OStream was discarded, because of its chatter or because no
+      destination accepts messages of its type.
+    - message_begin(type, chat_level): a message began with its prefix (OStream::prefix), whether or not it is
+      displayed.
+    - message_end(type, chat_level): a manipulator such as std::endl was shifted to an OStream, whether or not it
+      is displayed.
+    - sink_write(type, chat_level, bytes): text was written to one std::ostream destination. bytes is -1 for an
+      object or manipulator shifted into the destination with operator <<, whose length is not known.
+    - chatter(class_name, chat_level, displayed): a StreamFormatter decided whether a message of the given chatter
+      is displayed. class_name is a C string.
+
+    For example, to count the bytes written per message type:
+\verbatim
+    bpftrace -e 'usdt:./my_tool:st_stream:sink_write /arg2 >= 0/ { @bytes[arg0] = sum(arg2); }' -p PID
+\endverbatim
+*/
+#ifndef st_stream_Trace_h
+#define st_stream_Trace_h
+
+#if !defined(ST_STREAM_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define ST_STREAM_HAS_TRACE 1
+#endif
+#endif
+
+#ifdef ST_STREAM_HAS_TRACE
+#define ST_STREAM_TRACE2(name, arg1, arg2) DTRACE_PROBE2(st_stream, name, arg1, arg2)
+#define ST_STREAM_TRACE3(name, arg1, arg2, arg3) DTRACE_PROBE3(st_stream, name, arg1, arg2, arg3)
+#else
+#define ST_STREAM_TRACE2(name, arg1, arg2) do {} while (false)
+#define ST_STREAM_TRACE3(name, arg1, arg2, arg3) do {} while (false)
+#endif
+
+#endif
@@ -5,6 +5,7 @@
 #ifndef st_stream_st_stream_h
 #define st_stream_st_stream_h
 
+#include <map>
 #include <string>
 
 #include "st_stream/Stream.h"
@@ -16,8 +17,17 @@ namespace st_stream {
       \param exec_name The name of the current executable. Used by formatted streams to create prefix used for each line of output.
       \param max_chat The maximum chatter level. Messages with a chatter level higher than this will not be displayed.
       \param debug_mode Flag indicating whether debugging should be enabled.
+      \param options Bitwise or of StdStreamOption values, e.g. eCaptureStdStreams.
+
+      This also makes output safe across fork(2): output buffered by st_stream is written before the process forks,
+      so it is not copied into the child, and the child restarts the background threads it needs.
   */
-  void InitStdStreams(const std::string & exec_name, unsigned int max_chat, bool debug_mode);
+  void InitStdStreams(const std::string & exec_name, unsigned int max_chat, bool debug_mode, unsigned int options = 0);
+
+  /// \func GetComponentChatter
+  /// \brief Get the maximum chatter set for one component (class name) by SetComponentChatter. Return false
+  ///        if none was set, in which case the global maximum chatter applies.
+  bool GetComponentChatter(const std::string & class_name, unsigned int & max_chat);
 
   /// \func GetDebugMode
   /// \brief Return the setting of the global debug state flag.
@@ -27,22 +37,113 @@ namespace st_stream {
   /// \brief Return the name of the current executable.
   const std::string & GetExecName();
 
+  /// \func GetDisplayName
+  /// \brief Return the name of the current executable as it appears in prefixes: the name, followed by the process
+  ///        id in brackets if SetShowProcessId is in effect, e.g. "gtbin[1234]".
+  std::string GetDisplayName();
+
+  /// \func GetShowProcessId
+  /// \brief Return whether prefixes include the process id.
+  bool GetShowProcessId();
+
+  /// \func GetThreadStaging
+  /// \brief Return the setting of the global thread staging flag.
+  bool GetThreadStaging();
+
   /// \func GetMaximumChatter
   /// \brief Return the maximum chatter which should be displayed.
   unsigned int GetMaximumChatter();
 
+  /// \func ClearComponentChatter
+  /// \brief Remove the maximum chatter set for all components by SetComponentChatter.
+  void ClearComponentChatter();
+
+  /// \func SetComponentChatter
+  /// \brief Set the maximum chatter for messages from StreamFormatter objects with the given class name,
+  ///        in place of the global maximum chatter.
+  void SetComponentChatter(const std::string & class_name, unsigned int max_chat);
+
+  /// \func ReplaceComponentChatter
+  /// \brief Replace the maximum chatter set for all components with the given maximum chatter for each class name,
+  ///        in one step, so that no StreamFormatter sees some components' settings removed but not yet replaced.
+  void ReplaceComponentChatter(const std::map<std::string, unsigned int> & component_chat);
+
   /// \func SetDebugMode
-  /// \brief Set state of the global debug state flag.
+  /// \brief Set state of the global debug state flag. Existing StreamFormatter objects adopt the new
+  ///        setting the next time they are used.
   void SetDebugMode(bool debug_mode = true);
 
   /// \func SetExecName
   /// \brief Set the name of the current executable.
   void SetExecName(const std::string & exec_name);
 
+  /// \func SetShowProcessId
+  /// \brief Set whether prefixes include the process id after the executable name, so the output of worker
+  ///        processes sharing a destination can be told apart. Prefixes in a child process show its own id.
+  void SetShowProcessId(bool show_process_id = true);
+
   /// \func SetMaximumChatter
   /// \brief Set the maximum chatter which should be displayed.
   void SetMaximumChatter(unsigned int max_chat);
 
+  /// \func ApplyControlFile
+  /// \brief Read settings from a control file and apply them. Each line of the file may contain one of:
+  ///        "chatter = N" (maximum chatter), "debug = true|false" (debug mode), or "chatter ClassName = N"
+  ///        (maximum chatter for one component). Blank lines and lines beginning with # are ignored.
+  ///        Component settings not mentioned in the file are removed. Return false if the file could not
+  ///        be read or contained lines which were not understood; valid lines are applied regardless.
+  /// \param file_name The name of the control file.
+  bool ApplyControlFile(const std::string & file_name);
+
+  /// \func EnableRuntimeControl
+  /// \brief Allow chatter and debug settings of a running program to be changed from outside. A background
+  ///        thread applies the given control file (see ApplyControlFile) whenever its modification time
+  ///        changes, and whenever the process receives SIGUSR1. SIGUSR2 toggles the debug mode. Changes reach
+  ///        existing streams without any locking on the message path.
+  /// \param control_file The name of the control file. May be blank, in which case only signals are handled.
+  /// \param poll_ms Interval in milliseconds at which the control file is checked.
+  void EnableRuntimeControl(const std::string & control_file, unsigned int poll_ms = 1000);
+
+  /// \func DisableRuntimeControl
+  /// \brief Stop the background thread started by EnableRuntimeControl, and restore default signal handling.
+  void DisableRuntimeControl();
+
+  /// \func SetThreadStaging
+  /// \brief Set state of the global thread staging flag. StreamFormatter objects created while this is set
+  ///        stage their output per thread rather than writing directly to sterr, stlog and stout.
+  ///        See ThreadStage.h for details.
+  void SetThreadStaging(bool thread_staging = true);
+
+  /** \class SinkLock
+      \brief Scoped lock which serializes writing to destinations shared by several threads. All output which
+             st_stream forwards from one thread to another (e.g. from thread stages) is written while holding
+             this lock. The lock is recursive.
+  */
+  class SinkLock {
+    public:
+      SinkLock();
+
+      ~SinkLock();
+
+      /** \brief Take the lock in a handler run before the process forks (see pthread_atfork), so no other thread
+                 is writing while the process is copied. The lock is released by parentFork or childFork.
+      */
+      static void prepareFork();
+
+      /** \brief Release the lock taken by prepareFork, in the parent process.
+      */
+      static void parentFork();
+
+      /** \brief Release the lock taken by prepareFork, in the child process. The forking thread has a new id in
+                 the child, so it cannot release the lock it holds; the lock is replaced by an unlocked one instead.
+      */
+      static void childFork();
+
+    private:
+      SinkLock(const SinkLock &);
+      SinkLock & operator =(const SinkLock &);
+  };
+
 }
 
 #endif
@@ -1,7 +1,11 @@
 #$Id: st_streamLib.py,v 1.2 2008/02/22 00:53:50 golpa Exp $
+import sys
 def generate(env, **kw):
 	if not kw.get('depsOnly',0):
 		env.Tool('addLibrary', library = ['st_stream'])
+	env.Tool('addLibrary', library = ['z', 'pthread'])
+	if sys.platform.startswith('linux'):
+		env.Tool('addLibrary', library = ['rt', 'dl'])
 
 def exists(env):
 	return 1